@@ -2,7 +2,7 @@ from contextlib import closing
 from itertools import islice
 from os import cpu_count
 from sys import argv
-from snakefish import Generator
+from snakefish import Generator, select
 import math
 
 def pixels(y, n, abs):
@@ -67,17 +67,14 @@ def compute_rows(n, f):
 
     unordered_rows = []
     while len(generators) != 0:
-        for i in range(len(generators)):
+        for g in select(generators):
             try:
-                unordered_rows.append(generators[i].next(False))
-            except IndexError:
-                pass
+                unordered_rows.append(g.next(False))
             except StopIteration:
-                generators[i].join()
-                assert (generators[i].get_exit_status() == 0)
-                generators[i].dispose()
-                generators.pop(i)
-                break
+                g.join()
+                assert (g.get_exit_status() == 0)
+                g.dispose()
+                generators.remove(g)
     yield from ordered_rows(iter(unordered_rows), n)
 
 def mandelbrot(n):
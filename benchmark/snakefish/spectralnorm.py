@@ -28,11 +28,13 @@ def multiply_AtAv(u):
 
     tmp = snakefish.starmap(
         A_sum,
-        zip(repeat(u), r)
+        zip(repeat(u), r),
+        columnar=True
     )
     return snakefish.starmap(
         At_sum,
-        zip(repeat(tmp), r)
+        zip(repeat(tmp), r),
+        columnar=True
     )
 
 
@@ -0,0 +1,189 @@
+/**
+ * \file atomic_array.h
+ */
+
+#ifndef SNAKEFISH_ATOMIC_ARRAY_H
+#define SNAKEFISH_ATOMIC_ARRAY_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+#include "util.h"
+
+namespace snakefish {
+
+/**
+ * \brief A fixed-size array of atomic numbers in shared memory.
+ *
+ * The array is allocated when it's created, so an array created before a
+ * `thread` or `generator` is started is shared with it. Every cell can be
+ * updated from any process without a lock, e.g. for progress counters or
+ * histograms, and nothing has to be merged at the end.
+ *
+ * `T` is `int64_t` or `double`. Additions to `double` cells are done with a
+ * compare-and-swap loop, since there's no atomic floating point addition.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when an array is no
+ * longer needed to release resources.
+ */
+template <typename T> class atomic_array {
+public:
+  /**
+   * \brief No default constructor.
+   */
+  atomic_array() = delete;
+
+  /**
+   * \brief Default destructor.
+   */
+  ~atomic_array() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  atomic_array(const atomic_array &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  atomic_array &operator=(const atomic_array &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  atomic_array(atomic_array &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  atomic_array &operator=(atomic_array &&t) = delete;
+
+  /**
+   * \brief Create an array of `len` cells, all 0.
+   *
+   * \throws std::invalid_argument If `len` is 0.
+   */
+  explicit atomic_array(const size_t len) : cells(nullptr), len(len) {
+    if (len == 0) {
+      throw std::invalid_argument("invalid array size");
+    }
+
+    cells = static_cast<std::atomic<T> *>(
+        util::get_shared_mem(len * sizeof(std::atomic<T>), true));
+    for (size_t i = 0; i < len; i++)
+      cells[i].store(0);
+
+    // ensure that shared atomic variables are lock free
+    if (!cells[0].is_lock_free()) {
+      fprintf(stderr, "std::atomic<T> is not lock free!\n");
+      abort();
+    }
+  }
+
+  /**
+   * \brief Get the value of cell `i`.
+   *
+   * \throws std::out_of_range If `i` is out of range.
+   */
+  T load(const size_t i = 0) { return cell(i).load(); }
+
+  /**
+   * \brief Set the value of cell `i`.
+   *
+   * \throws std::out_of_range If `i` is out of range.
+   */
+  void store(const T val, const size_t i = 0) { cell(i).store(val); }
+
+  /**
+   * \brief Add `val` to cell `i`.
+   *
+   * \returns The previous value of the cell.
+   *
+   * \throws std::out_of_range If `i` is out of range.
+   */
+  T fetch_add(const T val, const size_t i = 0);
+
+  /**
+   * \brief Set cell `i` to `desired` if its value is `expected`.
+   *
+   * \returns `true` if the cell was set.
+   *
+   * \throws std::out_of_range If `i` is out of range.
+   */
+  bool compare_exchange(T expected, const T desired, const size_t i = 0) {
+    return cell(i).compare_exchange_strong(expected, desired);
+  }
+
+  /**
+   * \brief Get the values of all cells.
+   *
+   * Each value is read atomically, but not all of them at once.
+   */
+  std::vector<T> to_list() {
+    std::vector<T> vals(len);
+    for (size_t i = 0; i < len; i++)
+      vals[i] = cells[i].load();
+    return vals;
+  }
+
+  /**
+   * \brief Get the number of cells.
+   */
+  size_t get_len() { return len; }
+
+  /**
+   * \brief Release resources held by this array.
+   */
+  void dispose() {
+    if (munmap(cells, len * sizeof(std::atomic<T>))) {
+      perror("munmap() failed");
+      abort();
+    }
+  }
+
+protected:
+  /**
+   * \brief Get cell `i`.
+   *
+   * \throws std::out_of_range If `i` is out of range.
+   */
+  std::atomic<T> &cell(const size_t i) {
+    if (i >= len) {
+      throw std::out_of_range("index out of range");
+    }
+    return cells[i];
+  }
+
+  /**
+   * \brief The cells.
+   */
+  std::atomic<T> *cells;
+
+  /**
+   * \brief Number of cells.
+   */
+  size_t len;
+};
+
+template <typename T>
+inline T atomic_array<T>::fetch_add(const T val, const size_t i) {
+  return cell(i).fetch_add(val);
+}
+
+template <>
+inline double atomic_array<double>::fetch_add(const double val,
+                                              const size_t i) {
+  std::atomic<double> &c = cell(i);
+  double old = c.load(std::memory_order_relaxed);
+  while (!c.compare_exchange_weak(old, old + val))
+    ;
+  return old;
+}
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_ATOMIC_ARRAY_H
@@ -0,0 +1,288 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#include "broadcast_channel.h"
+#include "util.h"
+
+namespace snakefish {
+
+broadcast_channel::broadcast_channel(const size_t n_receivers, size_t size)
+    : header(static_cast<broadcast_header *>(
+          util::get_shared_mem(sizeof(broadcast_header), true))),
+      n_receivers(n_receivers), space_freed(0, &header->space_freed),
+      pickle(get_pickle_funcs()), tail(0), max_spins(0), spin_budget(0) {
+  if (n_receivers == 0) {
+    throw std::invalid_argument("invalid number of receivers");
+  }
+  if (size == 0) {
+    throw std::invalid_argument("invalid channel buffer size");
+  }
+
+  // the buffer is mirrored so that a message never has to be split, which
+  // only works in whole pages
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size = (size + page_size - 1) / page_size * page_size;
+  capacity = size;
+
+  // create shared memory and relevant metadata variables
+  shared_fd = util::get_shared_fd(size);
+  shared_mem = util::reserve_mem(2 * size);
+  util::map_shared_fd(shared_mem, size, shared_fd);
+  util::map_shared_fd(static_cast<char *>(shared_mem) + size, size, shared_fd);
+  cursors = static_cast<broadcast_cursor *>(
+      util::get_shared_mem(n_receivers * sizeof(broadcast_cursor), true));
+
+  // initialize metadata
+  msg_published.reserve(n_receivers);
+  for (size_t i = 0; i < n_receivers; i++) {
+    cursors[i].pos.store(0);
+    cursors[i].waiting.store(false);
+    msg_published.emplace_back(0, &cursors[i].msg_published);
+  }
+  header->write_pos.store(0);
+  header->receivers_waiting.store(0);
+  header->sender_waiting.store(false);
+
+  // ensure that shared atomic variables are lock free
+  if (!header->write_pos.is_lock_free()) {
+    fprintf(stderr, "std::atomic_size_t is not lock free!\n");
+    abort();
+  }
+}
+
+void broadcast_channel::set_spin(const unsigned max_spins) {
+  this->max_spins = max_spins;
+  spin_budget = max_spins;
+  for (semaphore_t &sem : msg_published)
+    sem.set_spin(max_spins);
+  space_freed.set_spin(max_spins);
+}
+
+size_t broadcast_channel::min_cursor() {
+  size_t min_pos = header->write_pos.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < n_receivers; i++) {
+    size_t pos = cursors[i].pos.load(std::memory_order_acquire);
+    min_pos = std::min(min_pos, pos);
+  }
+  return min_pos;
+}
+
+bool broadcast_channel::wait_for_space(const size_t pos, const size_t n,
+                                       const bool block,
+                                       const double timeout) {
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::duration<double>(std::max(timeout, 0.0));
+  while (true) {
+    tail = min_cursor();
+    if (pos + n - tail <= capacity)
+      return true;
+
+    // the buffer is full
+    if (!block)
+      return false;
+    double remaining = -1;
+    if (timeout >= 0) {
+      remaining = std::chrono::duration<double>(
+                      deadline - std::chrono::steady_clock::now())
+                      .count();
+      if (remaining <= 0)
+        return false;
+    }
+
+    // the slowest receiver may be about to move on
+    size_t old_tail = tail;
+    if (util::spin_until(
+            [this, old_tail]() { return min_cursor() != old_tail; },
+            max_spins, spin_budget))
+      continue;
+
+    // announce that we are going to sleep, then check again in case some
+    // receiver moved on before it could see the announcement
+    // stale posts only cause spurious wakeups, which are handled by the loop
+    header->sender_waiting.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (min_cursor() != old_tail) {
+      header->sender_waiting.store(false);
+      continue;
+    }
+    if (!space_freed.timedwait(remaining))
+      return false;
+  }
+}
+
+void broadcast_channel::send_bytes(const void *bytes, const size_t len,
+                                   const bool block, const double timeout) {
+  size_t n = msg_size(len);
+  if (n > capacity) {
+    throw std::overflow_error("channel buffer is full");
+  }
+
+  // tail is only refreshed when the message doesn't seem to fit, so the
+  // cursors are rarely scanned
+  size_t pos = header->write_pos.load(std::memory_order_relaxed);
+  if (pos + n - tail > capacity && !wait_for_space(pos, n, block, timeout)) {
+    throw std::overflow_error("channel buffer is full");
+  }
+
+  // the buffer is mirrored, so the message is contiguous
+  char *dst = at(pos);
+  memcpy(dst, &len, sizeof(size_t));
+  memcpy(dst + sizeof(size_t), bytes, len);
+  header->write_pos.store(pos + n, std::memory_order_release);
+  notify_receivers();
+}
+
+void broadcast_channel::notify_receivers() {
+  // the fence pairs with the one in claim_msg() so that either the receiver
+  // sees the new write_pos or this sees its waiting flag
+  // the cursors are only scanned when some receiver is (about to be) sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (header->receivers_waiting.load(std::memory_order_relaxed) == 0)
+    return;
+  for (size_t i = 0; i < n_receivers; i++) {
+    if (cursors[i].waiting.load(std::memory_order_relaxed) &&
+        cursors[i].waiting.exchange(false)) {
+      header->receivers_waiting.fetch_sub(1);
+      msg_published[i].post();
+    }
+  }
+}
+
+void broadcast_channel::send_pyobj(const py::object &obj, const bool block,
+                                   const double timeout) {
+  // serialize
+  py::bytes bytes = pickle.dumps(obj, pickle.protocol);
+  char *bytes_ptr = PyBytes_AsString(bytes.ptr());
+  if (bytes_ptr == nullptr) {
+    throw std::runtime_error("failed to get the bytes");
+  }
+  size_t len = PyBytes_Size(bytes.ptr());
+
+  // send
+  send_bytes(bytes_ptr, len, block, timeout);
+}
+
+size_t broadcast_channel::claim_msg(const size_t receiver, const bool block,
+                                    size_t &len) {
+  size_t pos = cursor_of(receiver).load(std::memory_order_relaxed);
+  while (header->write_pos.load(std::memory_order_acquire) == pos) {
+    if (!block) {
+      throw std::out_of_range("out-of-bounds read detected");
+    }
+
+    // the sender may be about to publish something
+    if (util::spin_until(
+            [this, pos]() {
+              return header->write_pos.load(std::memory_order_acquire) != pos;
+            },
+            max_spins, spin_budget))
+      break;
+
+    // announce that we are going to sleep, then check again in case the
+    // sender published something before it could see the announcement
+    // whoever clears the flag accounts for it in receivers_waiting
+    // stale posts only cause spurious wakeups, which are handled by the loop
+    std::atomic_bool &waiting = cursors[receiver].waiting;
+    header->receivers_waiting.fetch_add(1);
+    waiting.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (header->write_pos.load(std::memory_order_acquire) != pos) {
+      if (waiting.exchange(false))
+        header->receivers_waiting.fetch_sub(1);
+      break;
+    }
+    msg_published[receiver].wait();
+  }
+
+  memcpy(&len, at(pos), sizeof(size_t));
+  return pos;
+}
+
+void broadcast_channel::release_msg(const size_t receiver, const size_t pos,
+                                    const size_t len) {
+  cursors[receiver].pos.store(pos + msg_size(len), std::memory_order_release);
+
+  // the fence pairs with the one in wait_for_space() so that either the
+  // sender sees the new cursor or this sees sender_waiting
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (header->sender_waiting.load(std::memory_order_relaxed) &&
+      header->sender_waiting.exchange(false)) {
+    space_freed.post();
+  }
+}
+
+buffer broadcast_channel::receive_bytes(const size_t receiver,
+                                        const bool block) {
+  size_t len = 0;
+  size_t pos = claim_msg(receiver, block, len);
+
+  try {
+    buffer buf = buffer(len, buffer_type::MALLOC);
+    memcpy(buf.get_ptr(), at(pos) + sizeof(size_t), len);
+    release_msg(receiver, pos, len);
+    return buf;
+  } catch (...) {
+    release_msg(receiver, pos, len);
+    throw;
+  }
+}
+
+py::object broadcast_channel::receive_pyobj(const size_t receiver,
+                                            const bool block) {
+  size_t len = 0;
+  size_t pos = claim_msg(receiver, block, len);
+
+  // the sender doesn't overwrite the message until every receiver has moved
+  // past it, so it can be deserialized in place
+  try {
+    py::object mem_view = py::reinterpret_steal<py::object>(
+        PyMemoryView_FromMemory(at(pos) + sizeof(size_t), len, PyBUF_READ));
+    py::object obj = pickle.loads(mem_view);
+    release_msg(receiver, pos, len);
+    return obj;
+  } catch (...) {
+    release_msg(receiver, pos, len);
+    throw;
+  }
+}
+
+void broadcast_channel::dispose() {
+  if (munmap(shared_mem, 2 * capacity)) {
+    perror("munmap() failed");
+    abort();
+  }
+  if (close(shared_fd)) {
+    perror("close() failed");
+    abort();
+  }
+  for (semaphore_t &sem : msg_published) {
+    try {
+      sem.destroy();
+    } catch (...) {
+      abort();
+    }
+  }
+  try {
+    space_freed.destroy();
+  } catch (...) {
+    abort();
+  }
+  if (munmap(cursors, n_receivers * sizeof(broadcast_cursor))) {
+    perror("munmap() failed");
+    abort();
+  }
+  if (munmap(header, sizeof(broadcast_header))) {
+    perror("munmap() failed");
+    abort();
+  }
+}
+
+} // namespace snakefish
@@ -0,0 +1,345 @@
+/**
+ * \file broadcast_channel.h
+ */
+
+#ifndef SNAKEFISH_BROADCAST_CHANNEL_H
+#define SNAKEFISH_BROADCAST_CHANNEL_H
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "buffer.h"
+#include "channel.h"
+#include "semaphore_t.h"
+
+namespace snakefish {
+
+/**
+ * \brief The default `broadcast_channel` buffer size.
+ */
+const size_t DEFAULT_BROADCAST_CHANNEL_SIZE = 16 * 1024 * 1024; // 16 MiB
+
+/**
+ * \brief The read position of one receiver of a `broadcast_channel`, and what
+ * it needs to sleep.
+ *
+ * Each cursor has a cache line of its own, since it is written by a single
+ * receiver. Receivers wait for different messages, so each needs its own
+ * semaphore.
+ */
+struct alignas(CACHE_LINE_SIZE) broadcast_cursor {
+  std::atomic_size_t pos;
+  std::atomic_bool waiting;
+  sem_t msg_published;
+};
+
+/**
+ * \brief The shared state of `broadcast_channel`.
+ */
+struct broadcast_header {
+  // written by the sender
+  alignas(CACHE_LINE_SIZE) std::atomic_size_t write_pos;
+
+  // only touched when sleeping
+  alignas(CACHE_LINE_SIZE) std::atomic_size_t receivers_waiting;
+  std::atomic_bool sender_waiting;
+  sem_t space_freed;
+};
+
+/**
+ * \brief An IPC channel that delivers every message to all of a fixed set of
+ * receivers.
+ *
+ * There is a single sender. Each message is written once into the shared
+ * buffer, and every receiver reads it from there through a cursor of its own.
+ * The space taken by a message is reclaimed once the slowest receiver has
+ * moved past it, so a receiver that stops receiving eventually blocks the
+ * sender.
+ *
+ * Receivers are identified by their index, from 0 to `n_receivers - 1`. Each
+ * index must be used by a single process at a time.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when a channel is no
+ * longer needed to release resources.
+ *
+ * Characteristics of the functions:
+ * - `send_bytes()`: may or may not block^; can throw
+ * - `send_pyobj()`: may or may not block^; can throw
+ * - `receive_bytes()`: may or may not block^; can throw
+ * - `receive_pyobj()`: may or may not block^; can throw
+ *
+ * ^: the client must specify whether the function should block when there's no
+ * space to send or no incoming messages to receive
+ */
+class broadcast_channel {
+public:
+  /**
+   * \brief Create a channel with buffer size `DEFAULT_BROADCAST_CHANNEL_SIZE`.
+   */
+  explicit broadcast_channel(size_t n_receivers)
+      : broadcast_channel(n_receivers, DEFAULT_BROADCAST_CHANNEL_SIZE) {}
+
+  /**
+   * \brief Default destructor.
+   */
+  ~broadcast_channel() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  broadcast_channel(const broadcast_channel &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  broadcast_channel &operator=(const broadcast_channel &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  broadcast_channel(broadcast_channel &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  broadcast_channel &operator=(broadcast_channel &&t) = delete;
+
+  /**
+   * \brief Create a channel with buffer size `size`.
+   *
+   * \param n_receivers The number of receivers.
+   * \param size The size of the underlying shared memory buffer. It's rounded
+   * up to a multiple of the page size.
+   *
+   * \throws std::invalid_argument If `n_receivers` or `size` is 0.
+   */
+  broadcast_channel(size_t n_receivers, size_t size);
+
+  /**
+   * \brief Send some bytes to all receivers.
+   *
+   * \param bytes Pointer to the start of the bytes.
+   * \param len Number of bytes to send.
+   * \param block Should this function block until there's enough space?
+   * \param timeout Maximum number of seconds to block. If negative, there's no
+   * limit.
+   *
+   * \throws std::overflow_error If the underlying buffer does not have enough
+   * space to accommodate the request (when `block` is `true`, this means the
+   * timeout expired or the request is larger than the buffer).
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  void send_bytes(const void *bytes, size_t len, bool block = false,
+                  double timeout = -1);
+
+  /**
+   * \brief Send a Python object to all receivers.
+   *
+   * This function will serialize `obj` using `pickle` and send the binary
+   * output. The object is serialized and copied only once, however many
+   * receivers there are.
+   *
+   * \param obj The object to send.
+   * \param block Should this function block until there's enough space?
+   * \param timeout Maximum number of seconds to block. If negative, there's no
+   * limit.
+   *
+   * \throws std::overflow_error If the underlying buffer does not have enough
+   * space to accommodate the request (when `block` is `true`, this means the
+   * timeout expired or the request is larger than the buffer).
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  void send_pyobj(const py::object &obj, bool block = false,
+                  double timeout = -1);
+
+  /**
+   * \brief Receive some bytes as receiver `receiver`.
+   *
+   * \param receiver The index of the receiver.
+   * \param block Should this function block?
+   *
+   * \returns The received bytes wrapped in a `buffer`.
+   *
+   * \throws std::invalid_argument If `receiver` is not a valid index.
+   * \throws std::out_of_range If the underlying buffer does not have enough
+   * content to accommodate the request (this only applies when `block` is
+   * `false`).
+   * \throws std::runtime_error If some semaphore error occurred.
+   * \throws std::bad_alloc If `malloc()` failed.
+   */
+  buffer receive_bytes(size_t receiver, bool block);
+
+  /**
+   * \brief Receive a Python object as receiver `receiver`.
+   *
+   * This function will receive some bytes and deserialize them using `pickle`.
+   * The bytes are deserialized directly from the shared buffer.
+   *
+   * \param receiver The index of the receiver.
+   * \param block Should this function block?
+   *
+   * \throws std::invalid_argument If `receiver` is not a valid index.
+   * \throws std::out_of_range If the underlying buffer does not have enough
+   * content to accommodate the request (this only applies when `block` is
+   * `false`).
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  py::object receive_pyobj(size_t receiver, bool block);
+
+  /**
+   * \brief Check whether there's a message receiver `receiver` hasn't read.
+   *
+   * \throws std::invalid_argument If `receiver` is not a valid index.
+   */
+  bool poll(size_t receiver) {
+    return header->write_pos.load(std::memory_order_acquire) !=
+           cursor_of(receiver).load(std::memory_order_relaxed);
+  }
+
+  /**
+   * \brief Get the number of receivers.
+   */
+  size_t get_n_receivers() { return n_receivers; }
+
+  /**
+   * \brief Spin for a while before sleeping whenever this process has to
+   * wait for a message or for space. See `channel::set_spin()`.
+   */
+  void set_spin(unsigned max_spins);
+
+  /**
+   * \brief Release resources held by this channel.
+   */
+  void dispose();
+
+protected:
+  /**
+   * \brief The buffer, mapped twice back-to-back so that messages are
+   * contiguous even when they wrap around.
+   */
+  void *shared_mem;
+
+  /**
+   * \brief File descriptor of the shared memory object backing the buffer.
+   */
+  int shared_fd;
+
+  /**
+   * \brief Size of the buffer.
+   */
+  size_t capacity;
+
+  /**
+   * \brief The shared write position and wakeup flags.
+   */
+  broadcast_header *header;
+
+  /**
+   * \brief The read positions of the receivers.
+   *
+   * Like the write position, they grow monotonically, so the number of bytes
+   * in use is the write position minus the smallest read position.
+   */
+  broadcast_cursor *cursors;
+
+  /**
+   * \brief Number of receivers.
+   */
+  size_t n_receivers;
+
+  /**
+   * \brief For each receiver, a semaphore posted when a message is published
+   * while it is waiting for one.
+   */
+  std::vector<semaphore_t> msg_published;
+
+  /**
+   * \brief A semaphore posted when a receiver moves on while the sender is
+   * waiting for space.
+   */
+  semaphore_t space_freed;
+
+private:
+  /**
+   * \brief Get the number of bytes taken by a message of `len` bytes,
+   * including its length header.
+   *
+   * Messages are padded so that length headers stay aligned.
+   */
+  static size_t msg_size(size_t len) {
+    size_t size_t_size = sizeof(size_t);
+    return (size_t_size + len + size_t_size - 1) / size_t_size * size_t_size;
+  }
+
+  /**
+   * \brief Get a pointer to position `pos` in the buffer.
+   */
+  char *at(size_t pos) {
+    return static_cast<char *>(shared_mem) + pos % capacity;
+  }
+
+  /**
+   * \brief Get the cursor of receiver `receiver`.
+   *
+   * \throws std::invalid_argument If `receiver` is not a valid index.
+   */
+  std::atomic_size_t &cursor_of(size_t receiver) {
+    if (receiver >= n_receivers) {
+      throw std::invalid_argument("invalid receiver index");
+    }
+    return cursors[receiver].pos;
+  }
+
+  /**
+   * \brief Get the position of the slowest receiver.
+   */
+  size_t min_cursor();
+
+  /**
+   * \brief Wait until a message of `n` bytes fits at position `pos`.
+   *
+   * \returns Whether it fits before the timeout expired.
+   */
+  bool wait_for_space(size_t pos, size_t n, bool block, double timeout);
+
+  /**
+   * \brief Wait for the next message of receiver `receiver`.
+   *
+   * \returns Its position. Its length is stored in `len`.
+   */
+  size_t claim_msg(size_t receiver, bool block, size_t &len);
+
+  /**
+   * \brief Wake up the receivers waiting for a message.
+   */
+  void notify_receivers();
+
+  /**
+   * \brief Move receiver `receiver` past the message at position `pos`.
+   */
+  void release_msg(size_t receiver, size_t pos, size_t len);
+
+  /**
+   * \brief The functions used to (de)serialize objects.
+   */
+  const pickle_funcs &pickle;
+
+  /**
+   * \brief The position of the slowest receiver, as last seen by the sender.
+   *
+   * It can only grow stale in a conservative way, so it is only refreshed
+   * when a message doesn't seem to fit.
+   */
+  size_t tail;
+
+  unsigned max_spins;   // see set_spin()
+  unsigned spin_budget; // see util::spin_until()
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_BROADCAST_CHANNEL_H
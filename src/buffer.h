@@ -37,9 +37,14 @@ public:
   buffer &operator=(const buffer &t) = delete;
 
   /**
-   * \brief Default move constructor.
+   * \brief Move constructor.
+   *
+   * The moved-from buffer no longer owns any memory.
    */
-  buffer(buffer &&t) = default;
+  buffer(buffer &&t) noexcept : buf(t.buf), len(t.len), type(t.type) {
+    t.buf = nullptr;
+    t.len = 0;
+  }
 
   /**
    * \brief No move assignment operator.
@@ -1,32 +1,117 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <deque>
 #include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
 
 #include "channel.h"
+#include "codec.h"
 #include "util.h"
 
 namespace snakefish {
 
-channel::channel(const size_t size) : lock(1), n_unread(), capacity(size) {
-  // imports pickle functions
-  dumps = py::module::import("pickle").attr("dumps");
-  loads = py::module::import("pickle").attr("loads");
+/**
+ * \brief Flag set in the length header of a message once it has been
+ * released by the receiver.
+ */
+static const size_t RELEASED = static_cast<size_t>(1)
+                               << (sizeof(size_t) * 8 - 1);
+
+/**
+ * \brief Get the number of out-of-band buffers of a message produced by
+ * `channel::send_pyobj()`.
+ */
+static size_t n_oob_buffers(const char *bytes, const size_t len) {
+  if (codec::is_encoded(bytes, len))
+    return 0;
+
+  size_t n_bufs = 0;
+  memcpy(&n_bufs, bytes + len - sizeof(size_t), sizeof(size_t));
+  return n_bufs;
+}
+
+const pickle_funcs &get_pickle_funcs() {
+  static pickle_funcs *funcs = nullptr;
+  if (funcs == nullptr) {
+    py::module pickle = py::module::import("pickle");
+    funcs = new pickle_funcs{
+        pickle.attr("Pickler"), pickle.attr("dumps"), pickle.attr("loads"),
+        py::module::import("types").attr("SimpleNamespace"),
+        std::min(PICKLE_PROTOCOL,
+                 pickle.attr("HIGHEST_PROTOCOL").cast<unsigned>())};
+  }
+  return *funcs;
+}
+
+channel::channel(size_t size, const size_t max_size, const channel_mode mode)
+    : header(static_cast<channel_header *>(
+          util::get_shared_mem(sizeof(channel_header), true))),
+      lock(1, &header->lock), n_unread(0, &header->n_unread),
+      ready(&header->n_subscribers), space_freed(0, &header->space_freed),
+      capacity(size), base(0), generation(0), max_capacity(max_size),
+      page_size(sysconf(_SC_PAGESIZE)), mirrored(false), mode(mode),
+      views(std::make_shared<view_refs>()), pickle(get_pickle_funcs()),
+      reserving(false), reserved_begin(0), reserved_len(0),
+      reserved_space(0), batching(false), batch_len(0), batch_count(0),
+      max_spins(0), spin_budget(0) {
+  if (size == 0 || size > max_size) {
+    throw std::invalid_argument("invalid channel buffer size");
+  }
+  views->n_views = 0;
+  views->disposed = false;
+#ifdef __APPLE__
+  // shared memory objects can't be resized on macOS
+  size = max_size;
+  capacity = size;
+#endif
 
   // create shared memory and relevant metadata variables
-  shared_mem = util::get_shared_mem(size, false);
-  start = static_cast<std::atomic_size_t *>(
-      util::get_shared_mem(sizeof(std::atomic_size_t), true));
-  end = static_cast<std::atomic_size_t *>(
-      util::get_shared_mem(sizeof(std::atomic_size_t), true));
-  full = static_cast<std::atomic_bool *>(
-      util::get_shared_mem(sizeof(std::atomic_bool), true));
+  // the whole address range the buffer (and its mirror) may grow into is
+  // reserved, so that the buffer never moves
+  shared_fd = util::get_shared_fd(size);
+  shared_mem = util::reserve_mem(2 * max_size);
+  header->pages.store(page_policy::DEFAULT_PAGES);
+  header->prefault.store(false);
+  header->numa_node.store(-1);
+  map_buffer(size);
+  layout = &header->layout;
+  start = &header->start;
+  end = &header->end;
+  full = &header->full;
+  read = &header->read;
+  n_pending = &header->n_pending;
+  n_queued = &header->n_queued;
+  reader_waiting = &header->reader_waiting;
+  writers_waiting = &header->writers_waiting;
+  untrimmed = &header->untrimmed;
+  trimmed = &header->trimmed;
 
   // initialize metadata
   start->store(0);
   end->store(0);
+  read->store(0);
+  n_pending->store(0);
   full->store(false);
+  n_queued->store(0);
+  reader_waiting->store(false);
+  writers_waiting->store(0);
+  untrimmed->store(0);
+  trimmed->store(0);
+  header->trim_threshold.store(DEFAULT_TRIM_THRESHOLD);
+  header->stats_enabled.store(false);
+  reset_stats();
+  layout->generation.store(0);
+  layout->base.store(0);
+  layout->capacity.store(size);
 
   // ensure that shared atomic variables are lock free
   // note that end is of the same type as start
@@ -40,86 +125,1045 @@ channel::channel(const size_t size) : lock(1), n_unread(), capacity(size) {
   }
 }
 
-void channel::send_bytes(void *bytes, size_t len) {
+void channel::set_spin(const unsigned max_spins) {
+  this->max_spins = max_spins;
+  spin_budget = max_spins;
+  n_unread.set_spin(max_spins);
+  space_freed.set_spin(max_spins);
+}
+
+void channel::reset_stats() {
+  channel_stats &s = header->stats;
+  s.msgs_sent.store(0);
+  s.bytes_sent.store(0);
+  s.n_full.store(0);
+  s.max_used.store(0);
+  s.send_wait_ns.store(0);
+  s.msgs_received.store(0);
+  s.bytes_received.store(0);
+  s.receive_wait_ns.store(0);
+  s.lock_wait_ns.store(0);
+  for (size_t i = 0; i < N_LATENCY_BUCKETS; i++) {
+    s.send_latency[i].store(0);
+    s.receive_latency[i].store(0);
+  }
+}
+
+py::dict channel::stats() {
+  channel_stats &s = header->stats;
+  py::list send_latency;
+  py::list receive_latency;
+  for (size_t i = 0; i < N_LATENCY_BUCKETS; i++) {
+    send_latency.append(s.send_latency[i].load());
+    receive_latency.append(s.receive_latency[i].load());
+  }
+
+  py::dict d;
+  d["msgs_sent"] = s.msgs_sent.load();
+  d["bytes_sent"] = s.bytes_sent.load();
+  d["n_full"] = s.n_full.load();
+  d["max_used"] = s.max_used.load();
+  d["send_wait_ns"] = s.send_wait_ns.load();
+  d["msgs_received"] = s.msgs_received.load();
+  d["bytes_received"] = s.bytes_received.load();
+  d["receive_wait_ns"] = s.receive_wait_ns.load();
+  d["lock_wait_ns"] = s.lock_wait_ns.load();
+  d["send_latency"] = send_latency;
+  d["receive_latency"] = receive_latency;
+  return d;
+}
+
+void channel::record_latency(std::atomic_uint_fast64_t *hist,
+                             const uint64_t t0) {
+  // bucket i holds latencies in [2^i, 2^(i+1)) ns
+  uint64_t latency = util::get_time_ns() - t0;
+  size_t bucket = 0;
+  while (latency > 1 && bucket < N_LATENCY_BUCKETS - 1) {
+    latency >>= 1;
+    bucket++;
+  }
+  hist[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void channel::count_sent(const size_t len, const size_t n_msgs) {
+  channel_stats &s = header->stats;
+  s.msgs_sent.fetch_add(n_msgs, std::memory_order_relaxed);
+  s.bytes_sent.fetch_add(len - n_msgs * sizeof(size_t),
+                         std::memory_order_relaxed);
+
+  // raise the high-water mark if this is the new maximum
+  uint64_t used = capacity - get_available_space();
+  uint64_t max_used = s.max_used.load(std::memory_order_relaxed);
+  while (used > max_used &&
+         !s.max_used.compare_exchange_weak(max_used, used,
+                                           std::memory_order_relaxed)) {
+  }
+}
+
+void channel::acquire_lock() {
+  if (stats_on()) {
+    uint64_t t0 = util::get_time_ns();
+    lock.wait();
+    header->stats.lock_wait_ns.fetch_add(util::get_time_ns() - t0,
+                                         std::memory_order_relaxed);
+  } else {
+    lock.wait();
+  }
+  sync_layout();
+}
+
+void channel::map_buffer(const size_t len) {
+  util::map_shared_fd(shared_mem, len, shared_fd);
+
+  // mmap() only works in whole pages, so only page-aligned buffers can be
+  // mirrored
+  mirrored = len % page_size == 0;
+  if (mirrored)
+    util::map_shared_fd(static_cast<char *>(shared_mem) + len, len, shared_fd);
+  advise_buffer(len);
+}
+
+void channel::advise_buffer(const size_t len) {
+  size_t mapped_len = mirrored ? 2 * len : len;
+  if (header->pages.load() == page_policy::TRANSPARENT_HUGE_PAGES)
+    util::advise_huge_pages(shared_mem, mapped_len);
+  int node = header->numa_node.load();
+  if (node >= 0)
+    util::bind_to_numa_node(shared_mem, mapped_len, node);
+  if (header->prefault.load())
+    util::prefault(shared_mem, mapped_len);
+}
+
+int channel::set_numa_node(int node) {
+  if (node < 0)
+    node = util::get_numa_node();
+  util::check_numa_node(node);
+
+  header->numa_node.store(node);
+  advise_buffer(capacity);
+  return node;
+}
+
+page_policy channel::set_page_policy(page_policy policy, const bool prefault) {
+  if (header->pages.load() == page_policy::HUGETLB_PAGES) {
+    // there's no going back from the huge page pool
+    policy = page_policy::HUGETLB_PAGES;
+  } else if (policy == page_policy::HUGETLB_PAGES) {
+    if (reserving || batching || start->load() != end->load() ||
+        read->load() != end->load() || full->load()) {
+      throw std::runtime_error("channel is in use");
+    }
+    if (!use_hugetlb())
+      policy = page_policy::TRANSPARENT_HUGE_PAGES;
+  }
+
+  header->pages.store(policy);
+  header->prefault.store(prefault);
+  advise_buffer(capacity);
+  return policy;
+}
+
+bool channel::use_hugetlb() {
+#ifdef MFD_HUGETLB
+  size_t huge_page_size = util::get_huge_page_size();
+  if (huge_page_size == 0)
+    return false;
+  auto round_up = [huge_page_size](size_t n) {
+    return (n + huge_page_size - 1) / huge_page_size * huge_page_size;
+  };
+  size_t new_capacity = round_up(capacity);
+  size_t new_max_capacity = round_up(max_capacity);
+
+  // failures are expected when the pool is empty, so they are not reported
+  int fd = memfd_create("snakefish", MFD_CLOEXEC | MFD_HUGETLB);
+  if (fd == -1)
+    return false;
+  if (ftruncate(fd, new_capacity)) {
+    close(fd);
+    return false;
+  }
+
+  // huge pages must be mapped at aligned addresses, so reserve an extra huge
+  // page and trim the unaligned ends
+  size_t reserved_len = 2 * new_max_capacity + huge_page_size;
+  void *mem = mmap(nullptr, reserved_len, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  char *begin = static_cast<char *>(mem);
+  size_t offset = (huge_page_size - reinterpret_cast<uintptr_t>(begin) %
+                                        huge_page_size) %
+                  huge_page_size;
+  char *aligned = begin + offset;
+  if (offset > 0)
+    munmap(begin, offset);
+  munmap(aligned + 2 * new_max_capacity, huge_page_size - offset);
+
+  // map the buffer and its mirror
+  int prot = PROT_READ | PROT_WRITE;
+  int flags = MAP_SHARED | MAP_FIXED;
+  if (mmap(aligned, new_capacity, prot, flags, fd, 0) == MAP_FAILED ||
+      mmap(aligned + new_capacity, new_capacity, prot, flags, fd, 0) ==
+          MAP_FAILED) {
+    munmap(aligned, 2 * new_max_capacity);
+    close(fd);
+    return false;
+  }
+
+  // switch over to the new buffer
+  if (munmap(shared_mem, 2 * max_capacity)) {
+    perror("munmap() failed");
+    abort();
+  }
+  if (close(shared_fd)) {
+    perror("close() failed");
+    abort();
+  }
+  shared_mem = aligned;
+  shared_fd = fd;
+  capacity = new_capacity;
+  max_capacity = new_max_capacity;
+  page_size = huge_page_size;
+  mirrored = true;
+  layout->capacity.store(capacity);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void channel::release_space(const size_t idx, const size_t len) {
+  // only whole pages can be released, and the buffer may not be mirrored
+  size_t first_len = std::min(len, capacity - idx);
+  size_t ranges[2][2] = {{idx, idx + first_len}, {0, len - first_len}};
+  for (auto &range : ranges) {
+    size_t begin = (range[0] + page_size - 1) / page_size * page_size;
+    size_t end = range[1] / page_size * page_size;
+    if (begin < end)
+      util::release_pages(shared_fd, begin, end - begin);
+  }
+}
+
+void channel::trim_freed(const size_t pos, const size_t n) {
+  size_t threshold = header->trim_threshold.load(std::memory_order_relaxed);
+  if (threshold == 0)
+    return;
+
+  if (mode == channel_mode::SPSC) {
+    // space freed earlier may already be reused by the sender
+    if (n >= threshold)
+      release_space(index_of(pos), n);
+    return;
+  }
+
+  // nobody else can touch the free space while the lock is held, but some of
+  // what was freed may have been reused since
+  size_t len = untrimmed->load() + n;
+  if (len < threshold) {
+    untrimmed->store(len);
+    return;
+  }
+  len = std::min(len, get_available_space());
+  size_t head = start->load();
+  release_space((head + capacity - len) % capacity, len);
+  untrimmed->store(0);
+}
+
+void channel::trim_consumed() {
+  size_t threshold = header->trim_threshold.load(std::memory_order_relaxed);
+  size_t head = start->load(std::memory_order_acquire);
+  size_t from = trimmed->load(std::memory_order_relaxed);
+  if (threshold == 0 || head - from < threshold)
+    return;
+
+  // space before tail - capacity has been written again since it was freed
+  size_t tail = end->load(std::memory_order_relaxed);
+  if (tail - from > capacity)
+    from = tail - capacity;
+  release_space(index_of(from), head - from);
+  trimmed->store(head, std::memory_order_relaxed);
+}
+
+void channel::write_at(const size_t idx, const void *src, const size_t len) {
+  if (mirrored || idx + len <= capacity) {
+    // no wrapping, or the mirror takes care of it
+    memcpy(static_cast<char *>(shared_mem) + idx, src, len);
+  } else {
+    // wrapping occurred
+    size_t first_half_len = capacity - idx;
+    size_t second_half_len = len - first_half_len;
+    memcpy(static_cast<char *>(shared_mem) + idx, src, first_half_len);
+    memcpy(shared_mem, static_cast<const char *>(src) + first_half_len,
+           second_half_len);
+  }
+}
+
+void channel::read_at(const size_t idx, void *dst, const size_t len) {
+  if (mirrored || idx + len <= capacity) {
+    // no wrapping, or the mirror takes care of it
+    memcpy(dst, static_cast<char *>(shared_mem) + idx, len);
+  } else {
+    // wrapping occurred
+    size_t first_half_len = capacity - idx;
+    size_t second_half_len = len - first_half_len;
+    memcpy(dst, static_cast<char *>(shared_mem) + idx, first_half_len);
+    memcpy(static_cast<char *>(dst) + first_half_len, shared_mem,
+           second_half_len);
+  }
+}
+
+void channel::send_bytes(void *bytes, size_t len, const bool block,
+                         const double timeout) {
+  struct iovec iov = {bytes, len};
+  send_bytes(&iov, 1, block, timeout);
+}
+
+void channel::send_bytes(const struct iovec *iov, const size_t iovcnt,
+                         const bool block, const double timeout) {
+  size_t len = 0;
+  for (size_t i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+
   // no-op
   if (len == 0)
     return;
 
-  acquire_lock();
+  // the reservation guarantees that all writes fit
+  reserve(len, block, timeout);
+  for (size_t i = 0; i < iovcnt; i++)
+    write(iov[i].iov_base, iov[i].iov_len);
+  commit();
+}
+
+void channel::send_bytes_many(const struct iovec *msgs, const size_t n,
+                              const bool block, const double timeout) {
+  begin_batch();
+  try {
+    for (size_t i = 0; i < n; i++) {
+      if (msgs[i].iov_len == 0)
+        continue;
+      reserve(msgs[i].iov_len, block, timeout);
+      write(msgs[i].iov_base, msgs[i].iov_len);
+      commit();
+    }
+  } catch (...) {
+    abort_batch();
+    throw;
+  }
+  end_batch();
+}
+
+size_t channel::get_available_space() {
+  if (mode == channel_mode::SPSC) {
+    // only the receiver moves start, so the result can only grow stale in a
+    // conservative way
+    size_t head = start->load(std::memory_order_acquire);
+    size_t tail = end->load(std::memory_order_relaxed);
+    return capacity - (tail - head);
+  }
 
-  // ensure that buffer is large enough
-  size_t size_t_size = sizeof(size_t);
-  size_t n = size_t_size + len;
   size_t head = start->load();
   size_t tail = end->load();
-  size_t available_space = 0;
   if (head < tail)
-    available_space = capacity - (tail - head);
+    return capacity - (tail - head);
   else if (head > tail)
-    available_space = head - tail;
+    return head - tail;
   else if (!(full->load()))
-    available_space = capacity;
-  if (n > available_space) {
-    release_lock();
+    return capacity;
+  else
+    return 0;
+}
+
+void channel::reserve(const size_t len, const bool block,
+                      const double timeout) {
+  if (reserving) {
+    throw std::runtime_error("a message is already being written");
+  }
+
+  // a batch already holds the lock
+  if (mode == channel_mode::LOCKED && !batching)
+    acquire_lock();
+  else if (mode == channel_mode::SPSC)
+    sync_layout();
+  if (mode == channel_mode::SPSC && !batching)
+    trim_consumed();
+
+  // ensure that buffer is large enough
+  // messages committed in the current batch aren't published yet, so the new
+  // message goes after them
+  size_t n = sizeof(size_t) + len;
+  if (n > get_available_space() - batch_len &&
+      !grow(batch_len + n, batch_len)) {
+    bool ok = false;
+    bool stats = stats_on();
+    if (stats)
+      header->stats.n_full.fetch_add(1, std::memory_order_relaxed);
+    try {
+      uint64_t t0 = stats ? util::get_time_ns() : 0;
+      ok = block && wait_for_space(n, timeout);
+      if (stats && block)
+        header->stats.send_wait_ns.fetch_add(util::get_time_ns() - t0,
+                                             std::memory_order_relaxed);
+    } catch (...) {
+      if (mode == channel_mode::LOCKED && !batching)
+        release_lock();
+      throw;
+    }
+    if (!ok) {
+      if (mode == channel_mode::LOCKED && !batching)
+        release_lock();
+      throw std::overflow_error("channel buffer is full");
+    }
+  }
+
+  reserved_begin = end->load(std::memory_order_relaxed) + batch_len;
+  reserved_len = 0;
+  reserved_space = get_available_space() - batch_len;
+  reserving = true;
+}
+
+bool channel::extend_reservation(const size_t n) {
+  if (n <= reserved_space)
+    return true;
+
+  // for LOCKED channels, start can't move while the lock is held
+  if (mode == channel_mode::SPSC)
+    reserved_space = get_available_space() - batch_len;
+  if (n > reserved_space &&
+      grow(batch_len + n, batch_len + sizeof(size_t) + reserved_len))
+    reserved_space = get_available_space() - batch_len;
+
+  return n <= reserved_space;
+}
+
+bool channel::grow(const size_t n, const size_t written) {
+  if (capacity == max_capacity)
+    return false;
+
+  // for SPSC channels, start may move concurrently, which only makes the
+  // result conservative
+  size_t head = start->load(std::memory_order_acquire);
+  size_t head_idx, used;
+  if (mode == channel_mode::SPSC) {
+    head_idx = index_of(head);
+    used = end->load(std::memory_order_relaxed) - head;
+  } else {
+    head_idx = head;
+    used = capacity - get_available_space();
+  }
+
+  // if the data wraps around, the part at the start of the buffer is moved
+  // right after the old end, so that the data is contiguous again
+  // this is only possible while nobody else can be reading that part, i.e.
+  // for LOCKED channels with no views into it
+  // an SPSC receiver may be reading anything published, so the data can only
+  // move once all of it has been released; what's left is then unpublished,
+  // and it's moved to the start of the buffer instead
+  size_t wrapped_len = 0;
+  size_t old_head_idx = head_idx;
+  if (head_idx + used + written > capacity) {
+    if (mode == channel_mode::SPSC) {
+      if (used > 0)
+        return false;
+      head_idx = 0;
+    } else {
+      size_t tail = read->load();
+      size_t pending_len = (tail + capacity - head) % capacity;
+      if (pending_len == 0 && n_pending->load() > 0)
+        pending_len = capacity;
+      if (head + pending_len > capacity)
+        return false;
+      wrapped_len = head + used + written - capacity;
+    }
+  }
+
+  // double the size until the request fits
+  size_t new_capacity = capacity;
+  while ((new_capacity < used + n ||
+          new_capacity < head_idx + used + written) &&
+         new_capacity < max_capacity)
+    new_capacity *= 2;
+  new_capacity = (new_capacity + page_size - 1) / page_size * page_size;
+  new_capacity = std::min(new_capacity, max_capacity);
+  if (new_capacity < used + n || new_capacity < head_idx + used + written)
+    return false;
+
+  std::string moved;
+  if (head_idx != old_head_idx) {
+    moved.resize(written);
+    read_at(old_head_idx, &moved[0], written);
+  }
+
+  if (ftruncate(shared_fd, new_capacity)) {
+    perror("ftruncate() failed");
+    return false;
+  }
+  map_buffer(new_capacity);
+  if (wrapped_len > 0) {
+    char *mem = static_cast<char *>(shared_mem);
+    memcpy(mem + capacity, mem, wrapped_len);
+  }
+  if (!moved.empty())
+    memcpy(shared_mem, moved.data(), moved.size());
+
+  if (mode == channel_mode::LOCKED) {
+    // end, read and the position of the message being written are indices,
+    // which may have wrapped at the old end of the buffer
+    end->store(head + used);
+    reserved_begin = head + used + batch_len;
+    size_t tail = read->load();
+    if (tail < head || (tail == head && n_pending->load() > 0))
+      read->store(tail + capacity);
+    full->store(false);
+  } else {
+    // rebase positions so that the indices of existing data don't change
+    base = head - head_idx;
+  }
+  capacity = new_capacity;
+
+  // update the layout like a seqlock
+  generation += 2;
+  layout->generation.store(generation - 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  layout->base.store(base, std::memory_order_relaxed);
+  layout->capacity.store(capacity, std::memory_order_relaxed);
+  layout->generation.store(generation, std::memory_order_release);
+
+  return true;
+}
+
+void channel::sync_layout() {
+  if (layout->generation.load(std::memory_order_relaxed) == generation)
+    return;
+
+  size_t new_generation, new_base, new_capacity;
+  while (true) {
+    new_generation = layout->generation.load(std::memory_order_acquire);
+    new_base = layout->base.load(std::memory_order_relaxed);
+    new_capacity = layout->capacity.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (new_generation % 2 == 0 &&
+        layout->generation.load(std::memory_order_relaxed) == new_generation)
+      break;
+  }
+
+  if (new_capacity > capacity)
+    map_buffer(new_capacity);
+  generation = new_generation;
+  base = new_base;
+  capacity = new_capacity;
+}
+
+bool channel::wait_for_space(const size_t n, const double timeout) {
+  // this would never succeed
+  if (n > max_capacity)
+    return false;
+
+  // the receiver can't free anything before the batch is published
+  if (batching && batch_count > 0) {
+    publish(batch_len, batch_count);
+    batch_len = 0;
+    batch_count = 0;
+    if (mode == channel_mode::LOCKED)
+      acquire_lock();
+  }
+
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::duration<double>(std::max(timeout, 0.0));
+  while (get_available_space() - batch_len < n) {
+    // space may have been freed such that the buffer can grow now
+    if (grow(batch_len + n, batch_len))
+      break;
+
+    double remaining = -1;
+    if (timeout >= 0) {
+      remaining = std::chrono::duration<double>(
+                      deadline - std::chrono::steady_clock::now())
+                      .count();
+      if (remaining <= 0)
+        return false;
+    }
+
+    if (mode == channel_mode::SPSC) {
+      // the receiver may be about to free something
+      if (util::spin_until(
+              [this, n]() { return get_available_space() - batch_len >= n; },
+              max_spins, spin_budget))
+        break;
+
+      // announce that we are going to sleep, then check again in case the
+      // receiver freed something before it could see the announcement
+      writers_waiting->store(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (get_available_space() - batch_len >= n) {
+        writers_waiting->store(0);
+        break;
+      }
+
+      // stale posts only cause spurious wakeups, which are handled by the loop
+      if (!space_freed.timedwait(remaining))
+        return false;
+    } else {
+      // the receiver needs the lock to free anything
+      writers_waiting->fetch_add(1);
+      release_lock();
+      bool woken;
+      try {
+        woken = space_freed.timedwait(remaining);
+      } catch (...) {
+        acquire_lock();
+        throw;
+      }
+      acquire_lock();
+      if (!woken)
+        return false;
+    }
+  }
+
+  return true;
+}
+
+void channel::notify_writers() {
+  if (mode == channel_mode::SPSC) {
+    // the fence pairs with the one in wait_for_space() so that either the
+    // sender sees the new start or this sees writers_waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writers_waiting->load(std::memory_order_relaxed) > 0 &&
+        writers_waiting->exchange(0) > 0) {
+      space_freed.post();
+    }
+    return;
+  }
+
+  size_t n = writers_waiting->exchange(0);
+  for (size_t i = 0; i < n; i++)
+    space_freed.post();
+}
+
+void channel::write(const void *bytes, const size_t len) {
+  if (!reserving) {
+    throw std::runtime_error("no message is being written");
+  }
+
+  // grow the reservation if necessary
+  size_t size_t_size = sizeof(size_t);
+  if (!extend_reservation(size_t_size + reserved_len + len)) {
     throw std::overflow_error("channel buffer is full");
   }
 
+  write_at(index_of(reserved_begin + size_t_size + reserved_len), bytes,
+           len);
+  reserved_len += len;
+}
+
+size_t channel::write(const py::buffer &b) {
+  Py_buffer view;
+  if (PyObject_GetBuffer(b.ptr(), &view, PyBUF_SIMPLE)) {
+    throw py::error_already_set();
+  }
+
+  try {
+    write(view.buf, view.len);
+  } catch (...) {
+    PyBuffer_Release(&view);
+    throw;
+  }
+  PyBuffer_Release(&view);
+
+  return view.len;
+}
+
+void channel::commit() {
+  if (!reserving) {
+    throw std::runtime_error("no message is being written");
+  }
+
+  // no-op
+  if (reserved_len == 0) {
+    cancel();
+    return;
+  }
+
   // copy the length into shared buffer
-  void *len_bytes = &len;
-  size_t new_end = (tail + size_t_size) % capacity;
-  if (new_end > tail) {
-    // no wrapping
-    memcpy(static_cast<char *>(shared_mem) + tail, len_bytes, size_t_size);
+  size_t size_t_size = sizeof(size_t);
+  size_t n = size_t_size + reserved_len;
+  write_at(index_of(reserved_begin), &reserved_len, size_t_size);
+  reserving = false;
+
+  if (batching) {
+    batch_len += n;
+    batch_count++;
   } else {
-    // wrapping occurred
-    size_t first_half_len = capacity - tail;
-    size_t second_half_len = size_t_size - first_half_len;
-    memcpy(static_cast<char *>(shared_mem) + tail, len_bytes, first_half_len);
-    memcpy(shared_mem, static_cast<char *>(len_bytes) + first_half_len,
-           second_half_len);
+    publish(n, 1);
   }
+}
 
-  // copy the bytes into shared buffer
-  tail = new_end;
-  new_end = (new_end + len) % capacity;
-  if (new_end > tail) {
-    // no wrapping
-    memcpy(static_cast<char *>(shared_mem) + tail, bytes, n);
-  } else {
-    // wrapping occurred
-    size_t first_half_len = capacity - tail;
-    size_t second_half_len = len - first_half_len;
-    memcpy(static_cast<char *>(shared_mem) + tail, bytes, first_half_len);
-    memcpy(shared_mem, static_cast<const char *>(bytes) + first_half_len,
-           second_half_len);
+void channel::publish(const size_t len, const size_t n_msgs) {
+  if (mode == channel_mode::SPSC) {
+    // publish the messages
+    end->store(end->load(std::memory_order_relaxed) + len,
+               std::memory_order_release);
+    if (stats_on())
+      count_sent(len, n_msgs);
+
+    // wake up the receiver only if it is (about to be) sleeping
+    // the fence pairs with the ones in wait_for_message() and select() so that
+    // either the receiver sees the new end or this sees reader_waiting (or the
+    // subscription)
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (reader_waiting->load(std::memory_order_relaxed) &&
+        reader_waiting->exchange(false)) {
+      n_unread.post();
+    }
+    ready.notify();
+    return;
   }
 
   // update metadata
-  if (n == available_space)
+  if (len == get_available_space())
     full->store(true);
-  end->store(new_end);
+  end->store((end->load() + len) % capacity);
+  n_queued->fetch_add(n_msgs);
+  if (stats_on())
+    count_sent(len, n_msgs);
 
   try {
-    n_unread.post();
+    for (size_t i = 0; i < n_msgs; i++)
+      n_unread.post();
   } catch (const std::runtime_error &e) {
     release_lock();
     throw e;
   }
 
   release_lock();
+
+  // the fence pairs with the one in select() so that either the selector
+  // sees the new messages or this sees its subscription
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  ready.notify();
 }
 
-void channel::send_pyobj(const py::object &obj) {
-  // serialize obj to binary and get output
-  py::object bytes = dumps(obj, PICKLE_PROTOCOL);
-  PyObject *mem_view = PyMemoryView_GetContiguous(bytes.ptr(), PyBUF_READ, 'C');
-  Py_buffer *buf = PyMemoryView_GET_BUFFER(mem_view);
+void channel::begin_batch() {
+  if (reserving || batching) {
+    throw std::runtime_error("a message is already being written");
+  }
 
-  // send
-  send_bytes(buf->buf, buf->len);
+  if (mode == channel_mode::LOCKED) {
+    acquire_lock();
+  } else {
+    sync_layout();
+    trim_consumed();
+  }
+  batching = true;
+  batch_len = 0;
+  batch_count = 0;
 }
 
-buffer channel::receive_bytes(const bool block) {
+void channel::end_batch() {
+  batching = false;
+  if (batch_count > 0) {
+    publish(batch_len, batch_count);
+  } else if (mode == channel_mode::LOCKED) {
+    release_lock();
+  }
+}
+
+void channel::abort_batch() {
+  cancel();
+  batching = false;
+  if (mode == channel_mode::LOCKED)
+    release_lock();
+}
+
+void channel::cancel() {
+  if (!reserving)
+    return;
+
+  reserving = false;
+  if (mode == channel_mode::LOCKED && !batching)
+    release_lock();
+}
+
+py::object channel::make_pickler(const py::cpp_function &write_func,
+                                 std::vector<Py_buffer> &oob_bufs) {
+  py::object file = pickle.make_file(py::arg("write") = write_func);
+  if (pickle.protocol < 5)
+    return pickle.pickler_type(file, pickle.protocol);
+
+  py::cpp_function buffer_callback([&oob_bufs](const py::object &pb) {
+    Py_buffer view;
+    if (PyObject_GetBuffer(pb.ptr(), &view, PyBUF_ANY_CONTIGUOUS)) {
+      // let pickle deal with it
+      PyErr_Clear();
+      return true;
+    }
+    if (static_cast<size_t>(view.len) < OOB_BUFFER_THRESHOLD) {
+      PyBuffer_Release(&view);
+      return true;
+    }
+    oob_bufs.push_back(view);
+    return false;
+  });
+  return pickle.pickler_type(file, pickle.protocol,
+                             py::arg("buffer_callback") = buffer_callback);
+}
+
+void channel::serialize(const py::object &obj, serialized_obj &out) {
+  auto append = [&out](const void *bytes, size_t len) {
+    out.data.append(static_cast<const char *>(bytes), len);
+  };
+
+  size_t encoded_len = codec::encoded_size(obj.ptr());
+  if (encoded_len > 0) {
+    out.data.reserve(encoded_len);
+    codec::encode(obj.ptr(), append);
+    return;
+  }
+
+  py::cpp_function write_func([&append](const py::buffer &b) -> size_t {
+    Py_buffer view;
+    if (PyObject_GetBuffer(b.ptr(), &view, PyBUF_SIMPLE)) {
+      throw py::error_already_set();
+    }
+    size_t len = view.len;
+    append(view.buf, len);
+    PyBuffer_Release(&view);
+    return len;
+  });
+  make_pickler(write_func, out.oob_bufs).attr("dump")(obj);
+
+  // the trailer: the lengths of the out-of-band buffers, and the number of
+  // them
+  size_t n_bufs = out.oob_bufs.size();
+  out.trailer.resize(n_bufs + 1);
+  for (size_t i = 0; i < n_bufs; i++)
+    out.trailer[i] = out.oob_bufs[i].len;
+  out.trailer[n_bufs] = n_bufs;
+}
+
+void channel::send_serialized(const serialized_obj &obj, const bool block,
+                              const double timeout) {
+  size_t trailer_len = obj.trailer.size() * sizeof(size_t);
+  size_t len = obj.data.size() + trailer_len;
+  for (const Py_buffer &view : obj.oob_bufs)
+    len += view.len;
+
+  reserve(len, block, timeout);
+  try {
+    write(obj.data.data(), obj.data.size());
+    for (const Py_buffer &view : obj.oob_bufs)
+      write(view.buf, view.len);
+    if (trailer_len > 0)
+      write(obj.trailer.data(), trailer_len);
+  } catch (...) {
+    cancel();
+    throw;
+  }
+  commit();
+}
+
+void channel::send_pyobj(const py::object &obj, const bool block,
+                         const double timeout) {
+  // pickle obj directly into the shared buffer, keeping large buffers out of
+  // band
+  // if blocking and the output doesn't fit, it is spilled into a private
+  // buffer, and copied into the shared buffer once there's enough space
+  std::vector<Py_buffer> oob_bufs;
+  std::string spill;
+  bool spilling = false;
+  bool overflowed = false;
+  size_t size_t_size = sizeof(size_t);
+  // a batch is timed as a whole by send_many()
+  uint64_t t0 = stats_on() && !batching ? util::get_time_ns() : 0;
+
+  // common types skip pickle entirely
+  size_t encoded_len = codec::encoded_size(obj.ptr());
+  if (encoded_len > 0) {
+    reserve(encoded_len, block, timeout);
+    try {
+      auto write_func = [this](const void *bytes, size_t len) {
+        write(bytes, len);
+      };
+      codec::encode(obj.ptr(), write_func);
+    } catch (...) {
+      cancel();
+      throw;
+    }
+    commit();
+    if (t0)
+      record_latency(header->stats.send_latency, t0);
+    return;
+  }
+
+  // LOCKED channels pickle before taking the lock, since other processes
+  // would be locked out for as long as pickle runs
+  if (mode == channel_mode::LOCKED) {
+    serialized_obj serialized;
+    serialize(obj, serialized);
+    send_serialized(serialized, block, timeout);
+    if (t0)
+      record_latency(header->stats.send_latency, t0);
+    return;
+  }
+
+  reserve(0, block, timeout);
+
+  try {
+    py::cpp_function write_func([this, block, &spill, &spilling,
+                                 &overflowed](const py::buffer &b) -> size_t {
+      if (!spilling) {
+        try {
+          return write(b);
+        } catch (const std::overflow_error &) {
+          if (!block) {
+            if (stats_on())
+              header->stats.n_full.fetch_add(1, std::memory_order_relaxed);
+            overflowed = true;
+            throw;
+          }
+          spill.resize(reserved_len);
+          read_at(index_of(reserved_begin + sizeof(size_t)), &spill[0],
+                  reserved_len);
+          spilling = true;
+        }
+      }
+
+      Py_buffer view;
+      if (PyObject_GetBuffer(b.ptr(), &view, PyBUF_SIMPLE)) {
+        throw py::error_already_set();
+      }
+      size_t len = view.len;
+      spill.append(static_cast<const char *>(view.buf), len);
+      PyBuffer_Release(&view);
+      return len;
+    });
+    py::object pickler = make_pickler(write_func, oob_bufs);
+    try {
+      pickler.attr("dump")(obj);
+    } catch (py::error_already_set &) {
+      // the overflow reaches here as a Python exception, since it's raised
+      // inside write_func
+      if (overflowed)
+        throw std::overflow_error("channel buffer is full");
+      throw;
+    }
+
+    // build the trailer: the lengths of the out-of-band buffers, and the
+    // number of them
+    size_t n_bufs = oob_bufs.size();
+    std::vector<size_t> trailer(n_bufs + 1);
+    size_t len = spilling ? spill.size() : reserved_len;
+    for (size_t i = 0; i < n_bufs; i++) {
+      trailer[i] = oob_bufs[i].len;
+      len += trailer[i];
+    }
+    trailer[n_bufs] = n_bufs;
+    len += trailer.size() * size_t_size;
+
+    // move the message elsewhere if it doesn't fit where it is
+    if (block && !spilling && !extend_reservation(size_t_size + len)) {
+      spill.resize(reserved_len);
+      read_at(index_of(reserved_begin + size_t_size), &spill[0],
+              reserved_len);
+      spilling = true;
+    }
+    if (spilling) {
+      cancel();
+      reserve(len, block, timeout);
+      write(spill.data(), spill.size());
+    }
+
+    // append the out-of-band buffers and the trailer
+    for (size_t i = 0; i < n_bufs; i++)
+      write(oob_bufs[i].buf, oob_bufs[i].len);
+    write(trailer.data(), trailer.size() * size_t_size);
+  } catch (...) {
+    for (Py_buffer &view : oob_bufs)
+      PyBuffer_Release(&view);
+    cancel();
+    throw;
+  }
+
+  for (Py_buffer &view : oob_bufs)
+    PyBuffer_Release(&view);
+  commit();
+  if (t0)
+    record_latency(header->stats.send_latency, t0);
+}
+
+void channel::send_many(const py::iterable &objs, const bool block,
+                        const double timeout) {
+  uint64_t t0 = stats_on() ? util::get_time_ns() : 0;
+
+  // the batch holds the lock of a LOCKED channel throughout, so everything
+  // is serialized beforehand (see send_pyobj())
+  std::deque<serialized_obj> serialized;
+  if (mode == channel_mode::LOCKED) {
+    for (py::handle obj : objs) {
+      serialized.emplace_back();
+      serialize(py::reinterpret_borrow<py::object>(obj), serialized.back());
+    }
+  }
+
+  begin_batch();
+  try {
+    if (mode == channel_mode::LOCKED) {
+      for (const serialized_obj &obj : serialized)
+        send_serialized(obj, block, timeout);
+    } else {
+      for (py::handle obj : objs)
+        send_pyobj(py::reinterpret_borrow<py::object>(obj), block, timeout);
+    }
+  } catch (...) {
+    abort_batch();
+    throw;
+  }
+  end_batch();
+  if (t0)
+    record_latency(header->stats.send_latency, t0);
+}
+
+void channel::wait_for_message(const bool block) {
+  if (mode == channel_mode::SPSC) {
+    size_t head = read->load(std::memory_order_relaxed);
+    size_t tail = end->load(std::memory_order_acquire);
+
+    while (head == tail) {
+      if (!block) {
+        throw std::out_of_range("out-of-bounds read detected");
+      }
+
+      // the sender may be about to publish something
+      if (util::spin_until(
+              [this, head, &tail]() {
+                tail = end->load(std::memory_order_acquire);
+                return head != tail;
+              },
+              max_spins, spin_budget))
+        break;
+
+      // announce that we are going to sleep, then check again in case the
+      // sender published something before it could see the announcement
+      reader_waiting->store(true);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      tail = end->load(std::memory_order_acquire);
+      if (head != tail) {
+        reader_waiting->store(false);
+        break;
+      }
+
+      // stale posts only cause spurious wakeups, which are handled by the loop
+      n_unread.wait();
+      tail = end->load(std::memory_order_acquire);
+    }
+
+    // the buffer may have grown before the new messages were published
+    sync_layout();
+    return;
+  }
+
   if (block) {
     n_unread.wait();
   } else {
@@ -127,79 +1171,493 @@ buffer channel::receive_bytes(const bool block) {
       throw std::out_of_range("out-of-bounds read detected");
     }
   }
+}
+
+void channel::wait_for_message_timed(const bool block) {
+  if (!block || !stats_on()) {
+    wait_for_message(block);
+    return;
+  }
+
+  uint64_t t0 = util::get_time_ns();
+  wait_for_message(block);
+  header->stats.receive_wait_ns.fetch_add(util::get_time_ns() - t0,
+                                          std::memory_order_relaxed);
+}
+
+void channel::count_received(const size_t len, const size_t n_msgs) {
+  channel_stats &s = header->stats;
+  s.msgs_received.fetch_add(n_msgs, std::memory_order_relaxed);
+  s.bytes_received.fetch_add(len, std::memory_order_relaxed);
+}
+
+size_t channel::begin_receive(const bool block, size_t &len) {
+  size_t size_t_size = sizeof(size_t);
+  wait_for_message_timed(block);
+
+  if (mode == channel_mode::SPSC) {
+    size_t head = read->load(std::memory_order_relaxed);
+    read_at(index_of(head), &len, size_t_size);
+    read->store(head + size_t_size + len, std::memory_order_relaxed);
+    if (stats_on())
+      count_received(len, 1);
+    return head;
+  }
+
   acquire_lock();
+  n_queued->fetch_sub(1);
+  size_t head = read->load();
+  read_at(head, &len, size_t_size);
+  read->store((head + size_t_size + len) % capacity);
+  if (stats_on())
+    count_received(len, 1);
+  return head;
+}
+
+bool channel::poll() {
+  if (mode == channel_mode::SPSC) {
+    return read->load(std::memory_order_relaxed) !=
+           end->load(std::memory_order_acquire);
+  }
+
+  return n_queued->load() > 0;
+}
+
+void channel::begin_receive_many(const bool block, const size_t max_n,
+                                 std::vector<size_t> &positions,
+                                 std::vector<size_t> &lens) {
+  if (max_n == 0) {
+    throw std::invalid_argument("max_n must be positive");
+  }
 
-  // get length of bytes
   size_t size_t_size = sizeof(size_t);
-  buffer len_buf = buffer(size_t_size, buffer_type::MALLOC);
-  void *len_bytes = len_buf.get_ptr();
+  size_t len = 0;
+  size_t total_len = 0;
+  wait_for_message_timed(block);
 
-  size_t head = start->load();
-  size_t new_start = (head + size_t_size) % capacity;
-  if (new_start > head) {
-    // no wrapping
-    memcpy(len_bytes, static_cast<char *>(shared_mem) + head, size_t_size);
+  if (mode == channel_mode::SPSC) {
+    // take everything published so far
+    size_t head = read->load(std::memory_order_relaxed);
+    size_t tail = end->load(std::memory_order_acquire);
+    sync_layout();
+    while (head != tail && positions.size() < max_n) {
+      read_at(index_of(head), &len, size_t_size);
+      positions.push_back(head);
+      lens.push_back(len);
+      head += size_t_size + len;
+      total_len += len;
+    }
+    read->store(head, std::memory_order_relaxed);
+    if (stats_on())
+      count_received(total_len, positions.size());
+    return;
+  }
+
+  // claim as many messages as possible without blocking
+  size_t n = 1;
+  while (n < max_n && n_unread.trywait())
+    n++;
+
+  acquire_lock();
+  n_queued->fetch_sub(n);
+  size_t head = read->load();
+  for (size_t i = 0; i < n; i++) {
+    read_at(head, &len, size_t_size);
+    positions.push_back(head);
+    lens.push_back(len);
+    head = (head + size_t_size + len) % capacity;
+    total_len += len;
+  }
+  read->store(head);
+  if (stats_on())
+    count_received(total_len, n);
+}
+
+void channel::end_receive(const size_t *positions, const size_t n) {
+  // if no message is pending, the space can be handed back right away
+  if (mode == channel_mode::SPSC) {
+    if (start->load(std::memory_order_relaxed) == positions[0]) {
+      size_t tail = read->load(std::memory_order_relaxed);
+      trim_freed(positions[0], tail - positions[0]);
+      start->store(tail, std::memory_order_release);
+    } else {
+      for (size_t i = 0; i < n; i++)
+        mark_released(positions[i]);
+      reclaim();
+    }
+    notify_writers();
+    return;
+  }
+
+  if (n_pending->load() == 0) {
+    size_t available = get_available_space();
+    full->store(false);
+    start->store(read->load());
+    trim_freed(positions[0], get_available_space() - available);
   } else {
-    // wrapping occurred
-    size_t first_half_len = capacity - head;
-    size_t second_half_len = size_t_size - first_half_len;
-    memcpy(len_bytes, static_cast<char *>(shared_mem) + head, first_half_len);
-    memcpy(static_cast<char *>(len_bytes) + first_half_len, shared_mem,
-           second_half_len);
+    n_pending->fetch_add(n);
+    for (size_t i = 0; i < n; i++)
+      mark_released(positions[i]);
+    reclaim();
   }
+  notify_writers();
+  release_lock();
+}
+
+void channel::mark_released(const size_t pos) {
+  size_t size_t_size = sizeof(size_t);
+  size_t idx = index_of(pos);
+  size_t len = 0;
+
+  read_at(idx, &len, size_t_size);
+  len |= RELEASED;
+  write_at(idx, &len, size_t_size);
+}
+
+buffer channel::receive_bytes(const bool block) {
+  size_t size_t_size = sizeof(size_t);
+  size_t len = 0;
+  size_t head = begin_receive(block, len);
 
   // get bytes
-  size_t len = *static_cast<size_t *>(len_bytes);
   buffer buf = buffer(len, buffer_type::MALLOC);
-  char *bytes = static_cast<char *>(buf.get_ptr());
+  read_at(index_of(head + size_t_size), buf.get_ptr(), len);
 
-  head = new_start;
-  new_start = (new_start + len) % capacity;
-  if (new_start > head) {
-    // no wrapping
-    memcpy(bytes, static_cast<char *>(shared_mem) + head, len);
-  } else {
-    // wrapping occurred
-    size_t first_half_len = capacity - head;
-    size_t second_half_len = len - first_half_len;
-    memcpy(bytes, static_cast<char *>(shared_mem) + head, first_half_len);
-    memcpy(bytes + first_half_len, shared_mem, second_half_len);
+  // update metadata
+  end_receive(&head, 1);
+
+  return buf;
+}
+
+std::vector<buffer> channel::receive_bytes_many(const size_t max_n,
+                                                const bool block) {
+  size_t size_t_size = sizeof(size_t);
+  std::vector<size_t> positions;
+  std::vector<size_t> lens;
+  begin_receive_many(block, max_n, positions, lens);
+
+  // get bytes
+  std::vector<buffer> bufs;
+  try {
+    bufs.reserve(positions.size());
+    for (size_t i = 0; i < positions.size(); i++) {
+      bufs.emplace_back(lens[i], buffer_type::MALLOC);
+      read_at(index_of(positions[i] + size_t_size), bufs[i].get_ptr(),
+              lens[i]);
+    }
+  } catch (...) {
+    end_receive(positions.data(), positions.size());
+    throw;
   }
 
   // update metadata
-  full->store(false);
-  start->store(new_start);
-  release_lock();
+  end_receive(positions.data(), positions.size());
 
-  return buf;
+  return bufs;
+}
+
+channel_view channel::receive_view(const bool block) {
+  size_t size_t_size = sizeof(size_t);
+  size_t len = 0;
+  size_t head = begin_receive(block, len);
+  size_t idx = index_of(head + size_t_size);
+
+  if (mode == channel_mode::LOCKED) {
+    n_pending->fetch_add(1);
+    release_lock();
+  }
+
+  if (mirrored || idx + len <= capacity) {
+    // if the message wraps around, the mirror makes it contiguous
+    return channel_view(*this, head, static_cast<char *>(shared_mem) + idx,
+                        len);
+  } else {
+    // the message wraps around, so it has to be copied out
+    buffer buf = buffer(len, buffer_type::MALLOC);
+    read_at(idx, buf.get_ptr(), len);
+    release(head);
+    return channel_view(std::move(buf));
+  }
+}
+
+void channel::release(const size_t pos) {
+  if (mode == channel_mode::LOCKED)
+    acquire_lock();
+  else
+    sync_layout();
+
+  mark_released(pos);
+  reclaim();
+  notify_writers();
+
+  if (mode == channel_mode::LOCKED)
+    release_lock();
+}
+
+void channel::reclaim() {
+  size_t size_t_size = sizeof(size_t);
+  size_t len = 0;
+
+  if (mode == channel_mode::SPSC) {
+    size_t head = start->load(std::memory_order_relaxed);
+    size_t old_head = head;
+    size_t tail = read->load(std::memory_order_relaxed);
+    while (head != tail) {
+      read_at(index_of(head), &len, size_t_size);
+      if (!(len & RELEASED))
+        break;
+      head += size_t_size + (len & ~RELEASED);
+    }
+    if (head != old_head) {
+      trim_freed(old_head, head - old_head);
+      start->store(head, std::memory_order_release);
+    }
+  } else {
+    size_t head = start->load();
+    size_t old_head = head;
+    size_t freed = 0;
+    while (n_pending->load() > 0) {
+      read_at(head, &len, size_t_size);
+      if (!(len & RELEASED))
+        break;
+      head = (head + size_t_size + (len & ~RELEASED)) % capacity;
+      freed += size_t_size + (len & ~RELEASED);
+      n_pending->fetch_sub(1);
+    }
+    if (head != old_head) {
+      full->store(false);
+      start->store(head);
+      trim_freed(old_head, freed);
+    }
+  }
+}
+
+template <typename F>
+py::object channel::unpickle(const char *bytes, const size_t len, F get_owner,
+                             const size_t offset) {
+  // messages encoded by codec::encode() don't go through pickle
+  if (codec::is_encoded(bytes, len))
+    return codec::decode(bytes, len);
+
+  // parse the trailer
+  size_t size_t_size = sizeof(size_t);
+  size_t n_bufs = n_oob_buffers(bytes, len);
+  std::vector<size_t> buf_lens(n_bufs);
+  size_t trailer_len = (n_bufs + 1) * size_t_size;
+  if (n_bufs > 0)
+    memcpy(buf_lens.data(), bytes + len - trailer_len, n_bufs * size_t_size);
+  size_t stream_len = len - trailer_len;
+  for (size_t buf_len : buf_lens)
+    stream_len -= buf_len;
+
+  // deserialize
+  if (n_bufs == 0) {
+    // nothing refers to the message afterwards
+    py::object mem_view =
+        py::reinterpret_steal<py::object>(PyMemoryView_FromMemory(
+            const_cast<char *>(bytes), stream_len, PyBUF_READ));
+    return pickle.loads(mem_view);
+  }
+
+  // the out-of-band buffers are handed to pickle as slices of the owner, so
+  // the message is kept alive until all objects built on top of them are gone
+  py::object mem_view = get_owner();
+  py::list buffers;
+  size_t buf_offset = offset + stream_len;
+  for (size_t buf_len : buf_lens) {
+    buffers.append(
+        mem_view[py::slice(static_cast<ssize_t>(buf_offset),
+                           static_cast<ssize_t>(buf_offset + buf_len), 1)]);
+    buf_offset += buf_len;
+  }
+  return pickle.loads(
+      mem_view[py::slice(static_cast<ssize_t>(offset),
+                         static_cast<ssize_t>(offset + stream_len), 1)],
+      py::arg("buffers") = buffers);
 }
 
 py::object channel::receive_pyobj(const bool block) {
-  // receive & deserialize
-  buffer bytes_buf = receive_bytes(block);
-  py::handle mem_view = py::handle(
-      PyMemoryView_FromMemory(static_cast<char *>(bytes_buf.get_ptr()),
-                              bytes_buf.get_len(), PyBUF_READ));
-  py::object obj = loads(mem_view);
+  return _receive_pyobj(block, false);
+}
+
+py::object channel::receive_pyobj_copy(const bool block) {
+  return _receive_pyobj(block, true);
+}
+
+py::object channel::_receive_pyobj(const bool block, const bool copy_buffers) {
+  size_t size_t_size = sizeof(size_t);
+  uint64_t t0 = stats_on() ? util::get_time_ns() : 0;
+  size_t len = 0;
+  size_t head = begin_receive(block, len);
+  size_t idx = index_of(head + size_t_size);
+  const char *bytes = static_cast<const char *>(shared_mem) + idx;
+  py::object obj;
+
+  // unpickling may run arbitrary code, so it never happens under the lock of
+  // a LOCKED channel
+  // small messages are copied out, which is cheaper than handing them back
+  // separately
+  size_t n_bufs = n_oob_buffers(bytes, len);
+  bool locked = mode == channel_mode::LOCKED;
+  if ((!mirrored && idx + len > capacity) || (copy_buffers && n_bufs > 0) ||
+      (locked && n_bufs == 0 && len < OOB_BUFFER_THRESHOLD)) {
+    // the message wraps around, or the objects rebuilt from its out-of-band
+    // buffers must not refer to the shared buffer, so it has to be copied out
+    py::object copy = py::reinterpret_steal<py::object>(
+        PyByteArray_FromStringAndSize(nullptr, len));
+    if (!copy) {
+      end_receive(&head, 1);
+      throw py::error_already_set();
+    }
+    read_at(idx, PyByteArray_AS_STRING(copy.ptr()), len);
+    end_receive(&head, 1);
+
+    obj = unpickle(
+        PyByteArray_AS_STRING(copy.ptr()), len,
+        [&copy]() {
+          py::object mem_view = py::reinterpret_steal<py::object>(
+              PyMemoryView_FromObject(copy.ptr()));
+          if (!mem_view)
+            throw py::error_already_set();
+          return mem_view;
+        },
+        0);
+  } else if (n_bufs == 0) {
+    // pickle copies everything out of the message, so it's deserialized in
+    // place and handed back right after
+    // a LOCKED channel keeps it pending in the meantime, like a view
+    if (locked) {
+      n_pending->fetch_add(1);
+      release_lock();
+    }
+    try {
+      obj = unpickle(bytes, len, []() { return py::object(); }, 0);
+    } catch (...) {
+      if (locked)
+        release(head);
+      else
+        end_receive(&head, 1);
+      throw;
+    }
+    if (locked)
+      release(head);
+    else
+      end_receive(&head, 1);
+  } else {
+    // the objects rebuilt from the out-of-band buffers refer to the message,
+    // so it's handed to a view, which is released once they are all gone
+    // the space belongs to this message alone until then, so the buffers can
+    // be writable like the originals
+    if (locked) {
+      n_pending->fetch_add(1);
+      release_lock();
+    }
+    channel_view view(*this, head, bytes, len);
+    obj = unpickle(
+        bytes, len,
+        [&view]() {
+          view.set_writable();
+          py::object owner = py::cast(std::move(view));
+          py::object mem_view = py::reinterpret_steal<py::object>(
+              PyMemoryView_FromObject(owner.ptr()));
+          if (!mem_view)
+            throw py::error_already_set();
+          return mem_view;
+        },
+        0);
+  }
 
+  if (t0)
+    record_latency(header->stats.receive_latency, t0);
   return obj;
 }
 
-void channel::dispose() {
-  if (munmap(shared_mem, capacity)) {
-    perror("munmap() failed");
-    abort();
+py::list channel::receive_many(const size_t max_n, const bool block) {
+  size_t size_t_size = sizeof(size_t);
+  uint64_t t0 = stats_on() ? util::get_time_ns() : 0;
+  std::vector<size_t> positions;
+  std::vector<size_t> lens;
+  begin_receive_many(block, max_n, positions, lens);
+
+  // copy all messages out at once, so the lock is only held once
+  size_t total_len = 0;
+  for (size_t len : lens)
+    total_len += len;
+  py::object copy = py::reinterpret_steal<py::object>(
+      PyByteArray_FromStringAndSize(nullptr, total_len));
+  if (!copy) {
+    end_receive(positions.data(), positions.size());
+    throw py::error_already_set();
   }
-  if (munmap(start, sizeof(std::atomic_size_t))) {
-    perror("munmap() failed");
-    abort();
+  char *bytes = PyByteArray_AS_STRING(copy.ptr());
+  size_t offset = 0;
+  for (size_t i = 0; i < positions.size(); i++) {
+    read_at(index_of(positions[i] + size_t_size), bytes + offset, lens[i]);
+    offset += lens[i];
+  }
+  end_receive(positions.data(), positions.size());
+
+  // deserialize
+  py::object mem_view;
+  auto get_owner = [&copy, &mem_view]() {
+    if (!mem_view) {
+      mem_view = py::reinterpret_steal<py::object>(
+          PyMemoryView_FromObject(copy.ptr()));
+      if (!mem_view)
+        throw py::error_already_set();
+    }
+    return mem_view;
+  };
+  py::list objs;
+  offset = 0;
+  for (size_t len : lens) {
+    objs.append(unpickle(bytes + offset, len, get_owner, offset));
+    offset += len;
+  }
+  if (t0)
+    record_latency(header->stats.receive_latency, t0);
+  return objs;
+}
+
+void channel_view::release() {
+  // the exports would be left pointing at space that is reused
+  if (n_exports > 0) {
+    throw py::buffer_error("the view has exported buffers");
   }
-  if (munmap(end, sizeof(std::atomic_size_t))) {
+  drop();
+}
+
+void channel_view::drop() {
+  if (owner) {
+    owner->release(pos);
+    owner->drop_view();
+    owner.reset();
+  }
+  copy.reset();
+  ptr = nullptr;
+  len = 0;
+}
+
+void channel::drop_view() {
+  views->n_views--;
+  if (views->n_views == 0 && views->disposed)
+    unmap();
+}
+
+void channel::dispose() {
+  // the views still alive keep the memory mapped
+  views->disposed = true;
+  if (views->n_views == 0)
+    unmap();
+}
+
+void channel::unmap() {
+  if (munmap(shared_mem, 2 * max_capacity)) {
     perror("munmap() failed");
     abort();
   }
-  if (munmap(full, sizeof(std::atomic_bool))) {
-    perror("munmap() failed");
+  if (close(shared_fd)) {
+    perror("close() failed");
     abort();
   }
   try {
@@ -212,6 +1670,16 @@ void channel::dispose() {
   } catch (...) {
     abort();
   }
+  try {
+    space_freed.destroy();
+  } catch (...) {
+    abort();
+  }
+  ready.dispose();
+  if (munmap(header, sizeof(channel_header))) {
+    perror("munmap() failed");
+    abort();
+  }
 }
 
 } // namespace snakefish
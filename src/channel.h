@@ -6,14 +6,19 @@
 #define SNAKEFISH_CHANNEL_H
 
 #include <atomic>
+#include <memory>
 #include <set>
+#include <string>
+#include <vector>
 
 #include <semaphore.h>
+#include <sys/uio.h>
 
 #include <pybind11/pybind11.h>
 namespace py = pybind11;
 
 #include "buffer.h"
+#include "notifier.h"
 #include "semaphore_t.h"
 
 namespace snakefish {
@@ -21,18 +26,195 @@ namespace snakefish {
 /**
  * \brief The default [pickle protocol]
  * (https://docs.python.org/3.8/library/pickle.html#data-stream-format).
+ *
+ * If the running Python doesn't support it, `pickle.HIGHEST_PROTOCOL` is used
+ * instead.
+ */
+const unsigned PICKLE_PROTOCOL = 5;
+
+/**
+ * \brief The minimum size of a [pickle buffer]
+ * (https://docs.python.org/3.8/library/pickle.html#out-of-band-buffers) that
+ * will be sent out of band.
+ *
+ * Smaller buffers are cheaper to copy into the pickle stream than to track.
+ * The value matches the frame size of pickle protocol 4 and above.
  */
-const unsigned PICKLE_PROTOCOL = 4;
+const size_t OOB_BUFFER_THRESHOLD = 64 * 1024;
 
 /**
- * \brief The default `channel` buffer size.
+ * \brief The default maximum `channel` buffer size.
  *
- * Note that the buffer will be allocated using `mmap()` with flag
- * `MAP_NORESERVE`, so the actual memory consumption is much lower
- * in general.
+ * Only address space is reserved for the buffer up front. Memory is allocated
+ * as the buffer grows.
  */
 const size_t DEFAULT_CHANNEL_SIZE = 2l * 1024l * 1024l * 1024l; // 2 GiB
 
+/**
+ * \brief The default initial `channel` buffer size.
+ */
+const size_t DEFAULT_INITIAL_CHANNEL_SIZE = 64 * 1024; // 64 KiB
+
+/**
+ * \brief The default amount of consumed `channel` buffer space after which
+ * its memory is handed back to the system. See `channel::set_trim_threshold()`.
+ */
+const size_t DEFAULT_TRIM_THRESHOLD = 16 * 1024 * 1024; // 16 MiB
+
+/**
+ * \brief An enum indicating the synchronization scheme of `channel`.
+ *
+ * `LOCKED` channels serialize all senders and receivers through a lock, so
+ * they can be shared by any number of processes.
+ *
+ * `SPSC` channels only support a single sender and a single receiver. The two
+ * sides synchronize through atomic `start`/`end` indices, and a semaphore is
+ * only touched when the receiver actually has to sleep.
+ */
+enum channel_mode { LOCKED, SPSC };
+
+/**
+ * \brief An enum indicating what kind of pages back the buffer of a
+ * `channel`.
+ *
+ * `DEFAULT_PAGES` are the regular pages of the system.
+ *
+ * `TRANSPARENT_HUGE_PAGES` asks the kernel to back the buffer with huge pages
+ * when it can, which cuts TLB misses on large buffers. This is only advice,
+ * and it has no effect unless transparent huge pages are enabled for shared
+ * memory (see `/sys/kernel/mm/transparent_hugepage/shmem_enabled`).
+ *
+ * `HUGETLB_PAGES` moves the buffer to pages of the reserved huge page pool
+ * (see `/proc/sys/vm/nr_hugepages`), which are guaranteed to be huge.
+ */
+enum page_policy { DEFAULT_PAGES, TRANSPARENT_HUGE_PAGES, HUGETLB_PAGES };
+
+/**
+ * \brief The layout of the ring buffer of a `channel`, shared by all
+ * processes using it.
+ *
+ * Message positions are translated to indices with
+ * `(pos - base) % capacity`. The layout only changes when the buffer grows,
+ * and is updated like a seqlock: `generation` is odd while an update is in
+ * progress.
+ */
+struct ring_layout {
+  std::atomic_size_t generation;
+  std::atomic_size_t base;
+  std::atomic_size_t capacity;
+};
+
+/**
+ * \brief The size of a cache line, assumed to be the same everywhere.
+ */
+const size_t CACHE_LINE_SIZE = 64;
+
+/**
+ * \brief Number of buckets of the latency histograms of `channel_stats`.
+ *
+ * Bucket `i` counts latencies in `[2^i, 2^(i+1))` nanoseconds, except for the
+ * last one, which counts everything longer.
+ */
+const size_t N_LATENCY_BUCKETS = 32;
+
+/**
+ * \brief Statistics of a `channel`, kept in its control block while enabled.
+ *
+ * All times are in nanoseconds.
+ */
+struct channel_stats {
+  // updated by senders
+  alignas(CACHE_LINE_SIZE) std::atomic_uint_fast64_t msgs_sent;
+  std::atomic_uint_fast64_t bytes_sent;
+  std::atomic_uint_fast64_t n_full;       // sends that found the buffer full
+  std::atomic_uint_fast64_t max_used;     // high-water mark of used bytes
+  std::atomic_uint_fast64_t send_wait_ns; // time blocked waiting for space
+  std::atomic_uint_fast64_t send_latency[N_LATENCY_BUCKETS];
+
+  // updated by receivers
+  alignas(CACHE_LINE_SIZE) std::atomic_uint_fast64_t msgs_received;
+  std::atomic_uint_fast64_t bytes_received;
+  std::atomic_uint_fast64_t receive_wait_ns; // time blocked waiting for
+                                             // messages
+  std::atomic_uint_fast64_t receive_latency[N_LATENCY_BUCKETS];
+
+  // updated by both
+  alignas(CACHE_LINE_SIZE) std::atomic_uint_fast64_t lock_wait_ns;
+};
+
+/**
+ * \brief The shared control block of a `channel`.
+ *
+ * All shared metadata lives in a single mapping. Fields written by senders and
+ * fields written by receivers are kept on separate cache lines, so that the
+ * two sides of an `SPSC` channel don't keep stealing each other's lines. See
+ * `channel` for the meaning of each field.
+ */
+struct channel_header {
+  alignas(CACHE_LINE_SIZE) ring_layout layout; // written when growing
+  std::atomic_bool stats_enabled;
+  std::atomic_int pages; // a page_policy
+  std::atomic_bool prefault;
+  std::atomic_size_t trim_threshold;
+  std::atomic_int numa_node; // -1 if not bound
+
+  // written by senders
+  alignas(CACHE_LINE_SIZE) std::atomic_size_t end;
+  std::atomic_bool full;
+  std::atomic_size_t n_queued;
+  std::atomic_size_t writers_waiting;
+  std::atomic_size_t trimmed;
+
+  // written by receivers
+  alignas(CACHE_LINE_SIZE) std::atomic_size_t start;
+  std::atomic_size_t read;
+  std::atomic_size_t n_pending;
+  std::atomic_bool reader_waiting;
+  std::atomic_size_t n_subscribers;
+  std::atomic_size_t untrimmed;
+
+  // only touched when taking the lock or sleeping
+  alignas(CACHE_LINE_SIZE) sem_t lock;
+  sem_t n_unread;
+  sem_t space_freed;
+
+  channel_stats stats;
+};
+
+/**
+ * \brief The Python functions used by channels to (de)serialize objects.
+ *
+ * These are looked up once per process by `get_pickle_funcs()`, rather than
+ * once per channel.
+ */
+struct pickle_funcs {
+  py::object pickler_type; // pickle.Pickler
+  py::object dumps;        // pickle.dumps()
+  py::object loads;        // pickle.loads()
+  py::object make_file;    // types.SimpleNamespace, used to make file-like
+                           // objects for pickle.Pickler
+  unsigned protocol;       // the pickle protocol actually used
+};
+
+/**
+ * \brief Get the Python functions used by channels to (de)serialize objects.
+ *
+ * The functions are imported on the first call. They are never released, so
+ * that nothing is left to release after the interpreter shuts down.
+ */
+const pickle_funcs &get_pickle_funcs();
+
+class channel_view;
+
+/**
+ * \brief Bookkeeping shared by all copies of a `channel` (or `object_store`)
+ * in a process, so that its memory stays mapped while views of it are alive.
+ */
+struct view_refs {
+  size_t n_views; // number of live views in this process
+  bool disposed;  // has dispose() been called in this process?
+};
+
 /**
  * \brief An IPC channel with built-in synchronization support.
  *
@@ -45,25 +227,48 @@ const size_t DEFAULT_CHANNEL_SIZE = 2l * 1024l * 1024l * 1024l; // 2 GiB
  * longer needed to release resources.
  *
  * Characteristics of the functions:
- * - `send_bytes()`: won't block; can throw
- * - `send_pyobj()`: won't block; can throw
+ * - `send_bytes()`: may or may not block^^; can throw
+ * - `send_pyobj()`: may or may not block^^; can throw
+ * - `send_bytes_many()`/`send_many()`: may or may not block^^; can throw
+ * - `reserve()`: may or may not block^^; can throw
+ * - `write()`/`commit()`/`cancel()`: won't block; can throw
  * - `receive_bytes()`: may or may not block^; can throw
+ * - `receive_view()`: may or may not block^; can throw
  * - `receive_pyobj()`: may or may not block^; can throw
+ * - `receive_bytes_many()`/`receive_many()`: may or may not block^; can throw
  *
  * ^: the client must specify whether the function should block when there's no
  * incoming messages to receive
  *
- * **NOTE**: When doing shared memory IO, a lock must be acquired for
- * synchronization purposes. As such, all functions mentioned above
- * can technically block on the said lock. The characteristics described
- * apply when there's no contention.
+ * ^^: by default, these functions throw when the buffer is full. The client may
+ * ask them to block (with an optional timeout) until the receiver frees enough
+ * space instead, which bounds the memory used by a channel
+ *
+ * **NOTE**: When doing shared memory IO on a `LOCKED` channel, a lock must be
+ * acquired for synchronization purposes. As such, all functions mentioned
+ * above can technically block on the said lock. The characteristics described
+ * apply when there's no contention. `SPSC` channels don't have this lock, but
+ * they must have exactly one sending process and one receiving process at
+ * any given time.
  */
 class channel {
 public:
   /**
-   * \brief Create a channel with buffer size `DEFAULT_CHANNEL_SIZE`.
+   * \brief Create a growable `LOCKED` channel with initial buffer size
+   * `DEFAULT_INITIAL_CHANNEL_SIZE` and maximum buffer size
+   * `DEFAULT_CHANNEL_SIZE`.
+   */
+  channel() : channel(channel_mode::LOCKED) {}
+
+  /**
+   * \brief Create a growable channel with initial buffer size
+   * `DEFAULT_INITIAL_CHANNEL_SIZE` and maximum buffer size
+   * `DEFAULT_CHANNEL_SIZE`.
+   *
+   * \param mode The synchronization scheme of the channel.
    */
-  channel() : channel(DEFAULT_CHANNEL_SIZE) {}
+  explicit channel(channel_mode mode)
+      : channel(DEFAULT_INITIAL_CHANNEL_SIZE, DEFAULT_CHANNEL_SIZE, mode) {}
 
   /**
    * \brief Default destructor.
@@ -90,36 +295,231 @@ public:
    */
   channel &operator=(channel &&t) = delete;
 
+  /**
+   * \brief Create a `LOCKED` channel with buffer size `size`.
+   *
+   * \param size The size of the underlying shared memory buffer.
+   */
+  explicit channel(size_t size) : channel(size, channel_mode::LOCKED) {}
+
   /**
    * \brief Create a channel with buffer size `size`.
    *
    * \param size The size of the underlying shared memory buffer.
+   * \param mode The synchronization scheme of the channel.
+   */
+  channel(size_t size, channel_mode mode) : channel(size, size, mode) {}
+
+  /**
+   * \brief Create a growable channel.
+   *
+   * The buffer is a shared memory object that starts at `size` bytes, and is
+   * grown (up to `max_size` bytes) when a message doesn't fit. Since messages
+   * are never moved, the buffer can only grow when the messages in it don't
+   * wrap around its end. Each process maps the new size the next time it
+   * uses the channel.
+   *
+   * On macOS, shared memory objects can't be resized, so the buffer is
+   * created with size `max_size` right away.
+   *
+   * \param size The initial size of the underlying shared memory buffer.
+   * \param max_size The maximum size of the underlying shared memory buffer.
+   * \param mode The synchronization scheme of the channel.
+   *
+   * \throws std::invalid_argument If `size` is 0 or greater than `max_size`.
    */
-  explicit channel(size_t size);
+  channel(size_t size, size_t max_size, channel_mode mode);
 
   /**
    * \brief Send some bytes.
    *
    * \param bytes Pointer to the start of the bytes.
    * \param len Number of bytes to send.
+   * \param block Should this function block until there's enough space?
+   * \param timeout Maximum number of seconds to block. If negative, there's no
+   * limit.
+   *
+   * \throws std::overflow_error If the underlying buffer does not have enough
+   * space to accommodate the request (when `block` is `true`, this means the
+   * timeout expired or the request is larger than the maximum buffer size).
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  void send_bytes(void *bytes, size_t len, bool block = false,
+                  double timeout = -1);
+
+  /**
+   * \brief Send some bytes gathered from multiple buffers as one message.
+   *
+   * \param iov The buffers to send, in order.
+   * \param iovcnt Number of buffers in `iov`.
+   * \param block Should this function block until there's enough space?
+   * \param timeout Maximum number of seconds to block. If negative, there's no
+   * limit.
    *
    * \throws std::overflow_error If the underlying buffer does not have enough
-   * space to accommodate the request.
+   * space to accommodate the request (when `block` is `true`, this means the
+   * timeout expired or the request is larger than the maximum buffer size).
    * \throws std::runtime_error If some semaphore error occurred.
    */
-  void send_bytes(void *bytes, size_t len);
+  void send_bytes(const struct iovec *iov, size_t iovcnt, bool block = false,
+                  double timeout = -1);
+
+  /**
+   * \brief Send multiple messages at once.
+   *
+   * The messages are published together, so a `LOCKED` channel only takes
+   * its lock once for the whole batch. Empty messages are skipped.
+   *
+   * If `block` is `false`, either all messages are sent or none of them is.
+   * Otherwise, the messages that fit are published before waiting for more
+   * space, and they stay sent even if a later message fails.
+   *
+   * \param msgs The messages to send, in order. Each element is a message.
+   * \param n Number of messages in `msgs`.
+   * \param block Should this function block until there's enough space?
+   * \param timeout Maximum number of seconds to block. If negative, there's no
+   * limit.
+   *
+   * \throws std::overflow_error If the underlying buffer does not have enough
+   * space to accommodate the request (when `block` is `true`, this means the
+   * timeout expired or the request is larger than the maximum buffer size).
+   * \throws std::runtime_error If a message is already being written OR if
+   * some semaphore error occurred.
+   */
+  void send_bytes_many(const struct iovec *msgs, size_t n, bool block = false,
+                       double timeout = -1);
+
+  /**
+   * \brief Start writing a message in place.
+   *
+   * This reserves space for a message of at least `len` bytes. The message
+   * is then filled with `write()`, and published with `commit()` (or
+   * abandoned with `cancel()`). The reservation grows as needed while the
+   * message is being written.
+   *
+   * For `LOCKED` channels, the lock is held until `commit()` or `cancel()` is
+   * called, so other senders and receivers will block in the meantime.
+   *
+   * Only the initial reservation may block. Growing it with `write()` never
+   * does.
+   *
+   * \param len Number of bytes to reserve.
+   * \param block Should this function block until there's enough space?
+   * \param timeout Maximum number of seconds to block. If negative, there's no
+   * limit.
+   *
+   * \throws std::overflow_error If the underlying buffer does not have enough
+   * space to accommodate the request (when `block` is `true`, this means the
+   * timeout expired or the request is larger than the maximum buffer size).
+   * \throws std::runtime_error If a message is already being written OR if
+   * some semaphore error occurred.
+   */
+  void reserve(size_t len, bool block = false, double timeout = -1);
+
+  /**
+   * \brief Append some bytes to the message being written.
+   *
+   * \param bytes Pointer to the start of the bytes.
+   * \param len Number of bytes to append.
+   *
+   * \throws std::overflow_error If the underlying buffer does not have enough
+   * space to accommodate the request. The message is still being written
+   * afterwards.
+   * \throws std::runtime_error If no message is being written.
+   */
+  void write(const void *bytes, size_t len);
+
+  /**
+   * \brief Append the contents of a Python bytes-like object to the message
+   * being written.
+   *
+   * Together with `reserve()` and `commit()`, this makes the channel usable as
+   * a file for `pickle.Pickler`.
+   *
+   * \returns The number of bytes appended.
+   *
+   * \throws std::overflow_error If the underlying buffer does not have enough
+   * space to accommodate the request. The message is still being written
+   * afterwards.
+   * \throws std::runtime_error If no message is being written.
+   */
+  size_t write(const py::buffer &b);
+
+  /**
+   * \brief Publish the message being written.
+   *
+   * Committing an empty message is the same as `cancel()`.
+   *
+   * \throws std::runtime_error If no message is being written OR if some
+   * semaphore error occurred.
+   */
+  void commit();
+
+  /**
+   * \brief Abandon the message being written. This is a no-op if no message
+   * is being written.
+   */
+  void cancel();
 
   /**
    * \brief Send a Python object.
    *
    * This function will serialize `obj` using `pickle` and send the binary
-   * output.
+   * output. The output is written directly into the shared buffer, using
+   * `reserve()` and `commit()`. With pickle protocol 5, [pickle buffers]
+   * (https://docs.python.org/3.8/library/pickle.html#out-of-band-buffers)
+   * of at least `OOB_BUFFER_THRESHOLD` bytes (e.g. those of NumPy arrays) are
+   * copied straight into the shared buffer instead of into the pickle stream.
+   *
+   * If the output turns out not to fit and `block` is `true`, it is moved
+   * into a private buffer while waiting for enough space.
+   *
+   * `LOCKED` channels pickle into a private buffer from the start instead,
+   * and only take `lock` to copy the output into the shared buffer, so that
+   * other processes aren't locked out while `pickle` runs.
+   *
+   * Objects supported by `codec` (e.g. small `int`s, `str`s, and tuples of
+   * them) are encoded directly instead, without calling into `pickle`.
+   *
+   * \param obj The object to send.
+   * \param block Should this function block until there's enough space?
+   * \param timeout Maximum number of seconds to block. If negative, there's no
+   * limit.
    *
    * \throws std::overflow_error If the underlying buffer does not have enough
-   * space to accommodate the request.
+   * space to accommodate the request (when `block` is `true`, this means the
+   * timeout expired or the request is larger than the maximum buffer size).
    * \throws std::runtime_error If some semaphore error occurred.
    */
-  void send_pyobj(const py::object &obj);
+  void send_pyobj(const py::object &obj, bool block = false,
+                  double timeout = -1);
+
+  /**
+   * \brief Send multiple Python objects at once.
+   *
+   * Each object is serialized the same way as `send_pyobj()` and becomes a
+   * message of its own, but the messages are published together. This saves
+   * a lock acquisition and a semaphore update per object, which dominates the
+   * cost of sending small objects. `LOCKED` channels serialize all objects
+   * before taking `lock`.
+   *
+   * If `block` is `false`, either all objects are sent or none of them is.
+   * Otherwise, the objects that fit are published before waiting for more
+   * space, and they stay sent even if a later object fails.
+   *
+   * \param objs The objects to send, in order.
+   * \param block Should this function block until there's enough space?
+   * \param timeout Maximum number of seconds to block. If negative, there's no
+   * limit.
+   *
+   * \throws std::overflow_error If the underlying buffer does not have enough
+   * space to accommodate the request (when `block` is `true`, this means the
+   * timeout expired or the request is larger than the maximum buffer size).
+   * \throws std::runtime_error If a message is already being written OR if
+   * some semaphore error occurred.
+   */
+  void send_many(const py::iterable &objs, bool block = false,
+                 double timeout = -1);
 
   /**
    * \brief Receive some bytes.
@@ -136,10 +536,64 @@ public:
    */
   buffer receive_bytes(bool block);
 
+  /**
+   * \brief Receive some bytes without copying them out of the shared buffer.
+   *
+   * The returned view points directly into the shared buffer, and the space
+   * occupied by the message won't be reused until the view is released. If
+   * the message happens to wrap around the end of the shared buffer and the
+   * buffer isn't mirrored (i.e. its size isn't a multiple of the page size),
+   * it will be copied into a private buffer instead.
+   *
+   * Views may be released in any order. However, since the shared buffer is
+   * a ring, space is reclaimed in the order messages were received, so an
+   * unreleased view holds back the space of all messages received after it.
+   *
+   * \param block Should this function block?
+   *
+   * \returns The received bytes wrapped in a `channel_view`.
+   *
+   * \throws std::out_of_range If the underlying buffer does not have enough
+   * content to accommodate the request (this only applies when `block` is
+   * `false`).
+   * \throws std::runtime_error If some semaphore error occurred.
+   * \throws std::bad_alloc If `malloc()` failed.
+   */
+  channel_view receive_view(bool block);
+
+  /**
+   * \brief Receive up to `max_n` messages at once.
+   *
+   * This blocks (if `block` is `true`) until at least one message is
+   * available, then takes as many of the available messages as possible
+   * under a single lock acquisition.
+   *
+   * \param max_n Maximum number of messages to receive.
+   * \param block Should this function block?
+   *
+   * \returns The received messages, in order, each wrapped in a `buffer`.
+   *
+   * \throws std::out_of_range If the underlying buffer does not have enough
+   * content to accommodate the request (this only applies when `block` is
+   * `false`).
+   * \throws std::invalid_argument If `max_n` is 0.
+   * \throws std::runtime_error If some semaphore error occurred.
+   * \throws std::bad_alloc If `malloc()` failed.
+   */
+  std::vector<buffer> receive_bytes_many(size_t max_n, bool block);
+
   /**
    * \brief Receive a Python object.
    *
    * This function will receive some bytes and deserialize them using `pickle`.
+   * The bytes are deserialized directly from the shared buffer. Out-of-band
+   * buffers are not copied at all: the objects rebuilt from them refer to the
+   * shared buffer, and the space of the message is only reclaimed once they
+   * are garbage collected. Other messages are handed back as soon as they
+   * are deserialized. The lock of a `LOCKED` channel is never held while
+   * deserializing, which may run arbitrary code; messages smaller than
+   * `OOB_BUFFER_THRESHOLD` are copied out instead, so that the lock is only
+   * taken once for them.
    *
    * \param block Should this function block?
    *
@@ -151,6 +605,173 @@ public:
    */
   py::object receive_pyobj(bool block);
 
+  /**
+   * \brief Receive a Python object that doesn't refer to the shared buffer.
+   *
+   * This is the same as `receive_pyobj()`, except that a message with
+   * out-of-band buffers is copied out first, so the objects rebuilt from them
+   * stay valid after the channel is disposed. This is what `thread` and
+   * `generator` use, since they dispose of their channels while the results
+   * may still be in use.
+   *
+   * \param block Should this function block?
+   *
+   * \throws std::out_of_range If the underlying buffer does not have enough
+   * content to accommodate the request (this only applies when `block` is
+   * `false`).
+   * \throws std::runtime_error If some semaphore error occurred.
+   * \throws std::bad_alloc If `malloc()` failed.
+   */
+  py::object receive_pyobj_copy(bool block);
+
+  /**
+   * \brief Receive up to `max_n` Python objects at once.
+   *
+   * The messages are taken the same way as `receive_bytes_many()` and copied
+   * out of the shared buffer in one go before being deserialized, so the lock
+   * of a `LOCKED` channel is only acquired once for the whole batch.
+   * Out-of-band buffers refer to the copy rather than the shared buffer.
+   *
+   * \param max_n Maximum number of objects to receive.
+   * \param block Should this function block?
+   *
+   * \returns A list of the received objects, in order.
+   *
+   * \throws std::out_of_range If the underlying buffer does not have enough
+   * content to accommodate the request (this only applies when `block` is
+   * `false`).
+   * \throws std::invalid_argument If `max_n` is 0.
+   * \throws std::runtime_error If some semaphore error occurred.
+   * \throws std::bad_alloc If `malloc()` failed.
+   */
+  py::list receive_many(size_t max_n, bool block);
+
+  /**
+   * \brief Check whether there's an unread message.
+   *
+   * If there are other receivers, a message seen here may still be taken by
+   * one of them before this process gets to it.
+   */
+  bool poll();
+
+  /**
+   * \brief Get the notifier signalled whenever messages are published.
+   */
+  notifier &get_notifier() { return ready; }
+
+  /**
+   * \brief Spin for a while before sleeping whenever this process has to
+   * wait for a message or for space.
+   *
+   * Spinning avoids a sleep and a wakeup when the other side is about to
+   * respond, at the cost of burning CPU time in the meantime. This only
+   * affects the calling process (and its children forked afterwards).
+   *
+   * \param max_spins Maximum number of checks before sleeping. The actual
+   * number adapts to how long waits turn out to be (see
+   * `util::spin_until()`). If 0, waits go straight to the kernel. This is the
+   * default.
+   */
+  void set_spin(unsigned max_spins);
+
+  /**
+   * \brief Start (or stop) collecting statistics.
+   *
+   * The setting is shared by all processes using this channel. While
+   * statistics are collected, every send and receive is timed, which costs a
+   * few dozen nanoseconds.
+   */
+  void enable_stats(bool enabled = true) {
+    header->stats_enabled.store(enabled);
+  }
+
+  /**
+   * \brief Reset all statistics to 0.
+   */
+  void reset_stats();
+
+  /**
+   * \brief Get the statistics collected so far.
+   *
+   * \returns A `dict` mapping the names of the fields of `channel_stats` to
+   * their values. The latency histograms are lists of counts, one per bucket.
+   * `send_latency` covers `send_pyobj()` and `send_many()` calls, and
+   * `receive_latency` covers `receive_pyobj()` and `receive_many()` calls
+   * (including the time spent blocked).
+   */
+  py::dict stats();
+
+  /**
+   * \brief Choose what kind of pages back the buffer, and whether its pages
+   * are faulted in as soon as they are mapped.
+   *
+   * The policy is shared by all processes using this channel, and applies to
+   * the current buffer as well as to whatever it grows into. Prefaulting
+   * takes the page faults up front rather than on the first messages through
+   * each page, which makes latencies more predictable at the cost of
+   * committing memory early.
+   *
+   * Switching to `HUGETLB_PAGES` moves the buffer to a new shared memory
+   * object, so it must be done before the channel is shared with other
+   * processes (i.e. before forking) and while it's empty. The capacities are
+   * rounded up to a multiple of the huge page size. If no huge pages are
+   * available, `TRANSPARENT_HUGE_PAGES` is used instead. Once the buffer
+   * has moved, it stays on huge pages.
+   *
+   * \param policy The kind of pages to use.
+   * \param prefault Should pages be faulted in when they are mapped?
+   *
+   * \returns The policy actually in effect.
+   *
+   * \throws std::runtime_error If `policy` is `HUGETLB_PAGES` but the channel
+   * isn't empty.
+   */
+  page_policy set_page_policy(page_policy policy, bool prefault = false);
+
+  /**
+   * \brief Set how much consumed buffer space may stay in memory.
+   *
+   * Pages of the buffer stay in memory once they have been written, so a
+   * burst of large messages would otherwise keep its footprint for as long
+   * as the channel lives. Instead, once `threshold` bytes have been consumed
+   * since the last time, the memory of the consumed space is handed back to
+   * the system. It's faulted in again (as zeros) when the space is reused.
+   *
+   * For `LOCKED` channels, this is done by the receivers. For `SPSC`
+   * channels, the receiver only does it for single receives of at least
+   * `threshold` bytes, since space it has handed back to the sender may
+   * already be reused. The rest is done by the sender the next time it
+   * sends.
+   *
+   * The setting is shared by all processes using this channel. The default
+   * is `DEFAULT_TRIM_THRESHOLD`.
+   *
+   * \param threshold Number of bytes. If 0, memory is never handed back.
+   */
+  void set_trim_threshold(size_t threshold) {
+    header->trim_threshold.store(threshold);
+  }
+
+  /**
+   * \brief Allocate the buffer on a NUMA node, typically the one of the
+   * receiver.
+   *
+   * Otherwise, each page lands on the node of the process that happens to
+   * touch it first. The pages already allocated are moved if possible, and
+   * the buffer stays on the node as it grows. The node is only preferred, so
+   * the buffer can still grow when the node runs out of memory.
+   *
+   * This is a no-op on systems with a single node.
+   *
+   * \param node The node. If negative, the node the calling process is
+   * running on.
+   *
+   * \returns The node used.
+   *
+   * \throws std::invalid_argument If `node` is not a node of the system.
+   */
+  int set_numa_node(int node = -1);
+
   /**
    * \brief Release resources held by this channel.
    */
@@ -162,41 +783,470 @@ protected:
    */
   void *shared_mem;
 
+  /**
+   * \brief The shared control block. Most of the fields below point into it.
+   */
+  channel_header *header;
+
   /**
    * \brief "Mutex" for the shared memory.
    */
   semaphore_t lock;
 
+  /**
+   * \brief Number of bytes freed since the memory of the consumed space was
+   * last handed back. Only used by `LOCKED` channels.
+   */
+  std::atomic_size_t *untrimmed;
+
+  /**
+   * \brief Position up to which the memory of the consumed space has been
+   * handed back. Only used by `SPSC` channels.
+   */
+  std::atomic_size_t *trimmed;
+
   /**
    * \brief Index of first used byte.
+   *
+   * For `SPSC` channels, this is a monotonically increasing position instead.
+   * The actual index is `*start % capacity`.
    */
   std::atomic_size_t *start;
 
   /**
    * \brief Index of first unused byte.
+   *
+   * For `SPSC` channels, this is a monotonically increasing position instead.
+   * The actual index is `*end % capacity`.
    */
   std::atomic_size_t *end;
 
+  /**
+   * \brief Index of first unread byte.
+   *
+   * Bytes between `start` and `read` belong to messages that have been
+   * received but are still referenced by some `channel_view`.
+   *
+   * For `SPSC` channels, this is a monotonically increasing position instead.
+   * The actual index is `*read % capacity`.
+   */
+  std::atomic_size_t *read;
+
+  /**
+   * \brief Number of messages between `start` and `read`.
+   *
+   * This is unused by `SPSC` channels, since `start == read` already tells
+   * whether there are pending messages.
+   */
+  std::atomic_size_t *n_pending;
+
   /**
    * \brief A flag indicating whether this buffer is full.
+   *
+   * This is unused by `SPSC` channels, since `*end - *start` already tells
+   * how many bytes are in use.
    */
   std::atomic_bool *full;
 
   /**
    * \brief A semaphore representing the number of unread messages.
+   *
+   * For `SPSC` channels, this is only posted when the receiver is (about to
+   * be) sleeping, so its value is merely a wakeup hint.
    */
   semaphore_t n_unread;
 
+  /**
+   * \brief Number of unread messages.
+   *
+   * Unlike `n_unread`, this can be checked without taking anything. This is
+   * unused by `SPSC` channels, since `*read != *end` already tells whether
+   * there are unread messages.
+   */
+  std::atomic_size_t *n_queued;
+
+  /**
+   * \brief Notifier signalled whenever messages are published, for
+   * `select()`.
+   */
+  notifier ready;
+
+  /**
+   * \brief A flag indicating whether the receiver of an `SPSC` channel is
+   * (about to be) sleeping on `n_unread`.
+   */
+  std::atomic_bool *reader_waiting;
+
+  /**
+   * \brief A semaphore posted when space is freed while some sender is
+   * waiting for it.
+   */
+  semaphore_t space_freed;
+
+  /**
+   * \brief Number of senders (about to be) sleeping on `space_freed`.
+   */
+  std::atomic_size_t *writers_waiting;
+
+  /**
+   * \brief The layout of the buffer, as set by the last growth.
+   */
+  ring_layout *layout;
+
   /**
    * \brief Number of bytes this buffer can hold.
+   *
+   * This is the value of `layout->capacity` last seen by this process.
    */
   size_t capacity;
 
+  /**
+   * \brief The value of `layout->base` last seen by this process.
+   */
+  size_t base;
+
+  /**
+   * \brief The value of `layout->generation` last seen by this process.
+   */
+  size_t generation;
+
+  /**
+   * \brief Maximum number of bytes this buffer can grow to hold. Twice as
+   * much address space is reserved at `shared_mem`, to leave room for the
+   * mirror.
+   */
+  size_t max_capacity;
+
+  /**
+   * \brief File descriptor of the shared memory object backing the buffer.
+   */
+  int shared_fd;
+
+  /**
+   * \brief Size of the pages backing the buffer. The buffer can only be
+   * mapped (and grown) in multiples of it.
+   */
+  size_t page_size;
+
+  /**
+   * \brief Whether the buffer is mapped a second time right after itself in
+   * this process.
+   *
+   * With the mirror, a range that wraps around the end of the buffer is still
+   * contiguous in memory. This requires `capacity` to be a multiple of the
+   * page size.
+   */
+  bool mirrored;
+
+  /**
+   * \brief The synchronization scheme of this channel.
+   */
+  channel_mode mode;
+
+  /**
+   * \brief The views of this channel alive in this process. `dispose()`
+   * leaves the memory mapped until the last one is released.
+   */
+  std::shared_ptr<view_refs> views;
+
 private:
+  friend class channel_view;
+
+  /**
+   * \brief Wait for an unread message, then return the position of its
+   * length header and move `read` past it.
+   *
+   * `lock` is held on return for `LOCKED` channels.
+   */
+  size_t begin_receive(bool block, size_t &len);
+
+  /**
+   * \brief Wait for at least one unread message, then take up to `max_n` of
+   * them. The positions of their length headers and their lengths are
+   * appended to `positions` and `lens`, and `read` is moved past them.
+   *
+   * `lock` is held on return for `LOCKED` channels.
+   */
+  void begin_receive_many(bool block, size_t max_n,
+                          std::vector<size_t> &positions,
+                          std::vector<size_t> &lens);
+
+  /**
+   * \brief Hand back the space of the `n` messages at `positions`, which have
+   * been taken by `begin_receive()` or `begin_receive_many()` and copied out.
+   *
+   * `lock` must be held for `LOCKED` channels, and is released on return.
+   */
+  void end_receive(const size_t *positions, size_t n);
+
+  /**
+   * \brief Wait until there's at least one unread message.
+   *
+   * For `LOCKED` channels, this takes one from `n_unread` but doesn't
+   * acquire `lock`.
+   */
+  void wait_for_message(bool block);
+
+  /**
+   * \brief Set the `RELEASED` flag of the message at position `pos`.
+   *
+   * `lock` must be held for `LOCKED` channels.
+   */
+  void mark_released(size_t pos);
+
+  /**
+   * \brief Start a batch of messages. Messages committed until `end_batch()`
+   * is called are only published then.
+   *
+   * `lock` is held until the batch ends for `LOCKED` channels.
+   */
+  void begin_batch();
+
+  /**
+   * \brief Publish all messages committed since `begin_batch()`.
+   */
+  void end_batch();
+
+  /**
+   * \brief Abandon all messages committed since `begin_batch()`.
+   */
+  void abort_batch();
+
+  /**
+   * \brief Wait until `n` bytes are available, or until `timeout` seconds
+   * have passed.
+   *
+   * Messages committed in the current batch are published first, since they
+   * can't be consumed otherwise. `lock` must be held for `LOCKED` channels,
+   * and is held again on return.
+   *
+   * \returns `true` if enough space is available.
+   */
+  bool wait_for_space(size_t n, double timeout);
+
+  /**
+   * \brief Wake up the senders waiting in `wait_for_space()`.
+   *
+   * `lock` must be held for `LOCKED` channels.
+   */
+  void notify_writers();
+
+  /**
+   * \brief Publish `n_msgs` messages occupying the `len` bytes after `end`.
+   *
+   * `lock` must be held for `LOCKED` channels, and is released on return.
+   */
+  void publish(size_t len, size_t n_msgs);
+
+  /**
+   * \brief A Python object serialized into private memory, waiting to be
+   * copied into the shared buffer.
+   */
+  struct serialized_obj {
+    serialized_obj() = default;
+    serialized_obj(const serialized_obj &) = delete;
+    ~serialized_obj() {
+      for (Py_buffer &view : oob_bufs)
+        PyBuffer_Release(&view);
+    }
+
+    std::string data;                // the codec or pickle output
+    std::vector<Py_buffer> oob_bufs; // the out-of-band buffers
+    std::vector<size_t> trailer;     // empty for codec output
+  };
+
+  /**
+   * \brief Create a pickler writing through `write_func`, which keeps pickle
+   * buffers of at least `OOB_BUFFER_THRESHOLD` bytes out of band by adding
+   * them to `oob_bufs`.
+   */
+  py::object make_pickler(const py::cpp_function &write_func,
+                          std::vector<Py_buffer> &oob_bufs);
+
+  /**
+   * \brief Serialize `obj` the same way as `send_pyobj()`, but into `out`.
+   *
+   * This doesn't touch the shared buffer, so that `LOCKED` channels don't
+   * hold `lock` while `pickle` runs.
+   */
+  void serialize(const py::object &obj, serialized_obj &out);
+
+  /**
+   * \brief Send an object serialized by `serialize()`.
+   */
+  void send_serialized(const serialized_obj &obj, bool block, double timeout);
+
+  /**
+   * \brief Deserialize a message produced by `send_pyobj()`.
+   *
+   * \param bytes Pointer to the start of the message.
+   * \param len Length of the message.
+   * \param get_owner Returns a writable `memoryview` covering the message,
+   * out of which the out-of-band buffers are sliced. Only called if there
+   * are out-of-band buffers.
+   * \param offset Offset of the message in the `memoryview`.
+   */
+  template <typename F>
+  py::object unpickle(const char *bytes, size_t len, F get_owner,
+                      size_t offset);
+
+  /**
+   * \brief Common implementation of `receive_pyobj()` and
+   * `receive_pyobj_copy()`.
+   */
+  py::object _receive_pyobj(bool block, bool copy_buffers);
+
+  /**
+   * \brief Mark the message at position `pos` as released and reclaim as
+   * much space as possible.
+   */
+  void release(size_t pos);
+
+  /**
+   * \brief Forget a view that was released, finishing `dispose()` if it was
+   * the last one.
+   */
+  void drop_view();
+
+  /**
+   * \brief Unmap the memory of this channel and destroy its semaphores.
+   */
+  void unmap();
+
   /**
-   * \brief Acquire `lock`.
+   * \brief Move `start` past all released messages.
+   *
+   * `lock` must be held for `LOCKED` channels.
+   */
+  void reclaim();
+
+  /**
+   * \brief Get the number of bytes that can be written into the shared
+   * buffer.
+   *
+   * `lock` must be held for `LOCKED` channels.
+   */
+  size_t get_available_space();
+
+  /**
+   * \brief Try to grow the shared buffer so that `n` bytes are available
+   * after the published messages. `written` of these bytes (the current batch
+   * and message) have already been written.
+   *
+   * `lock` must be held for `LOCKED` channels.
+   *
+   * \returns `true` if the buffer has grown.
+   */
+  bool grow(size_t n, size_t written);
+
+  /**
+   * \brief Pick up changes made to `layout` by other processes, mapping more
+   * of the shared buffer if needed.
+   */
+  void sync_layout();
+
+  /**
+   * \brief Make sure that the message being written can have `n` bytes
+   * (including its length header), growing the reservation if needed.
+   *
+   * \returns `true` on success.
+   */
+  bool extend_reservation(size_t n);
+
+  /**
+   * \brief Translate a position to an index into the shared buffer.
+   */
+  size_t index_of(size_t pos) { return (pos - base) % capacity; }
+
+  /**
+   * \brief Map the first `len` bytes of the shared memory object at
+   * `shared_mem`, followed by the mirror if possible.
+   */
+  void map_buffer(size_t len);
+
+  /**
+   * \brief Apply the page policy in `header` to the first `len` bytes of the
+   * buffer (and their mirror).
+   */
+  void advise_buffer(size_t len);
+
+  /**
+   * \brief Move the buffer to a new shared memory object backed by the huge
+   * page pool. The channel must be empty and not shared yet.
+   *
+   * \returns `true` on success. Nothing changes on failure.
+   */
+  bool use_hugetlb();
+
+  /**
+   * \brief Copy `len` bytes from `src` into the shared buffer at index `idx`,
+   * wrapping around if necessary.
+   */
+  void write_at(size_t idx, const void *src, size_t len);
+
+  /**
+   * \brief Copy `len` bytes from the shared buffer at index `idx` into `dst`,
+   * wrapping around if necessary.
+   */
+  void read_at(size_t idx, void *dst, size_t len);
+
+  /**
+   * \brief Hand the memory of the whole pages among the `len` bytes at index
+   * `idx` of the buffer back to the system, wrapping around if necessary.
+   */
+  void release_space(size_t idx, size_t len);
+
+  /**
+   * \brief Account for `n` bytes freed by a receiver, handing the memory of
+   * the consumed space behind `start` back to the system if
+   * `trim_threshold` is reached.
+   *
+   * For `LOCKED` channels, `lock` must be held. For `SPSC` channels, this
+   * must be called before `start` is moved past the freed space, which is
+   * the `n` bytes at position `pos`.
+   */
+  void trim_freed(size_t pos, size_t n);
+
+  /**
+   * \brief Hand the memory of the space consumed since the last call back to
+   * the system if `trim_threshold` is reached. Only for the sender of `SPSC`
+   * channels, outside of reservations and batches.
+   */
+  void trim_consumed();
+
+  /**
+   * \brief Acquire `lock`, then pick up changes made to `layout`.
+   */
+  void acquire_lock();
+
+  /**
+   * \brief Check whether statistics are being collected.
+   */
+  bool stats_on() {
+    return header->stats_enabled.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * \brief Add the time elapsed since `t0` (as returned by
+   * `util::get_time_ns()`) to the latency histogram `hist`.
+   */
+  void record_latency(std::atomic_uint_fast64_t *hist, uint64_t t0);
+
+  /**
+   * \brief Count `n_msgs` messages taking `len` bytes (including their length
+   * headers) as sent.
+   */
+  void count_sent(size_t len, size_t n_msgs);
+
+  /**
+   * \brief Count `n_msgs` messages of `len` bytes in total as received.
+   */
+  void count_received(size_t len, size_t n_msgs);
+
+  /**
+   * \brief Call `wait_for_message()`, counting the time spent blocked.
    */
-  void acquire_lock() { lock.wait(); }
+  void wait_for_message_timed(bool block);
 
   /**
    * \brief Release `lock`.
@@ -204,14 +1254,139 @@ private:
   void release_lock() { lock.post(); }
 
   /**
-   * \brief `pickle.dumps()`
+   * \brief The functions used to (de)serialize objects.
+   */
+  const pickle_funcs &pickle;
+
+  bool reserving;        // is a message being written?
+  size_t reserved_begin; // position of the message being written
+  size_t reserved_len;   // number of bytes written so far
+  size_t reserved_space; // number of bytes known to be available
+
+  bool batching;      // is a batch being written?
+  size_t batch_len;   // number of bytes committed in the batch so far
+  size_t batch_count; // number of messages committed in the batch so far
+
+  unsigned max_spins;   // see set_spin()
+  unsigned spin_budget; // see util::spin_until()
+};
+
+/**
+ * \brief A read-only view of a message received with
+ * `channel::receive_view()`.
+ *
+ * The space occupied by the message is handed back to the channel when the
+ * view is released, either explicitly with `release()` or by destroying it.
+ * The memory of the channel stays mapped until then, even if the channel is
+ * disposed first.
+ */
+class channel_view {
+public:
+  /**
+   * \brief No default constructor.
+   */
+  channel_view() = delete;
+
+  /**
+   * \brief Destructor. Releases the view.
+   */
+  ~channel_view() { drop(); }
+
+  /**
+   * \brief No copy constructor.
+   */
+  channel_view(const channel_view &t) = delete;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  channel_view &operator=(const channel_view &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  channel_view(channel_view &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
    */
-  py::object dumps;
+  channel_view &operator=(channel_view &&t) = delete;
 
   /**
-   * \brief `pickle.loads()`
+   * \brief Get a pointer to the start of the message.
    */
-  py::object loads;
+  const void *get_ptr() { return ptr; }
+
+  /**
+   * \brief Get the length (in bytes) of the message.
+   */
+  size_t get_len() { return len; }
+
+  /**
+   * \brief Is the view read-only?
+   */
+  bool is_readonly() { return readonly; }
+
+  /**
+   * \brief Allow the message to be modified in place.
+   *
+   * The space of a message isn't touched by the channel until it is
+   * released, so this is safe as long as nothing else reads the message.
+   */
+  void set_writable() { readonly = false; }
+
+  /**
+   * \brief Count a buffer exported to Python (e.g. a `memoryview`).
+   */
+  void add_export() { n_exports++; }
+
+  /**
+   * \brief Forget a buffer exported to Python once it's released.
+   */
+  void remove_export() { n_exports--; }
+
+  /**
+   * \brief Hand the space occupied by the message back to the channel.
+   *
+   * The view must not be accessed afterwards. Releasing a view more than once
+   * is a no-op.
+   *
+   * \throws py::buffer_error If buffers exported to Python are still alive.
+   */
+  void release();
+
+private:
+  friend class channel;
+
+  /**
+   * \brief Release the view, regardless of exported buffers.
+   */
+  void drop();
+
+  /**
+   * \brief Create a view of the message at position `pos` of `owner`.
+   */
+  channel_view(const channel &owner, size_t pos, const void *ptr, size_t len)
+      : owner(new channel(owner)), copy(), pos(pos), ptr(ptr), len(len),
+        readonly(true), n_exports(0) {
+    this->owner->views->n_views++;
+  }
+
+  /**
+   * \brief Create a view of a message that has been copied out.
+   */
+  explicit channel_view(buffer &&copy)
+      : owner(), copy(new buffer(std::move(copy))), pos(0),
+        ptr(this->copy->get_ptr()), len(this->copy->get_len()),
+        readonly(true), n_exports(0) {}
+
+  std::unique_ptr<channel> owner; // null if not backed by a channel
+  std::unique_ptr<buffer> copy;   // null if backed by a channel
+  size_t pos;
+  const void *ptr;
+  size_t len;
+  bool readonly;
+  size_t n_exports; // number of buffers exported to Python
 };
 
 } // namespace snakefish
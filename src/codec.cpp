@@ -0,0 +1,136 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdexcept>
+
+#include "codec.h"
+
+namespace snakefish {
+
+namespace codec {
+
+size_t encoded_size(PyObject *obj, const unsigned depth) {
+  size_t size_t_size = sizeof(size_t);
+
+  if (obj == Py_None || obj == Py_True || obj == Py_False) {
+    return 1;
+  } else if (PyLong_CheckExact(obj)) {
+    int overflow = 0;
+    PyLong_AsLongLongAndOverflow(obj, &overflow);
+    return overflow ? 0 : 1 + sizeof(int64_t);
+  } else if (PyFloat_CheckExact(obj)) {
+    return 1 + sizeof(double);
+  } else if (PyBytes_CheckExact(obj)) {
+    return 1 + size_t_size + PyBytes_GET_SIZE(obj);
+  } else if (PyUnicode_CheckExact(obj)) {
+    // strings with lone surrogates have no UTF-8 form, so pickle deals with
+    // them
+    Py_ssize_t len = 0;
+    if (PyUnicode_AsUTF8AndSize(obj, &len) == nullptr) {
+      PyErr_Clear();
+      return 0;
+    }
+    return 1 + size_t_size + len;
+  } else if (PyTuple_CheckExact(obj) && depth < MAX_TUPLE_DEPTH) {
+    size_t size = 1 + size_t_size;
+    Py_ssize_t n = PyTuple_GET_SIZE(obj);
+    for (Py_ssize_t i = 0; i < n; i++) {
+      size_t item_size = encoded_size(PyTuple_GET_ITEM(obj, i), depth + 1);
+      if (item_size == 0)
+        return 0;
+      size += item_size;
+    }
+    return size;
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Take ownership of a new reference returned by the C API.
+ *
+ * \throws py::error_already_set If `obj` is `null`.
+ */
+static py::object own(PyObject *obj) {
+  if (obj == nullptr)
+    throw py::error_already_set();
+  return py::reinterpret_steal<py::object>(obj);
+}
+
+/**
+ * \brief Decode the object at `p`, and move `p` past it.
+ */
+static py::object decode_at(const char *&p, const char *end) {
+  size_t size_t_size = sizeof(size_t);
+  auto take = [&p, end](void *dst, size_t len) {
+    if (static_cast<size_t>(end - p) < len) {
+      throw std::runtime_error("malformed message");
+    }
+    memcpy(dst, p, len);
+    p += len;
+  };
+
+  unsigned char t = 0;
+  take(&t, 1);
+  switch (t) {
+  case TAG_NONE:
+    return py::none();
+  case TAG_TRUE:
+    return py::bool_(true);
+  case TAG_FALSE:
+    return py::bool_(false);
+  case TAG_INT: {
+    int64_t val = 0;
+    take(&val, sizeof(val));
+    return own(PyLong_FromLongLong(val));
+  }
+  case TAG_FLOAT: {
+    double val = 0;
+    take(&val, sizeof(val));
+    return own(PyFloat_FromDouble(val));
+  }
+  case TAG_BYTES:
+  case TAG_STR: {
+    size_t len = 0;
+    take(&len, size_t_size);
+    if (static_cast<size_t>(end - p) < len) {
+      throw std::runtime_error("malformed message");
+    }
+    py::object obj =
+        own(t == TAG_BYTES ? PyBytes_FromStringAndSize(p, len)
+                           : PyUnicode_DecodeUTF8(p, len, "strict"));
+    p += len;
+    return obj;
+  }
+  case TAG_TUPLE: {
+    size_t n = 0;
+    take(&n, size_t_size);
+    if (static_cast<size_t>(end - p) < n) {
+      // every item takes at least one byte
+      throw std::runtime_error("malformed message");
+    }
+    py::tuple items(n);
+    for (size_t i = 0; i < n; i++) {
+      py::object item = decode_at(p, end);
+      PyTuple_SET_ITEM(items.ptr(), i, item.release().ptr());
+    }
+    return std::move(items);
+  }
+  default:
+    throw std::runtime_error("malformed message");
+  }
+}
+
+py::object decode(const char *bytes, const size_t len) {
+  const char *p = bytes;
+  const char *end = bytes + len;
+  py::object obj = decode_at(p, end);
+  if (p != end) {
+    throw std::runtime_error("malformed message");
+  }
+  return obj;
+}
+
+} // namespace codec
+
+} // namespace snakefish
@@ -0,0 +1,138 @@
+/**
+ * \file codec.h
+ */
+
+#ifndef SNAKEFISH_CODEC_H
+#define SNAKEFISH_CODEC_H
+
+#include <cstdint>
+#include <cstring>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+namespace snakefish {
+
+/**
+ * \brief A compact encoding of common Python objects, so that they can be sent
+ * without going through `pickle`.
+ *
+ * `None`, `bool`, `int` (when it fits in 64 bits), `float`, `bytes`, `str`,
+ * and `tuple`s of these are supported. Subclasses are not, since they wouldn't
+ * survive the round trip. Everything else has to be pickled.
+ *
+ * An encoded object starts with a tag byte, which is never the first byte of
+ * a `pickle` stream (the `PROTO` opcode), so both can share a wire format.
+ * Numbers and lengths are stored in native byte order, since both sides run
+ * on the same machine.
+ */
+namespace codec {
+
+/**
+ * \brief The first byte of a `pickle` stream of protocol 2 or higher.
+ */
+const unsigned char PICKLE_PROTO = 0x80;
+
+/**
+ * \brief The maximum nesting depth of tuples that are encoded.
+ *
+ * Anything deeper is pickled, which also bounds the recursion here.
+ */
+const unsigned MAX_TUPLE_DEPTH = 8;
+
+/**
+ * \brief Tags of the encoded types.
+ */
+enum tag : unsigned char {
+  TAG_NONE = 1,
+  TAG_TRUE,
+  TAG_FALSE,
+  TAG_INT,   // followed by an int64_t
+  TAG_FLOAT, // followed by a double
+  TAG_BYTES, // followed by the length (size_t) and the bytes
+  TAG_STR,   // followed by the length (size_t) and the UTF-8 bytes
+  TAG_TUPLE, // followed by the number of items (size_t) and the items
+};
+
+/**
+ * \brief Get the size of the encoding of `obj`.
+ *
+ * \returns The number of bytes, or 0 if `obj` can't be encoded and has to be
+ * pickled instead.
+ */
+size_t encoded_size(PyObject *obj, unsigned depth = 0);
+
+/**
+ * \brief Encode `obj`, which must be encodable (see `encoded_size()`).
+ *
+ * \param obj The object to encode.
+ * \param write A function taking a pointer and a number of bytes, called with
+ * consecutive pieces of the encoding.
+ */
+template <typename W> void encode(PyObject *obj, W &write) {
+  size_t size_t_size = sizeof(size_t);
+  unsigned char header[1 + sizeof(double) + sizeof(size_t)];
+
+  if (obj == Py_None) {
+    header[0] = TAG_NONE;
+    write(header, 1);
+  } else if (obj == Py_True) {
+    header[0] = TAG_TRUE;
+    write(header, 1);
+  } else if (obj == Py_False) {
+    header[0] = TAG_FALSE;
+    write(header, 1);
+  } else if (PyLong_CheckExact(obj)) {
+    int64_t val = PyLong_AsLongLong(obj);
+    header[0] = TAG_INT;
+    memcpy(header + 1, &val, sizeof(val));
+    write(header, 1 + sizeof(val));
+  } else if (PyFloat_CheckExact(obj)) {
+    double val = PyFloat_AS_DOUBLE(obj);
+    header[0] = TAG_FLOAT;
+    memcpy(header + 1, &val, sizeof(val));
+    write(header, 1 + sizeof(val));
+  } else if (PyBytes_CheckExact(obj)) {
+    size_t len = PyBytes_GET_SIZE(obj);
+    header[0] = TAG_BYTES;
+    memcpy(header + 1, &len, size_t_size);
+    write(header, 1 + size_t_size);
+    write(PyBytes_AS_STRING(obj), len);
+  } else if (PyUnicode_CheckExact(obj)) {
+    // the UTF-8 form is cached by encoded_size()
+    Py_ssize_t len = 0;
+    const char *utf8 = PyUnicode_AsUTF8AndSize(obj, &len);
+    header[0] = TAG_STR;
+    memcpy(header + 1, &len, size_t_size);
+    write(header, 1 + size_t_size);
+    write(utf8, len);
+  } else {
+    size_t n = PyTuple_GET_SIZE(obj);
+    header[0] = TAG_TUPLE;
+    memcpy(header + 1, &n, size_t_size);
+    write(header, 1 + size_t_size);
+    for (size_t i = 0; i < n; i++)
+      encode(PyTuple_GET_ITEM(obj, i), write);
+  }
+}
+
+/**
+ * \brief Check whether a message was encoded by `encode()` rather than
+ * pickled.
+ */
+static inline bool is_encoded(const char *bytes, const size_t len) {
+  return len > 0 && static_cast<unsigned char>(bytes[0]) != PICKLE_PROTO;
+}
+
+/**
+ * \brief Decode an object encoded by `encode()`.
+ *
+ * \throws std::runtime_error If the encoding is malformed.
+ */
+py::object decode(const char *bytes, size_t len);
+
+} // namespace codec
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_CODEC_H
@@ -1,11 +1,13 @@
 #include "generator.h"
+#include "util.h"
 
 namespace snakefish {
 
 generator::generator(const py::function &f)
     : is_parent(false), child_pid(0), started(false), joined(false),
-      child_status(0), extract_func(), merge_func(), _channel(),
-      cmd_channel(1024), next_sent(false), stop_sent(false), merging(false) {
+      child_status(0), extract_func(), merge_func(),
+      _channel(channel_mode::SPSC), cmd_channel(1024, channel_mode::SPSC),
+      next_sent(false), stop_sent(false), merging(false), numa_node(-1) {
 
   py::object is_gen_func =
       py::module::import("inspect").attr("isgeneratorfunction");
@@ -22,8 +24,9 @@ generator::generator(const py::function &f, py::function extract,
                      py::function merge)
     : is_parent(false), child_pid(0), started(false), joined(false),
       child_status(0), extract_func(std::move(extract)),
-      merge_func(std::move(merge)), _channel(), cmd_channel(1024),
-      next_sent(false), stop_sent(false), merging(true) {
+      merge_func(std::move(merge)), _channel(channel_mode::SPSC),
+      cmd_channel(1024, channel_mode::SPSC),
+      next_sent(false), stop_sent(false), merging(true), numa_node(-1) {
 
   py::object is_gen_func =
       py::module::import("inspect").attr("isgeneratorfunction");
@@ -36,6 +39,13 @@ generator::generator(const py::function &f, py::function extract,
   _next = py::getattr(gen, "__next__");
 }
 
+void generator::set_numa_node(int node) {
+  if (node < 0)
+    node = util::get_numa_node();
+  util::check_numa_node(node);
+  numa_node = node;
+}
+
 void generator::start() {
   if (started) {
     throw std::runtime_error("this generator has already been started");
@@ -50,6 +60,8 @@ void generator::start() {
     is_parent = false;
     child_pid = 0;
     started = true;
+    if (numa_node >= 0)
+      util::run_on_numa_node(numa_node);
     run();
   } else {
     perror("fork() failed");
@@ -63,13 +75,13 @@ py::object generator::next(bool block) {
     next_sent = true;
   }
 
-  py::object val = _channel.receive_pyobj(block);
+  py::object val = _channel.receive_pyobj_copy(block);
   next_sent = false;
 
   if (py::isinstance(val, PyExc_Exception)) {
     // handle exceptions
-    py::object type = _channel.receive_pyobj(true);
-    py::object traceback = _channel.receive_pyobj(true);
+    py::object type = _channel.receive_pyobj_copy(true);
+    py::object traceback = _channel.receive_pyobj_copy(true);
 
     if (!py::isinstance(val, PyExc_StopIteration)) {
       py::print(py::str("").attr("join")(traceback));
@@ -81,6 +93,19 @@ py::object generator::next(bool block) {
   }
 }
 
+bool generator::poll() {
+  if (!started) {
+    throw std::runtime_error("this generator has not been started yet");
+  }
+
+  if (!next_sent) {
+    send_cmd(generator_cmd::NEXT);
+    next_sent = true;
+  }
+
+  return _channel.poll();
+}
+
 void generator::join() {
   if (!started) {
     throw std::runtime_error("this generator has not been started yet");
@@ -105,7 +130,7 @@ void generator::join() {
   } else {
     joined = true;
     if (merging) {
-      globals = _channel.receive_pyobj(true);
+      globals = _channel.receive_pyobj_copy(true);
       merge_func(py::globals(), globals);
     }
   }
@@ -137,7 +162,7 @@ bool generator::try_join() {
   } else {
     joined = true;
     if (merging) {
-      globals = _channel.receive_pyobj(true);
+      globals = _channel.receive_pyobj_copy(true);
       merge_func(py::globals(), globals);
     }
     return true;
@@ -179,22 +204,18 @@ void generator::run() {
       break;
     } else if (cmd == generator_cmd::NEXT) {
       try {
-        _channel.send_pyobj(_next());
-      } catch (py::error_already_set &e) {
-        // send exceptions to parent
-        _channel.send_pyobj(e.value());
-        _channel.send_pyobj(e.type());
-
-        // send traceback
-        if (e.trace()) {
-          _channel.send_pyobj(
-              py::module::import("traceback")
-                  .attr("format_exception")(e.type(), e.value(), e.trace()));
-        } else {
-          _channel.send_pyobj(
-              py::module::import("traceback")
-                  .attr("format_exception_only")(e.type(), e.value()));
+        try {
+          _channel.send_pyobj(_next());
+        } catch (py::error_already_set &e) {
+          // send exceptions to parent
+          send_exception(e.value(), e.type(), e.trace());
         }
+      } catch (const std::exception &e) {
+        // e.g. the value doesn't fit in the channel, or can't be pickled
+        // the parent is waiting for it, so it gets a `RuntimeError` instead
+        py::object type =
+            py::reinterpret_borrow<py::object>(PyExc_RuntimeError);
+        send_exception(type(e.what()), type, py::object());
       }
     } else {
       fprintf(stderr, "unknown command: %d!\n", cmd);
@@ -203,12 +224,33 @@ void generator::run() {
   }
 
   if (merging) {
-    globals = extract_func(py::globals());
-    _channel.send_pyobj(globals);
+    try {
+      globals = extract_func(py::globals());
+      _channel.send_pyobj(globals);
+    } catch (const std::exception &) {
+      // the parent is waiting for the globals, so it gets none instead
+      _channel.send_pyobj(py::dict());
+    }
   }
   std::exit(0);
 }
 
+void generator::send_exception(const py::object &value,
+                               const py::object &type,
+                               const py::object &trace) {
+  _channel.send_pyobj(value);
+  _channel.send_pyobj(type);
+
+  // send traceback
+  if (trace) {
+    _channel.send_pyobj(py::module::import("traceback")
+                            .attr("format_exception")(type, value, trace));
+  } else {
+    _channel.send_pyobj(py::module::import("traceback")
+                            .attr("format_exception_only")(type, value));
+  }
+}
+
 void generator::send_cmd(generator_cmd cmd) {
   if (!is_parent) {
     fprintf(stderr, "send_cmd() called by child!\n");
@@ -102,6 +102,14 @@ public:
    */
   void start();
 
+  /**
+   * \brief Run this generator on the CPUs of a NUMA node, and allocate its
+   * memory there. See `thread::set_numa_node()`.
+   *
+   * This only has an effect if it's called before `start()`.
+   */
+  void set_numa_node(int node = -1);
+
   /**
    * \brief Get the next output of the generator.
    *
@@ -113,6 +121,34 @@ public:
    */
   py::object next(bool block);
 
+  /**
+   * \brief Check whether the next output is ready, i.e. whether `next(false)`
+   * would return (or rethrow) without throwing `std::out_of_range`.
+   *
+   * Like `next()`, this asks the generator for its next output if it hasn't
+   * been asked yet.
+   *
+   * \throws std::runtime_error If this generator has not been started yet.
+   */
+  bool poll();
+
+  /**
+   * \brief Get the notifier signalled whenever the generator outputs
+   * something.
+   */
+  notifier &get_notifier() { return _channel.get_notifier(); }
+
+  /**
+   * \brief Spin for a while before sleeping whenever the parent waits for an
+   * output or the child waits for a command. See `channel::set_spin()`.
+   *
+   * This only affects the child if it's called before `start()`.
+   */
+  void set_spin(unsigned max_spins) {
+    _channel.set_spin(max_spins);
+    cmd_channel.set_spin(max_spins);
+  }
+
   /**
    * \brief Join this generator.
    *
@@ -160,6 +196,13 @@ private:
    */
   void run();
 
+  /**
+   * \brief Send the exception `value` of type `type`, along with its
+   * formatted traceback `trace` (if not null), to the parent.
+   */
+  void send_exception(const py::object &value, const py::object &type,
+                      const py::object &trace);
+
   /**
    * \brief Send a command to the child.
    */
@@ -185,6 +228,7 @@ private:
   bool next_sent;      // has command NEXT been sent?
   bool stop_sent;      // has command STOP been sent?
   bool merging;        // should globals be merged?
+  int numa_node;       // the node to run on, or -1
 };
 
 } // namespace snakefish
@@ -1,31 +1,105 @@
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <string>
 #include <thread>
 
+#include <poll.h>
+
+#include "channel.h"
+#include "generator.h"
 #include "misc.h"
+#include "mpmc_channel.h"
 #include "thread.h"
+#include "util.h"
 
 namespace snakefish {
 
-static std::vector<py::object>
-map_thread_func(const py::function &f, const std::vector<py::handle> &args) {
+py::object pack_results(const std::vector<py::object> &results) {
+  bool all_floats = true;
+  bool all_ints = true;
+  for (const py::object &result : results) {
+    all_floats = all_floats && PyFloat_CheckExact(result.ptr());
+    all_ints = all_ints && PyLong_CheckExact(result.ptr());
+  }
+  if (results.empty() || !(all_floats || all_ints))
+    return py::cast(results);
+
+  std::string bytes(results.size() * sizeof(double), '\0');
+  for (size_t i = 0; i < results.size(); i++) {
+    if (all_floats) {
+      double val = PyFloat_AS_DOUBLE(results[i].ptr());
+      memcpy(&bytes[i * sizeof(val)], &val, sizeof(val));
+    } else {
+      int overflow = 0;
+      long long val = PyLong_AsLongLongAndOverflow(results[i].ptr(), &overflow);
+      if (overflow)
+        return py::cast(results);
+      memcpy(&bytes[i * sizeof(val)], &val, sizeof(val));
+    }
+  }
+  return py::module::import("array").attr("array")(all_floats ? "d" : "q",
+                                                   py::bytes(bytes));
+}
+
+static py::object map_thread_func(const py::function &f,
+                                  const std::vector<py::handle> &args) {
   std::vector<py::object> results;
   results.reserve(args.size());
 
   for (auto arg : args) {
     results.push_back(f(arg));
   }
-  return results;
+  return pack_results(results);
 }
 
-static std::vector<py::object>
-starmap_thread_func(const py::function &f,
-                    const std::vector<py::handle> &args) {
+static py::object starmap_thread_func(const py::function &f,
+                                      const std::vector<py::handle> &args) {
   std::vector<py::object> results;
   results.reserve(args.size());
 
   for (auto arg : args) {
     results.push_back(f(*arg));
   }
-  return results;
+  return pack_results(results);
+}
+
+py::object join_results(const std::vector<py::object> &chunks,
+                        const bool columnar) {
+  py::object array_type = py::module::import("array").attr("array");
+
+  if (columnar && !chunks.empty()) {
+    bool packed = true;
+    py::object typecode = py::none();
+    for (const py::object &chunk : chunks) {
+      if (!py::isinstance(chunk, array_type)) {
+        packed = false;
+        break;
+      }
+      if (typecode.is_none())
+        typecode = chunk.attr("typecode");
+      else if (!typecode.equal(chunk.attr("typecode")))
+        packed = false;
+    }
+    if (packed) {
+      py::object joined = array_type(typecode);
+      for (const py::object &chunk : chunks)
+        joined.attr("extend")(chunk);
+      return joined;
+    }
+  }
+
+  py::list results;
+  for (const py::object &chunk : chunks) {
+    if (py::isinstance(chunk, array_type)) {
+      results.attr("extend")(chunk.attr("tolist")());
+    } else {
+      results.attr("extend")(chunk);
+    }
+  }
+  return std::move(results);
 }
 
 static inline py::cpp_function
@@ -38,9 +112,10 @@ get_thread_func(const py::function &f, const std::vector<py::handle> &args,
   }
 }
 
-static std::vector<py::object>
-_map(const py::function &f, const py::iterable &args, py::function *extract,
-     py::function *merge, uint concurrency, uint chunksize, bool star) {
+static py::object _map(const py::function &f, const py::iterable &args,
+                       py::function *extract, py::function *merge,
+                       uint concurrency, uint chunksize, bool star,
+                       bool columnar) {
 
   py::list arg_list = py::list(args); // assemble args
 
@@ -60,16 +135,20 @@ _map(const py::function &f, const py::iterable &args, py::function *extract,
 
   // run jobs
   std::vector<thread> threads;
-  std::vector<py::object> results;
+  std::vector<py::object> chunks;
   std::vector<py::handle> thread_args;
 
   threads.reserve(concurrency);
-  results.reserve(arg_list.size());
+  chunks.reserve(n_batch * concurrency);
   thread_args.reserve(chunksize);
 
   auto iter = arg_list.begin();
   auto end = arg_list.end();
 
+  // on NUMA systems, consecutive workers go to the same node, so that the
+  // chunks are spread node by node
+  size_t n_nodes = util::get_numa_nodes().size();
+
   for (uint i = 0; i < n_batch; i++) {
     for (uint j = 0; j < concurrency; j++) {
       // split args
@@ -90,11 +169,15 @@ _map(const py::function &f, const py::iterable &args, py::function *extract,
       if ((extract != nullptr) && (merge != nullptr)) {
         // with merging
         thread t(get_thread_func(f, thread_args, star), *extract, *merge);
+        if (n_nodes > 1)
+          t.set_numa_node(j * n_nodes / concurrency);
         t.start();
         threads.push_back(std::move(t));
       } else {
         // without merging
         thread t(get_thread_func(f, thread_args, star));
+        if (n_nodes > 1)
+          t.set_numa_node(j * n_nodes / concurrency);
         t.start();
         threads.push_back(std::move(t));
       }
@@ -103,14 +186,10 @@ _map(const py::function &f, const py::iterable &args, py::function *extract,
       thread_args.clear();
     }
 
-    // join threads and concatenate results
+    // join threads and collect results
     for (thread &t : threads) {
       t.join();
-
-      auto thread_results = py::cast<std::vector<py::object>>(t.get_result());
-      std::move(std::begin(thread_results), std::end(thread_results),
-                std::back_inserter(results));
-
+      chunks.push_back(t.get_result());
       t.dispose();
     }
 
@@ -118,31 +197,137 @@ _map(const py::function &f, const py::iterable &args, py::function *extract,
     threads.clear();
   }
 
-  return results;
+  return join_results(chunks, columnar);
 }
 
-std::vector<py::object> map(const py::function &f, const py::iterable &args,
-                            uint concurrency, uint chunksize) {
-  return _map(f, args, nullptr, nullptr, concurrency, chunksize, false);
+py::object map(const py::function &f, const py::iterable &args,
+               uint concurrency, uint chunksize, bool columnar) {
+  return _map(f, args, nullptr, nullptr, concurrency, chunksize, false,
+              columnar);
 }
 
-std::vector<py::object> map_merge(const py::function &f,
-                                  const py::iterable &args,
-                                  py::function extract, py::function merge,
-                                  uint concurrency, uint chunksize) {
-  return _map(f, args, &extract, &merge, concurrency, chunksize, false);
+py::object map_merge(const py::function &f, const py::iterable &args,
+                     py::function extract, py::function merge,
+                     uint concurrency, uint chunksize, bool columnar) {
+  return _map(f, args, &extract, &merge, concurrency, chunksize, false,
+              columnar);
 }
 
-std::vector<py::object> starmap(const py::function &f, const py::iterable &args,
-                                uint concurrency, uint chunksize) {
-  return _map(f, args, nullptr, nullptr, concurrency, chunksize, true);
+py::object starmap(const py::function &f, const py::iterable &args,
+                   uint concurrency, uint chunksize, bool columnar) {
+  return _map(f, args, nullptr, nullptr, concurrency, chunksize, true,
+              columnar);
 }
 
-std::vector<py::object> starmap_merge(const py::function &f,
-                                      const py::iterable &args,
-                                      py::function extract, py::function merge,
-                                      uint concurrency, uint chunksize) {
-  return _map(f, args, &extract, &merge, concurrency, chunksize, true);
+py::object starmap_merge(const py::function &f, const py::iterable &args,
+                         py::function extract, py::function merge,
+                         uint concurrency, uint chunksize, bool columnar) {
+  return _map(f, args, &extract, &merge, concurrency, chunksize, true,
+              columnar);
+}
+
+std::vector<py::object> select(const py::iterable &objs,
+                               const double timeout) {
+  // collect what to check and what to wait on
+  std::vector<py::object> candidates;
+  std::vector<std::function<bool()>> checks;
+  std::vector<notifier *> notifiers;
+  for (py::handle h : objs) {
+    py::object obj = py::reinterpret_borrow<py::object>(h);
+    if (py::isinstance<channel>(obj)) {
+      channel *c = obj.cast<channel *>();
+      checks.emplace_back([c]() { return c->poll(); });
+      notifiers.push_back(&c->get_notifier());
+    } else if (py::isinstance<mpmc_channel>(obj)) {
+      mpmc_channel *c = obj.cast<mpmc_channel *>();
+      checks.emplace_back([c]() { return c->poll(); });
+      notifiers.push_back(&c->get_notifier());
+    } else if (py::isinstance<generator>(obj)) {
+      generator *g = obj.cast<generator *>();
+      checks.emplace_back([g]() { return g->poll(); });
+      notifiers.push_back(&g->get_notifier());
+    } else {
+      throw std::invalid_argument(
+          "only channels and generators can be selected");
+    }
+    candidates.push_back(obj);
+  }
+  if (candidates.empty()) {
+    throw std::invalid_argument("nothing to select");
+  }
+
+  std::vector<struct pollfd> fds(notifiers.size());
+  for (size_t i = 0; i < notifiers.size(); i++)
+    fds[i] = {notifiers[i]->get_fd(), POLLIN, 0};
+
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::duration<double>(std::max(timeout, 0.0));
+  std::vector<py::object> ready;
+  std::vector<bool> drained(notifiers.size(), false);
+  while (true) {
+    // subscribe, then check in case something was published before the
+    // senders could see the subscriptions
+    // the fence pairs with the ones in the publishing functions
+    for (notifier *n : notifiers)
+      n->subscribe();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::vector<size_t> ready_idx;
+    try {
+      for (size_t i = 0; i < checks.size(); i++) {
+        if (checks[i]()) {
+          ready.push_back(candidates[i]);
+          ready_idx.push_back(i);
+        }
+      }
+    } catch (...) {
+      for (notifier *n : notifiers)
+        n->unsubscribe();
+      throw;
+    }
+
+    double remaining = -1;
+    if (timeout >= 0) {
+      remaining = std::chrono::duration<double>(
+                      deadline - std::chrono::steady_clock::now())
+                      .count();
+    }
+    if (!ready.empty() || (timeout >= 0 && remaining <= 0)) {
+      for (notifier *n : notifiers)
+        n->unsubscribe();
+
+      // a notifier is shared by all selectors of an object, and draining it
+      // may have swallowed the wakeup of another one, so it's passed on
+      // while there's still something to take
+      for (size_t i : ready_idx) {
+        if (drained[i])
+          notifiers[i]->notify();
+      }
+      return ready;
+    }
+
+    // sleep until some notifier is signalled
+    int timeout_ms =
+        timeout < 0 ? -1 : static_cast<int>(std::ceil(remaining * 1000));
+    int result = ::poll(fds.data(), fds.size(), timeout_ms);
+    for (notifier *n : notifiers)
+      n->unsubscribe();
+    if (result == -1) {
+      if (errno != EINTR) {
+        perror("poll() failed");
+        throw std::runtime_error("poll() failed");
+      }
+      if (PyErr_CheckSignals() != 0)
+        throw py::error_already_set();
+    }
+
+    // stale signals only cause spurious wakeups, which are handled by the loop
+    for (size_t i = 0; i < fds.size(); i++) {
+      if (fds[i].revents & POLLIN) {
+        notifiers[i]->drain();
+        drained[i] = true;
+      }
+    }
+  }
 }
 
 } // namespace snakefish
@@ -53,12 +53,18 @@ inline uint64_t get_timestamp_serialized() {
  * to the number of cores in the system.
  *
  * \param chunksize The size of each process' job. If not supplied, `args` are
- * handed out evenly to each process.
+ * handed out evenly to each process. On NUMA systems, processes are spread
+ * evenly over the nodes, with consecutive chunks on the same node.
  *
- * \return The return values as a `vector` (or a `list` in Python).
+ * \param columnar Should the results be returned as an `array.array` when
+ * they are all `float`s (or all `int`s that fit in 64 bits)? Either way, such
+ * results are sent back by the workers as raw 8-byte values.
+ *
+ * \return The return values as a `list`, or an `array.array` (see
+ * `columnar`).
  */
-std::vector<py::object> map(const py::function &f, const py::iterable &args,
-                            uint concurrency = 0, uint chunksize = 0);
+py::object map(const py::function &f, const py::iterable &args,
+               uint concurrency = 0, uint chunksize = 0, bool columnar = false);
 
 /**
  * \brief `map(f, args)` executed in parallel, with global variable merging.
@@ -75,14 +81,20 @@ std::vector<py::object> map(const py::function &f, const py::iterable &args,
  * to the number of cores in the system.
  *
  * \param chunksize The size of each process' job. If not supplied, `args` are
- * handed out evenly to each process.
+ * handed out evenly to each process. On NUMA systems, processes are spread
+ * evenly over the nodes, with consecutive chunks on the same node.
+ *
+ * \param columnar Should the results be returned as an `array.array` when
+ * they are all `float`s (or all `int`s that fit in 64 bits)? Either way, such
+ * results are sent back by the workers as raw 8-byte values.
  *
- * \return The return values as a `vector` (or a `list` in Python).
+ * \return The return values as a `list`, or an `array.array` (see
+ * `columnar`).
  */
-std::vector<py::object> map_merge(const py::function &f,
-                                  const py::iterable &args,
-                                  py::function extract, py::function merge,
-                                  uint concurrency = 0, uint chunksize = 0);
+py::object map_merge(const py::function &f, const py::iterable &args,
+                     py::function extract, py::function merge,
+                     uint concurrency = 0, uint chunksize = 0,
+                     bool columnar = false);
 
 /**
  * \brief `starmap(f, args)` executed in parallel, with no global variable
@@ -97,12 +109,19 @@ std::vector<py::object> map_merge(const py::function &f,
  * to the number of cores in the system.
  *
  * \param chunksize The size of each process' job. If not supplied, `args` are
- * handed out evenly to each process.
+ * handed out evenly to each process. On NUMA systems, processes are spread
+ * evenly over the nodes, with consecutive chunks on the same node.
+ *
+ * \param columnar Should the results be returned as an `array.array` when
+ * they are all `float`s (or all `int`s that fit in 64 bits)? Either way, such
+ * results are sent back by the workers as raw 8-byte values.
  *
- * \return The return values as a `vector` (or a `list` in Python).
+ * \return The return values as a `list`, or an `array.array` (see
+ * `columnar`).
  */
-std::vector<py::object> starmap(const py::function &f, const py::iterable &args,
-                                uint concurrency = 0, uint chunksize = 0);
+py::object starmap(const py::function &f, const py::iterable &args,
+                   uint concurrency = 0, uint chunksize = 0,
+                   bool columnar = false);
 
 /**
  * \brief `starmap(f, args)` executed in parallel, with global variable merging.
@@ -120,14 +139,70 @@ std::vector<py::object> starmap(const py::function &f, const py::iterable &args,
  * to the number of cores in the system.
  *
  * \param chunksize The size of each process' job. If not supplied, `args` are
- * handed out evenly to each process.
+ * handed out evenly to each process. On NUMA systems, processes are spread
+ * evenly over the nodes, with consecutive chunks on the same node.
+ *
+ * \param columnar Should the results be returned as an `array.array` when
+ * they are all `float`s (or all `int`s that fit in 64 bits)? Either way, such
+ * results are sent back by the workers as raw 8-byte values.
+ *
+ * \return The return values as a `list`, or an `array.array` (see
+ * `columnar`).
+ */
+py::object starmap_merge(const py::function &f, const py::iterable &args,
+                         py::function extract, py::function merge,
+                         uint concurrency = 0, uint chunksize = 0,
+                         bool columnar = false);
+
+/**
+ * \brief Pack the results of a worker into an `array.array` if they are all
+ * `float`s or all `int`s that fit in 64 bits.
+ *
+ * This way, each result crosses the channel as 8 raw bytes instead of a
+ * pickled object, and doesn't have to be boxed again unless the caller asks
+ * for a `list`.
+ *
+ * \returns The `array.array`, or the results as a `list` if they can't be
+ * packed.
+ */
+py::object pack_results(const std::vector<py::object> &results);
+
+/**
+ * \brief Assemble the results returned by the workers of `map()` or
+ * `pool::map()`.
+ *
+ * \param chunks The results of each worker, in order, as returned by
+ * `pack_results()`.
+ * \param columnar Should the results be returned as a single `array.array`
+ * when all workers packed theirs the same way?
+ */
+py::object join_results(const std::vector<py::object> &chunks, bool columnar);
+
+/**
+ * \brief Wait until at least one of `objs` has something to receive.
+ *
+ * Instead of spinning on non-blocking receives, the calling process sleeps in
+ * `poll()` on the notifiers of the objects until one of them publishes
+ * something. Several processes may select on the same object: the one that
+ * takes a wakeup passes it on if it finds the object ready.
+ *
+ * \param objs The `channel`, `mpmc_channel` and `generator` objects to wait
+ * on, as a Python iterable. Generators that haven't been asked for their next
+ * output yet are asked right away, as `generator::next()` would.
+ *
+ * \param timeout Maximum number of seconds to wait. If negative, there's no
+ * limit.
+ *
+ * \return The objects which are ready to be received from, in the order they
+ * appear in `objs`, as a `vector` (or a `list` in Python). Empty if the
+ * timeout expired.
  *
- * \return The return values as a `vector` (or a `list` in Python).
+ * \throws std::invalid_argument If `objs` is empty or contains something
+ * else.
+ * \throws std::runtime_error If `poll()` failed OR if a generator has not
+ * been started yet.
  */
-std::vector<py::object> starmap_merge(const py::function &f,
-                                      const py::iterable &args,
-                                      py::function extract, py::function merge,
-                                      uint concurrency = 0, uint chunksize = 0);
+std::vector<py::object> select(const py::iterable &objs, double timeout = -1);
 
 } // namespace snakefish
 
@@ -0,0 +1,324 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <sched.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "mpmc_channel.h"
+#include "util.h"
+
+namespace snakefish {
+
+mpmc_channel::mpmc_channel(size_t size)
+    : header(static_cast<mpmc_header *>(
+          util::get_shared_mem(sizeof(mpmc_header), true))),
+      msg_published(0, &header->msg_published),
+      space_freed(0, &header->space_freed), ready(&header->n_subscribers),
+      pickle(get_pickle_funcs()), max_spins(0), spin_budget(0) {
+  if (size == 0) {
+    throw std::invalid_argument("invalid channel buffer size");
+  }
+
+  // the buffer is mirrored so that a message never has to be split, which
+  // only works in whole pages
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size = (size + page_size - 1) / page_size * page_size;
+  n_slots = size / MPMC_SLOT_SIZE;
+
+  // create shared memory and relevant metadata variables
+  shared_fd = util::get_shared_fd(size);
+  shared_mem = util::reserve_mem(2 * size);
+  util::map_shared_fd(shared_mem, size, shared_fd);
+  util::map_shared_fd(static_cast<char *>(shared_mem) + size, size, shared_fd);
+  seqs = static_cast<std::atomic_size_t *>(
+      util::get_shared_mem(n_slots * sizeof(std::atomic_size_t), true));
+
+  // initialize metadata
+  for (size_t i = 0; i < n_slots; i++)
+    seqs[i].store(0);
+  header->enqueue_pos.store(0);
+  header->dequeue_pos.store(0);
+  header->receivers_waiting.store(0);
+  header->senders_waiting.store(0);
+
+  // ensure that shared atomic variables are lock free
+  if (!header->enqueue_pos.is_lock_free()) {
+    fprintf(stderr, "std::atomic_size_t is not lock free!\n");
+    abort();
+  }
+}
+
+void mpmc_channel::set_spin(const unsigned max_spins) {
+  this->max_spins = max_spins;
+  spin_budget = max_spins;
+  msg_published.set_spin(max_spins);
+  space_freed.set_spin(max_spins);
+}
+
+size_t mpmc_channel::claim_slots(const size_t n_msg_slots, const bool block,
+                                 const double timeout) {
+  if (n_msg_slots > n_slots) {
+    throw std::overflow_error("channel buffer is full");
+  }
+
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::duration<double>(std::max(timeout, 0.0));
+  size_t pos = header->enqueue_pos.load(std::memory_order_relaxed);
+  while (true) {
+    size_t head = header->dequeue_pos.load(std::memory_order_acquire);
+    if (pos < head) {
+      // pos is stale
+      pos = header->enqueue_pos.load(std::memory_order_relaxed);
+      continue;
+    }
+
+    // dequeue_pos advances when messages are claimed, but their slots are
+    // only handed back once the receivers are done with them
+    if (pos - head + n_msg_slots <= n_slots &&
+        slots_free(pos, n_msg_slots)) {
+      if (header->enqueue_pos.compare_exchange_weak(pos, pos + n_msg_slots))
+        break;
+      continue;
+    }
+
+    // the buffer is full
+    if (!block) {
+      throw std::overflow_error("channel buffer is full");
+    }
+    double remaining = -1;
+    if (timeout >= 0) {
+      remaining = std::chrono::duration<double>(
+                      deadline - std::chrono::steady_clock::now())
+                      .count();
+      if (remaining <= 0)
+        throw std::overflow_error("channel buffer is full");
+    }
+
+    // some receiver may be about to claim or free something
+    if (util::spin_until(
+            [this, head, pos, n_msg_slots]() {
+              return header->dequeue_pos.load(std::memory_order_acquire) !=
+                         head ||
+                     slots_free(pos, n_msg_slots);
+            },
+            max_spins, spin_budget)) {
+      pos = header->enqueue_pos.load(std::memory_order_relaxed);
+      continue;
+    }
+
+    // announce that we are going to sleep, then check again in case some
+    // receiver claimed or freed something before it could see the
+    // announcement
+    // stale announcements only cause spurious wakeups, which are handled by
+    // the loop
+    header->senders_waiting.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (header->dequeue_pos.load(std::memory_order_acquire) == head &&
+        !slots_free(pos, n_msg_slots) && !space_freed.timedwait(remaining)) {
+      throw std::overflow_error("channel buffer is full");
+    }
+    pos = header->enqueue_pos.load(std::memory_order_relaxed);
+  }
+
+  return pos;
+}
+
+bool mpmc_channel::slots_free(const size_t pos, const size_t n_msg_slots) {
+  // only the sender that claims pos writes these sequence numbers next, so
+  // they can't change between this check and a successful claim
+  for (size_t p = pos; p < pos + n_msg_slots; p++) {
+    size_t free_seq = p / n_slots * n_slots;
+    if (seqs[p % n_slots].load(std::memory_order_acquire) != free_seq)
+      return false;
+  }
+  return true;
+}
+
+void mpmc_channel::publish(const size_t pos) {
+  seqs[pos % n_slots].store(pos / n_slots * n_slots + 1,
+                            std::memory_order_release);
+
+  // the fence pairs with the ones in claim_msg() and select() so that either
+  // the receiver sees the new message or this sees receivers_waiting (or the
+  // subscription)
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (header->receivers_waiting.load(std::memory_order_relaxed) > 0) {
+    size_t n = header->receivers_waiting.exchange(0);
+    for (size_t i = 0; i < n; i++)
+      msg_published.post();
+  }
+  ready.notify();
+}
+
+size_t mpmc_channel::claim_msg(const bool block, size_t &len) {
+  size_t pos = header->dequeue_pos.load(std::memory_order_relaxed);
+  while (true) {
+    size_t published_seq = pos / n_slots * n_slots + 1;
+    size_t seq = seqs[pos % n_slots].load(std::memory_order_acquire);
+
+    if (seq == published_seq) {
+      // if some other receiver claims the message first, the length read
+      // here may be garbage, but the compare-and-swap will fail anyway
+      memcpy(&len, slot_at(pos), sizeof(size_t));
+      if (header->dequeue_pos.compare_exchange_weak(pos,
+                                                    pos + slots_for(len)))
+        return pos;
+      continue;
+    }
+
+    if (seq > published_seq) {
+      // pos is stale
+      pos = header->dequeue_pos.load(std::memory_order_relaxed);
+      continue;
+    }
+
+    if (header->enqueue_pos.load(std::memory_order_acquire) != pos) {
+      // some sender is still writing the message
+      sched_yield();
+      pos = header->dequeue_pos.load(std::memory_order_relaxed);
+      continue;
+    }
+
+    // the buffer is empty
+    if (!block) {
+      throw std::out_of_range("out-of-bounds read detected");
+    }
+
+    // some sender may be about to publish something
+    if (util::spin_until(
+            [this, pos]() {
+              return header->enqueue_pos.load(std::memory_order_acquire) !=
+                     pos;
+            },
+            max_spins, spin_budget)) {
+      pos = header->dequeue_pos.load(std::memory_order_relaxed);
+      continue;
+    }
+
+    // announce that we are going to sleep, then check again in case some
+    // sender claimed something before it could see the announcement
+    // stale announcements only cause spurious wakeups, which are handled by
+    // the loop
+    header->receivers_waiting.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (header->enqueue_pos.load(std::memory_order_acquire) == pos)
+      msg_published.wait();
+    pos = header->dequeue_pos.load(std::memory_order_relaxed);
+  }
+}
+
+void mpmc_channel::free_slots(const size_t pos, const size_t len) {
+  size_t n_msg_slots = slots_for(len);
+  for (size_t p = pos; p < pos + n_msg_slots; p++)
+    seqs[p % n_slots].store((p / n_slots + 1) * n_slots,
+                            std::memory_order_release);
+
+  // the fence pairs with the one in claim_slots() so that either the sender
+  // sees the freed slots or this sees senders_waiting
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (header->senders_waiting.load(std::memory_order_relaxed) > 0) {
+    size_t n = header->senders_waiting.exchange(0);
+    for (size_t i = 0; i < n; i++)
+      space_freed.post();
+  }
+}
+
+void mpmc_channel::send_bytes(const void *bytes, const size_t len,
+                              const bool block, const double timeout) {
+  size_t size_t_size = sizeof(size_t);
+  size_t pos = claim_slots(slots_for(len), block, timeout);
+
+  // the buffer is mirrored, so the message is contiguous
+  char *dst = slot_at(pos);
+  memcpy(dst, &len, size_t_size);
+  memcpy(dst + size_t_size, bytes, len);
+  publish(pos);
+}
+
+void mpmc_channel::send_pyobj(const py::object &obj, const bool block,
+                              const double timeout) {
+  // serialize
+  py::bytes bytes = pickle.dumps(obj, pickle.protocol);
+  char *bytes_ptr = PyBytes_AsString(bytes.ptr());
+  if (bytes_ptr == nullptr) {
+    throw std::runtime_error("failed to get the bytes");
+  }
+  size_t len = PyBytes_Size(bytes.ptr());
+
+  // send
+  send_bytes(bytes_ptr, len, block, timeout);
+}
+
+buffer mpmc_channel::receive_bytes(const bool block) {
+  size_t len = 0;
+  size_t pos = claim_msg(block, len);
+
+  try {
+    buffer buf = buffer(len, buffer_type::MALLOC);
+    memcpy(buf.get_ptr(), slot_at(pos) + sizeof(size_t), len);
+    free_slots(pos, len);
+    return buf;
+  } catch (...) {
+    free_slots(pos, len);
+    throw;
+  }
+}
+
+py::object mpmc_channel::receive_pyobj(const bool block) {
+  size_t len = 0;
+  size_t pos = claim_msg(block, len);
+
+  // the slots belong to this receiver until they are freed, so the message
+  // can be deserialized in place
+  try {
+    py::object mem_view =
+        py::reinterpret_steal<py::object>(PyMemoryView_FromMemory(
+            slot_at(pos) + sizeof(size_t), len, PyBUF_READ));
+    py::object obj = pickle.loads(mem_view);
+    free_slots(pos, len);
+    return obj;
+  } catch (...) {
+    free_slots(pos, len);
+    throw;
+  }
+}
+
+void mpmc_channel::dispose() {
+  size_t size = n_slots * MPMC_SLOT_SIZE;
+  if (munmap(shared_mem, 2 * size)) {
+    perror("munmap() failed");
+    abort();
+  }
+  if (close(shared_fd)) {
+    perror("close() failed");
+    abort();
+  }
+  if (munmap(seqs, n_slots * sizeof(std::atomic_size_t))) {
+    perror("munmap() failed");
+    abort();
+  }
+  try {
+    msg_published.destroy();
+  } catch (...) {
+    abort();
+  }
+  try {
+    space_freed.destroy();
+  } catch (...) {
+    abort();
+  }
+  ready.dispose();
+  if (munmap(header, sizeof(mpmc_header))) {
+    perror("munmap() failed");
+    abort();
+  }
+}
+
+} // namespace snakefish
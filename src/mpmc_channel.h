@@ -0,0 +1,324 @@
+/**
+ * \file mpmc_channel.h
+ */
+
+#ifndef SNAKEFISH_MPMC_CHANNEL_H
+#define SNAKEFISH_MPMC_CHANNEL_H
+
+#include <atomic>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "buffer.h"
+#include "channel.h"
+#include "notifier.h"
+#include "semaphore_t.h"
+
+namespace snakefish {
+
+/**
+ * \brief The default `mpmc_channel` buffer size.
+ */
+const size_t DEFAULT_MPMC_CHANNEL_SIZE = 16 * 1024 * 1024; // 16 MiB
+
+/**
+ * \brief The size of a slot of `mpmc_channel`.
+ *
+ * A message occupies as many consecutive slots as needed to hold its length
+ * header and payload.
+ */
+const size_t MPMC_SLOT_SIZE = 64;
+
+/**
+ * \brief The shared state of `mpmc_channel`.
+ *
+ * The positions are claimed by producers and consumers respectively, so they
+ * live on separate cache lines.
+ */
+struct mpmc_header {
+  // next position to be claimed by a producer
+  alignas(CACHE_LINE_SIZE) std::atomic_size_t enqueue_pos;
+
+  // next position to be claimed by a consumer
+  alignas(CACHE_LINE_SIZE) std::atomic_size_t dequeue_pos;
+
+  // only touched when sleeping or selecting
+  alignas(CACHE_LINE_SIZE) std::atomic_size_t receivers_waiting;
+  std::atomic_size_t senders_waiting;
+  std::atomic_size_t n_subscribers;
+  sem_t msg_published;
+  sem_t space_freed;
+};
+
+/**
+ * \brief An IPC channel that supports any number of senders and receivers.
+ *
+ * Unlike `channel`, no lock is involved. The buffer is divided into slots of
+ * `MPMC_SLOT_SIZE` bytes, each with a sequence number. Senders claim runs of
+ * consecutive slots by advancing a shared position with compare-and-swap, fill
+ * them, then publish the message through the sequence number of its first
+ * slot. Receivers claim whole messages the same way, and hand the slots back
+ * through their sequence numbers once done. Senders and receivers therefore
+ * only contend on the claim itself, and a message is never seen partially
+ * written or by more than one receiver.
+ *
+ * Since messages are claimed in order, a receiver may have to wait for a slow
+ * sender that claimed an earlier position to publish its message.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when a channel is no
+ * longer needed to release resources.
+ *
+ * Characteristics of the functions:
+ * - `send_bytes()`: may or may not block^; can throw
+ * - `send_pyobj()`: may or may not block^; can throw
+ * - `receive_bytes()`: may or may not block^; can throw
+ * - `receive_pyobj()`: may or may not block^; can throw
+ *
+ * ^: the client must specify whether the function should block when there's no
+ * space to send or no incoming messages to receive
+ */
+class mpmc_channel {
+public:
+  /**
+   * \brief Create a channel with buffer size `DEFAULT_MPMC_CHANNEL_SIZE`.
+   */
+  mpmc_channel() : mpmc_channel(DEFAULT_MPMC_CHANNEL_SIZE) {}
+
+  /**
+   * \brief Default destructor.
+   */
+  ~mpmc_channel() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  mpmc_channel(const mpmc_channel &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  mpmc_channel &operator=(const mpmc_channel &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  mpmc_channel(mpmc_channel &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  mpmc_channel &operator=(mpmc_channel &&t) = delete;
+
+  /**
+   * \brief Create a channel with buffer size `size`.
+   *
+   * \param size The size of the underlying shared memory buffer. It's rounded
+   * up to a multiple of the page size.
+   *
+   * \throws std::invalid_argument If `size` is 0.
+   */
+  explicit mpmc_channel(size_t size);
+
+  /**
+   * \brief Send some bytes.
+   *
+   * \param bytes Pointer to the start of the bytes.
+   * \param len Number of bytes to send.
+   * \param block Should this function block until there's enough space?
+   * \param timeout Maximum number of seconds to block. If negative, there's no
+   * limit.
+   *
+   * \throws std::overflow_error If the underlying buffer does not have enough
+   * space to accommodate the request (when `block` is `true`, this means the
+   * timeout expired or the request is larger than the buffer).
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  void send_bytes(const void *bytes, size_t len, bool block = false,
+                  double timeout = -1);
+
+  /**
+   * \brief Send a Python object.
+   *
+   * This function will serialize `obj` using `pickle` and send the binary
+   * output.
+   *
+   * \param obj The object to send.
+   * \param block Should this function block until there's enough space?
+   * \param timeout Maximum number of seconds to block. If negative, there's no
+   * limit.
+   *
+   * \throws std::overflow_error If the underlying buffer does not have enough
+   * space to accommodate the request (when `block` is `true`, this means the
+   * timeout expired or the request is larger than the buffer).
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  void send_pyobj(const py::object &obj, bool block = false,
+                  double timeout = -1);
+
+  /**
+   * \brief Receive some bytes.
+   *
+   * \param block Should this function block?
+   *
+   * \returns The received bytes wrapped in a `buffer`.
+   *
+   * \throws std::out_of_range If the underlying buffer does not have enough
+   * content to accommodate the request (this only applies when `block` is
+   * `false`).
+   * \throws std::runtime_error If some semaphore error occurred.
+   * \throws std::bad_alloc If `malloc()` failed.
+   */
+  buffer receive_bytes(bool block);
+
+  /**
+   * \brief Receive a Python object.
+   *
+   * This function will receive some bytes and deserialize them using `pickle`.
+   * The bytes are deserialized directly from the shared buffer.
+   *
+   * \param block Should this function block?
+   *
+   * \throws std::out_of_range If the underlying buffer does not have enough
+   * content to accommodate the request (this only applies when `block` is
+   * `false`).
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  py::object receive_pyobj(bool block);
+
+  /**
+   * \brief Check whether there's an unread message.
+   *
+   * A message seen here may still be taken by another receiver before this
+   * process gets to it.
+   */
+  bool poll() {
+    return header->enqueue_pos.load(std::memory_order_acquire) !=
+           header->dequeue_pos.load(std::memory_order_acquire);
+  }
+
+  /**
+   * \brief Get the notifier signalled whenever messages are published.
+   */
+  notifier &get_notifier() { return ready; }
+
+  /**
+   * \brief Spin for a while before sleeping whenever this process has to
+   * wait for a message or for space. See `channel::set_spin()`.
+   */
+  void set_spin(unsigned max_spins);
+
+  /**
+   * \brief Release resources held by this channel.
+   */
+  void dispose();
+
+protected:
+  /**
+   * \brief The slots, mapped twice back-to-back so that messages are
+   * contiguous even when they wrap around.
+   */
+  void *shared_mem;
+
+  /**
+   * \brief File descriptor of the shared memory object backing the slots.
+   */
+  int shared_fd;
+
+  /**
+   * \brief The sequence numbers of the slots.
+   *
+   * Slot `i` is free for the producer of position `pos` when its sequence
+   * number is `pos - i`, i.e. `pos / n_slots * n_slots`. Once a message is
+   * published, the sequence number of its first slot is one more than that.
+   * Once it is consumed, the sequence numbers of all its slots are advanced
+   * by `n_slots`. This way, the initial value of all sequence numbers is 0.
+   */
+  std::atomic_size_t *seqs;
+
+  /**
+   * \brief The shared positions and wakeup flags.
+   */
+  mpmc_header *header;
+
+  /**
+   * \brief A semaphore posted when a message is published while some
+   * receiver is waiting for one.
+   */
+  semaphore_t msg_published;
+
+  /**
+   * \brief A semaphore posted when slots are freed while some sender is
+   * waiting for them.
+   */
+  semaphore_t space_freed;
+
+  /**
+   * \brief Notifier signalled whenever messages are published, for
+   * `select()`.
+   */
+  notifier ready;
+
+  /**
+   * \brief Number of slots.
+   */
+  size_t n_slots;
+
+private:
+  /**
+   * \brief Claim `n_msg_slots` slots for a new message, waiting for them to
+   * be freed if necessary.
+   *
+   * \returns The position of the first slot.
+   */
+  size_t claim_slots(size_t n_msg_slots, bool block, double timeout);
+
+  /**
+   * \brief Check whether the `n_msg_slots` slots from position `pos` have
+   * been freed by the receivers of the previous lap.
+   */
+  bool slots_free(size_t pos, size_t n_msg_slots);
+
+  /**
+   * \brief Publish the message at position `pos`.
+   */
+  void publish(size_t pos);
+
+  /**
+   * \brief Claim the next message.
+   *
+   * \returns The position of its first slot. Its length is stored in `len`.
+   */
+  size_t claim_msg(bool block, size_t &len);
+
+  /**
+   * \brief Free the slots of the message at position `pos`.
+   */
+  void free_slots(size_t pos, size_t len);
+
+  /**
+   * \brief Get the number of slots needed by a message of `len` bytes.
+   */
+  size_t slots_for(size_t len) {
+    return (sizeof(size_t) + len + MPMC_SLOT_SIZE - 1) / MPMC_SLOT_SIZE;
+  }
+
+  /**
+   * \brief Get a pointer to the slot at position `pos`.
+   */
+  char *slot_at(size_t pos) {
+    return static_cast<char *>(shared_mem) + pos % n_slots * MPMC_SLOT_SIZE;
+  }
+
+  /**
+   * \brief The functions used to (de)serialize objects.
+   */
+  const pickle_funcs &pickle;
+
+  unsigned max_spins;   // see set_spin()
+  unsigned spin_budget; // see util::spin_until()
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_MPMC_CHANNEL_H
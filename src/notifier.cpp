@@ -0,0 +1,80 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef __APPLE__
+#include <sys/eventfd.h>
+#endif
+
+#include "notifier.h"
+
+namespace snakefish {
+
+#ifdef __APPLE__
+notifier::notifier(std::atomic_size_t *n_subscribers)
+    : n_subscribers(n_subscribers) {
+  int fds[2];
+  if (pipe(fds)) {
+    perror("pipe() failed");
+    throw std::runtime_error("pipe() failed");
+  }
+  for (int fd : fds) {
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+      perror("fcntl() failed");
+      throw std::runtime_error("fcntl() failed");
+    }
+  }
+  read_fd = fds[0];
+  write_fd = fds[1];
+  n_subscribers->store(0);
+}
+#else
+notifier::notifier(std::atomic_size_t *n_subscribers)
+    : n_subscribers(n_subscribers) {
+  read_fd = eventfd(0, EFD_NONBLOCK);
+  if (read_fd == -1) {
+    perror("eventfd() failed");
+    throw std::runtime_error("eventfd() failed");
+  }
+  write_fd = read_fd;
+  n_subscribers->store(0);
+}
+#endif
+
+void notifier::signal() {
+  // a full pipe or eventfd counter is still readable, so EAGAIN is fine
+  uint64_t one = 1;
+  if (write(write_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+    perror("write() failed");
+    throw std::runtime_error("write() failed");
+  }
+}
+
+void notifier::drain() {
+  // an eventfd is reset by a single read, a pipe may take several
+  uint64_t buf[64];
+  ssize_t result;
+  do {
+    result = read(read_fd, buf, sizeof(buf));
+  } while (result > 0);
+  if (result == -1 && errno != EAGAIN) {
+    perror("read() failed");
+    throw std::runtime_error("read() failed");
+  }
+}
+
+void notifier::dispose() {
+  if (close(read_fd)) {
+    perror("close() failed");
+    abort();
+  }
+  if (write_fd != read_fd && close(write_fd)) {
+    perror("close() failed");
+    abort();
+  }
+}
+
+} // namespace snakefish
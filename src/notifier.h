@@ -0,0 +1,116 @@
+/**
+ * \file notifier.h
+ */
+
+#ifndef SNAKEFISH_NOTIFIER_H
+#define SNAKEFISH_NOTIFIER_H
+
+#include <atomic>
+
+namespace snakefish {
+
+/**
+ * \brief A file descriptor that becomes readable when something happens.
+ *
+ * This allows waiting for several channels at once with `poll()`. On Linux,
+ * an `eventfd` is used. On macOS, which doesn't implement `eventfd`, a
+ * non-blocking pipe is used instead.
+ *
+ * To keep the notifying side cheap, the file descriptor is only written to
+ * while some process has subscribed to it. Subscribers are counted in shared
+ * memory, and the protocol is the same as for the semaphores of `channel`:
+ * - the waiting side calls `subscribe()`, issues a `seq_cst` fence, checks its
+ *   condition, then `poll()`s the file descriptor
+ * - the notifying side updates the condition, issues a `seq_cst` fence, then
+ *   calls `notify()`
+ *
+ * **NOTE**: This wrapper is intended for multi-processing, not multi-threading.
+ */
+class notifier {
+public:
+  /**
+   * \brief Create a notifier.
+   *
+   * \param n_subscribers Where to count subscribers. This must be shared
+   * memory which stays mapped until `dispose()` is called.
+   *
+   * \throws std::runtime_error If `eventfd()` or `pipe()` failed.
+   */
+  explicit notifier(std::atomic_size_t *n_subscribers);
+
+  /**
+   * \brief Default destructor.
+   */
+  ~notifier() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  notifier(const notifier &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  notifier &operator=(const notifier &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  notifier(notifier &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  notifier &operator=(notifier &&t) = delete;
+
+  /**
+   * \brief Make the file descriptor readable if some process has subscribed.
+   *
+   * \throws std::runtime_error If `write()` failed.
+   */
+  void notify() {
+    if (n_subscribers->load(std::memory_order_relaxed) > 0)
+      signal();
+  }
+
+  /**
+   * \brief Start watching the file descriptor.
+   */
+  void subscribe() { n_subscribers->fetch_add(1); }
+
+  /**
+   * \brief Stop watching the file descriptor.
+   */
+  void unsubscribe() { n_subscribers->fetch_sub(1); }
+
+  /**
+   * \brief Make the file descriptor unreadable again.
+   *
+   * \throws std::runtime_error If `read()` failed.
+   */
+  void drain();
+
+  /**
+   * \brief Get the file descriptor to `poll()` for reading.
+   */
+  int get_fd() { return read_fd; }
+
+  /**
+   * \brief Close the file descriptors.
+   */
+  void dispose();
+
+private:
+  /**
+   * \brief Write to the file descriptor unconditionally.
+   */
+  void signal();
+
+  int read_fd;
+  int write_fd; // same as read_fd for an eventfd
+  std::atomic_size_t *n_subscribers;
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_NOTIFIER_H
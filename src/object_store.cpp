@@ -0,0 +1,353 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "object_store.h"
+#include "util.h"
+
+namespace snakefish {
+
+/**
+ * \brief Round `n` up to a multiple of `OBJECT_ALIGNMENT`.
+ */
+static size_t align_up(const size_t n) {
+  return (n + OBJECT_ALIGNMENT - 1) / OBJECT_ALIGNMENT * OBJECT_ALIGNMENT;
+}
+
+/**
+ * \brief Release the views of the buffers of an object being stored.
+ */
+static void release_views(std::vector<Py_buffer> &views) {
+  for (Py_buffer &view : views)
+    PyBuffer_Release(&view);
+  views.clear();
+}
+
+object_store::object_store(size_t size)
+    : arena(nullptr), capacity(0), block_seqs(nullptr),
+      header(static_cast<object_store_header *>(
+          util::get_shared_mem(sizeof(object_store_header), true))),
+      lock(1, &header->lock), views(std::make_shared<view_refs>()),
+      pickle(get_pickle_funcs()) {
+  views->n_views = 0;
+  views->disposed = false;
+  size = align_up(size);
+  if (size == 0 ||
+      size / OBJECT_ALIGNMENT > static_cast<size_t>(1) << HANDLE_OFFSET_BITS) {
+    throw std::invalid_argument("invalid object store size");
+  }
+
+  // only the pages holding objects are ever touched
+  capacity = size;
+  arena = static_cast<char *>(util::get_shared_mem(capacity, false));
+  block_seqs = static_cast<size_t *>(util::get_shared_mem(
+      capacity / OBJECT_ALIGNMENT * sizeof(size_t), false));
+
+  // initialize metadata
+  header->next_seq = 1;
+  header->used = 0;
+  object_block *block = reinterpret_cast<object_block *>(arena);
+  block->size = capacity;
+  block->seq = 0;
+}
+
+object_block *object_store::block_of(const size_t handle) {
+  size_t mask = (static_cast<size_t>(1) << HANDLE_OFFSET_BITS) - 1;
+  size_t idx = handle & mask;
+  size_t seq = handle >> HANDLE_OFFSET_BITS;
+  if (seq == 0 || idx >= capacity / OBJECT_ALIGNMENT) {
+    throw std::invalid_argument("invalid handle");
+  }
+
+  // the sequence number tells a block apart from whatever was there before
+  if (block_seqs[idx] != seq) {
+    throw std::invalid_argument("invalid handle");
+  }
+  return reinterpret_cast<object_block *>(arena + idx * OBJECT_ALIGNMENT);
+}
+
+size_t object_store::allocate(const size_t len, const int kind) {
+  size_t n = align_up(sizeof(object_block) + len);
+
+  // first fit, merging free blocks along the way
+  size_t offset = 0;
+  while (offset < capacity) {
+    object_block *block = reinterpret_cast<object_block *>(arena + offset);
+    if (block->seq == 0) {
+      size_t next = offset + block->size;
+      while (next < capacity &&
+             reinterpret_cast<object_block *>(arena + next)->seq == 0) {
+        block->size += reinterpret_cast<object_block *>(arena + next)->size;
+        next = offset + block->size;
+      }
+
+      if (block->size >= n) {
+        if (block->size - n >= sizeof(object_block)) {
+          object_block *rest =
+              reinterpret_cast<object_block *>(arena + offset + n);
+          rest->size = block->size - n;
+          rest->seq = 0;
+          block->size = n;
+        }
+
+        size_t seq = header->next_seq;
+        header->next_seq =
+            seq + 1 < static_cast<size_t>(1) << HANDLE_OFFSET_BITS ? seq + 1
+                                                                   : 1;
+        block->seq = seq;
+        block_seqs[offset / OBJECT_ALIGNMENT] = seq;
+        block->refs.store(1);
+        block->len = len;
+        block->kind = kind;
+        header->used += block->size;
+        return (seq << HANDLE_OFFSET_BITS) | (offset / OBJECT_ALIGNMENT);
+      }
+    }
+    offset += block->size;
+  }
+
+  return 0;
+}
+
+size_t object_store::put(const py::object &obj) {
+  PyObject *p = obj.ptr();
+  size_t size_t_size = sizeof(size_t);
+  std::vector<Py_buffer> views;
+  py::bytes stream;
+  object_kind kind = object_kind::PICKLED_OBJECT;
+  size_t len = 0;
+
+  // bytes-like objects are stored as is
+  if (PyBytes_CheckExact(p) || PyByteArray_CheckExact(p) ||
+      PyMemoryView_Check(p)) {
+    Py_buffer view;
+    if (PyObject_GetBuffer(p, &view, PyBUF_ANY_CONTIGUOUS) == 0) {
+      views.push_back(view);
+      kind = object_kind::RAW_BUFFER;
+      len = view.len;
+    } else {
+      // let pickle deal with it
+      PyErr_Clear();
+    }
+  }
+
+  // anything else is pickled, with large buffers out of band
+  // layout: number of buffers, stream length, buffer lengths, stream, buffers
+  // (each aligned)
+  if (kind == object_kind::PICKLED_OBJECT) {
+    try {
+      if (pickle.protocol >= 5) {
+        py::cpp_function buffer_callback([&views](const py::object &pb) {
+          Py_buffer view;
+          if (PyObject_GetBuffer(pb.ptr(), &view, PyBUF_ANY_CONTIGUOUS)) {
+            PyErr_Clear();
+            return true;
+          }
+          if (static_cast<size_t>(view.len) < OOB_BUFFER_THRESHOLD) {
+            PyBuffer_Release(&view);
+            return true;
+          }
+          views.push_back(view);
+          return false;
+        });
+        stream = pickle.dumps(obj, pickle.protocol,
+                              py::arg("buffer_callback") = buffer_callback);
+      } else {
+        stream = pickle.dumps(obj, pickle.protocol);
+      }
+    } catch (...) {
+      release_views(views);
+      throw;
+    }
+
+    len = (2 + views.size()) * size_t_size + PyBytes_GET_SIZE(stream.ptr());
+    for (const Py_buffer &view : views)
+      len = align_up(len) + view.len;
+  }
+
+  // allocate
+  lock.wait();
+  size_t handle = allocate(len, kind);
+  if (handle == 0) {
+    lock.post();
+    release_views(views);
+    throw std::overflow_error("object store is full");
+  }
+  object_block *block = block_of(handle);
+  lock.post();
+
+  // nobody else can see the block before the handle is returned, so it's
+  // filled outside of the lock
+  char *data = reinterpret_cast<char *>(block) + sizeof(object_block);
+  if (kind == object_kind::RAW_BUFFER) {
+    memcpy(data, views[0].buf, len);
+  } else {
+    size_t n_bufs = views.size();
+    size_t stream_len = PyBytes_GET_SIZE(stream.ptr());
+    memcpy(data, &n_bufs, size_t_size);
+    memcpy(data + size_t_size, &stream_len, size_t_size);
+    size_t pos = 2 * size_t_size;
+    for (const Py_buffer &view : views) {
+      size_t buf_len = view.len;
+      memcpy(data + pos, &buf_len, size_t_size);
+      pos += size_t_size;
+    }
+    memcpy(data + pos, PyBytes_AS_STRING(stream.ptr()), stream_len);
+    pos += stream_len;
+    for (const Py_buffer &view : views) {
+      pos = align_up(pos);
+      memcpy(data + pos, view.buf, view.len);
+      pos += view.len;
+    }
+  }
+  release_views(views);
+
+  return handle;
+}
+
+py::object object_store::get(const size_t handle) {
+  size_t size_t_size = sizeof(size_t);
+
+  // the reference is handed over to the view
+  lock.wait();
+  object_block *block;
+  try {
+    block = block_of(handle);
+  } catch (...) {
+    lock.post();
+    throw;
+  }
+  block->refs.fetch_add(1);
+  lock.post();
+
+  size_t offset = reinterpret_cast<char *>(block) - arena;
+  const char *data = reinterpret_cast<char *>(block) + sizeof(object_block);
+  object_store_view view(*this, offset, data, block->len);
+
+  if (block->kind == object_kind::RAW_BUFFER) {
+    py::object owner = py::cast(std::move(view));
+    py::object mem_view = py::reinterpret_steal<py::object>(
+        PyMemoryView_FromObject(owner.ptr()));
+    if (!mem_view)
+      throw py::error_already_set();
+    return mem_view;
+  }
+
+  // parse the header
+  size_t n_bufs = 0, stream_len = 0;
+  memcpy(&n_bufs, data, size_t_size);
+  memcpy(&stream_len, data + size_t_size, size_t_size);
+  std::vector<size_t> buf_lens(n_bufs);
+  if (n_bufs > 0)
+    memcpy(buf_lens.data(), data + 2 * size_t_size, n_bufs * size_t_size);
+  size_t stream_offset = (2 + n_bufs) * size_t_size;
+
+  // deserialize
+  if (n_bufs == 0) {
+    // nothing refers to the object afterwards, so the view is released on
+    // return
+    py::object mem_view = py::reinterpret_steal<py::object>(
+        PyMemoryView_FromMemory(const_cast<char *>(data + stream_offset),
+                                stream_len, PyBUF_READ));
+    return pickle.loads(mem_view);
+  }
+
+  // the out-of-band buffers are slices of the view, so the object is kept
+  // alive until all objects built on top of them are gone
+  py::object owner = py::cast(std::move(view));
+  py::object mem_view = py::reinterpret_steal<py::object>(
+      PyMemoryView_FromObject(owner.ptr()));
+  if (!mem_view)
+    throw py::error_already_set();
+  py::list buffers;
+  size_t pos = stream_offset + stream_len;
+  for (size_t buf_len : buf_lens) {
+    pos = align_up(pos);
+    buffers.append(mem_view[py::slice(static_cast<ssize_t>(pos),
+                                      static_cast<ssize_t>(pos + buf_len), 1)]);
+    pos += buf_len;
+  }
+  return pickle.loads(
+      mem_view[py::slice(static_cast<ssize_t>(stream_offset),
+                         static_cast<ssize_t>(stream_offset + stream_len), 1)],
+      py::arg("buffers") = buffers);
+}
+
+void object_store::retain(const size_t handle) {
+  lock.wait();
+  try {
+    block_of(handle)->refs.fetch_add(1);
+  } catch (...) {
+    lock.post();
+    throw;
+  }
+  lock.post();
+}
+
+void object_store::release(const size_t handle) {
+  // the handle is checked and the reference dropped at once, so that the
+  // block can't be freed (and reused) in between
+  lock.wait();
+  try {
+    drop_ref(block_of(handle));
+  } catch (...) {
+    lock.post();
+    throw;
+  }
+  lock.post();
+}
+
+void object_store::unref(const size_t offset) {
+  lock.wait();
+  drop_ref(reinterpret_cast<object_block *>(arena + offset));
+  lock.post();
+}
+
+void object_store::drop_ref(object_block *block) {
+  if (block->refs.fetch_sub(1) == 1) {
+    // merged with its free neighbors by the next allocate()
+    size_t offset = reinterpret_cast<char *>(block) - arena;
+    block->seq = 0;
+    block_seqs[offset / OBJECT_ALIGNMENT] = 0;
+    header->used -= block->size;
+  }
+}
+
+void object_store::drop_view() {
+  views->n_views--;
+  if (views->n_views == 0 && views->disposed)
+    unmap();
+}
+
+void object_store::dispose() {
+  // the views still alive keep the memory mapped
+  views->disposed = true;
+  if (views->n_views == 0)
+    unmap();
+}
+
+void object_store::unmap() {
+  if (munmap(arena, capacity)) {
+    perror("munmap() failed");
+    abort();
+  }
+  if (munmap(block_seqs, capacity / OBJECT_ALIGNMENT * sizeof(size_t))) {
+    perror("munmap() failed");
+    abort();
+  }
+  try {
+    lock.destroy();
+  } catch (...) {
+    abort();
+  }
+  if (munmap(header, sizeof(object_store_header))) {
+    perror("munmap() failed");
+    abort();
+  }
+}
+
+} // namespace snakefish
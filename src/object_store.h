@@ -0,0 +1,355 @@
+/**
+ * \file object_store.h
+ */
+
+#ifndef SNAKEFISH_OBJECT_STORE_H
+#define SNAKEFISH_OBJECT_STORE_H
+
+#include <atomic>
+#include <memory>
+
+#include <semaphore.h>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "channel.h"
+#include "semaphore_t.h"
+
+namespace snakefish {
+
+/**
+ * \brief The default `object_store` size.
+ *
+ * Only address space is reserved up front. Memory is allocated as objects are
+ * stored.
+ */
+const size_t DEFAULT_OBJECT_STORE_SIZE = 4l * 1024l * 1024l * 1024l; // 4 GiB
+
+/**
+ * \brief The alignment of the blocks of an `object_store`, which is also the
+ * alignment of the buffers stored in them.
+ */
+const size_t OBJECT_ALIGNMENT = 64;
+
+/**
+ * \brief Number of bits of a handle used for the offset of its block (in
+ * units of `OBJECT_ALIGNMENT`). The bits above hold its sequence number.
+ */
+const unsigned HANDLE_OFFSET_BITS = 32;
+
+/**
+ * \brief An enum indicating how an object is stored.
+ *
+ * `PICKLED_OBJECT`s are stored as a `pickle` stream followed by its
+ * out-of-band buffers. `RAW_BUFFER`s are the bytes of a bytes-like object.
+ */
+enum object_kind { PICKLED_OBJECT = 1, RAW_BUFFER };
+
+/**
+ * \brief The header of a block of the arena of an `object_store`. The block
+ * holds the stored object right after it.
+ */
+struct alignas(OBJECT_ALIGNMENT) object_block {
+  size_t size;             // size of the block, including this header
+  size_t seq;              // sequence number of the object, or 0 if free
+  std::atomic_size_t refs; // number of references to the object
+  size_t len;              // size of the object
+  int kind;                // an object_kind
+};
+
+/**
+ * \brief The shared state of an `object_store`.
+ */
+struct object_store_header {
+  sem_t lock;
+  size_t next_seq;
+  size_t used; // number of bytes in allocated blocks
+};
+
+class object_store_view;
+
+/**
+ * \brief A shared memory store of immutable Python objects.
+ *
+ * An object is serialized once into the shared arena by `put()`, which
+ * returns a small integer handle. The handle can be sent over any channel,
+ * and `get()` rebuilds the object from the arena in any process sharing the
+ * store. Large buffers (e.g. those of NumPy arrays) are not copied again:
+ * the rebuilt objects refer to the arena, read-only.
+ *
+ * Objects are reference counted. `put()` returns the first reference,
+ * `retain()` adds one, and `release()` drops one. The space of an object is
+ * reused once its last reference is dropped and nothing returned by `get()`
+ * refers to it anymore.
+ *
+ * The store must be created before the processes sharing it are forked.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when a store is no
+ * longer needed to release resources.
+ */
+class object_store {
+public:
+  /**
+   * \brief Create a store of size `DEFAULT_OBJECT_STORE_SIZE`.
+   */
+  object_store() : object_store(DEFAULT_OBJECT_STORE_SIZE) {}
+
+  /**
+   * \brief Default destructor.
+   */
+  ~object_store() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  object_store(const object_store &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  object_store &operator=(const object_store &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  object_store(object_store &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  object_store &operator=(object_store &&t) = delete;
+
+  /**
+   * \brief Create a store of size `size`.
+   *
+   * \param size The size of the arena. It's rounded up to a multiple of
+   * `OBJECT_ALIGNMENT`.
+   *
+   * \throws std::invalid_argument If `size` is 0 or too large for handles.
+   */
+  explicit object_store(size_t size);
+
+  /**
+   * \brief Store an object.
+   *
+   * `bytes`, `bytearray` and `memoryview` objects are stored as is. Anything
+   * else is serialized using `pickle`, with [pickle buffers]
+   * (https://docs.python.org/3.8/library/pickle.html#out-of-band-buffers)
+   * of at least `OOB_BUFFER_THRESHOLD` bytes stored out of band.
+   *
+   * \returns The handle of the object, which holds one reference to it.
+   *
+   * \throws std::overflow_error If the store doesn't have enough space.
+   */
+  size_t put(const py::object &obj);
+
+  /**
+   * \brief Get a stored object.
+   *
+   * Bytes-like objects come back as a read-only `memoryview` of the arena.
+   * Other objects are deserialized from the arena, and their out-of-band
+   * buffers are read-only views of it. Either way, the space of the object
+   * isn't reused while these views are alive.
+   *
+   * \throws std::invalid_argument If `handle` is not the handle of a stored
+   * object.
+   */
+  py::object get(size_t handle);
+
+  /**
+   * \brief Add a reference to a stored object.
+   *
+   * \throws std::invalid_argument If `handle` is not the handle of a stored
+   * object.
+   */
+  void retain(size_t handle);
+
+  /**
+   * \brief Drop a reference to a stored object.
+   *
+   * \throws std::invalid_argument If `handle` is not the handle of a stored
+   * object.
+   */
+  void release(size_t handle);
+
+  /**
+   * \brief Get the number of bytes taken by the stored objects (including
+   * block headers and padding).
+   */
+  size_t get_used() { return header->used; }
+
+  /**
+   * \brief Release resources held by this store. The memory stays mapped
+   * until the views returned by `get()` are gone.
+   */
+  void dispose();
+
+protected:
+  /**
+   * \brief The arena holding the stored objects.
+   */
+  char *arena;
+
+  /**
+   * \brief Size of the arena.
+   */
+  size_t capacity;
+
+  /**
+   * \brief The sequence number of the object whose block starts at each
+   * multiple of `OBJECT_ALIGNMENT` in the arena, or 0. Handles are checked
+   * against this shared table rather than the block headers, since a stale
+   * handle may point into the middle of another object, whose bytes could
+   * pass for a header.
+   */
+  size_t *block_seqs;
+
+  /**
+   * \brief The shared state of this store.
+   */
+  object_store_header *header;
+
+  /**
+   * \brief "Mutex" for the arena.
+   */
+  semaphore_t lock;
+
+  /**
+   * \brief The views of this store alive in this process. `dispose()` leaves
+   * the memory mapped until the last one is destroyed.
+   */
+  std::shared_ptr<view_refs> views;
+
+  /**
+   * \brief Get the block of the object with handle `handle`.
+   *
+   * `lock` must be held.
+   *
+   * \throws std::invalid_argument If `handle` is not the handle of a stored
+   * object.
+   */
+  object_block *block_of(size_t handle);
+
+  /**
+   * \brief Allocate a block for an object of `len` bytes, with one reference
+   * to it.
+   *
+   * `lock` must be held.
+   *
+   * \param len The size of the object.
+   * \param kind An `object_kind`.
+   *
+   * \returns The handle of the object, or 0 if there's no space.
+   */
+  size_t allocate(size_t len, int kind);
+
+  /**
+   * \brief Drop a reference to the object in the block at `offset`, freeing
+   * the block if it was the last one.
+   */
+  void unref(size_t offset);
+
+  /**
+   * \brief Drop a reference to the object in `block`, freeing the block if it
+   * was the last one.
+   *
+   * `lock` must be held.
+   */
+  void drop_ref(object_block *block);
+
+  /**
+   * \brief Forget a view that was destroyed, finishing `dispose()` if it was
+   * the last one.
+   */
+  void drop_view();
+
+  /**
+   * \brief Unmap the memory of this store and destroy its lock.
+   */
+  void unmap();
+
+private:
+  friend class object_store_view;
+
+  /**
+   * \brief The functions used to (de)serialize objects.
+   */
+  const pickle_funcs &pickle;
+};
+
+/**
+ * \brief A read-only view of an object stored in an `object_store`.
+ *
+ * The view holds a reference to the object, which is dropped when the view
+ * is destroyed.
+ */
+class object_store_view {
+public:
+  /**
+   * \brief No default constructor.
+   */
+  object_store_view() = delete;
+
+  /**
+   * \brief Destructor. Drops the reference held by the view.
+   */
+  ~object_store_view() {
+    if (owner) {
+      owner->unref(offset);
+      owner->drop_view();
+    }
+  }
+
+  /**
+   * \brief No copy constructor.
+   */
+  object_store_view(const object_store_view &t) = delete;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  object_store_view &operator=(const object_store_view &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  object_store_view(object_store_view &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  object_store_view &operator=(object_store_view &&t) = delete;
+
+  /**
+   * \brief Get a pointer to the start of the object.
+   */
+  const void *get_ptr() { return ptr; }
+
+  /**
+   * \brief Get the length (in bytes) of the object.
+   */
+  size_t get_len() { return len; }
+
+private:
+  friend class object_store;
+
+  /**
+   * \brief Create a view of the object in the block at `offset` of `owner`,
+   * taking over a reference to it.
+   */
+  object_store_view(const object_store &owner, size_t offset,
+                    const void *ptr, size_t len)
+      : owner(new object_store(owner)), offset(offset), ptr(ptr), len(len) {
+    this->owner->views->n_views++;
+  }
+
+  std::unique_ptr<object_store> owner;
+  size_t offset;
+  const void *ptr;
+  size_t len;
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_OBJECT_STORE_H
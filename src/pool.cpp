@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+#include "misc.h"
+#include "pool.h"
+#include "util.h"
+
+namespace snakefish {
+
+/**
+ * \brief Get the error of a failed task, as `(value, type, traceback)`.
+ */
+static py::tuple task_error(py::error_already_set &e) {
+  py::object traceback = py::module::import("traceback");
+  py::object lines;
+  if (e.trace()) {
+    lines = traceback.attr("format_exception")(e.type(), e.value(), e.trace());
+  } else {
+    lines = traceback.attr("format_exception_only")(e.type(), e.value());
+  }
+  return py::make_tuple(e.value(), e.type(), lines);
+}
+
+/**
+ * \brief Get an error as `(value, type, traceback)` of a `RuntimeError` with
+ * message `msg`.
+ *
+ * \param lines The traceback, or `None` to only format the exception itself.
+ */
+static py::tuple runtime_error(const py::str &msg, py::object lines) {
+  py::object type = py::reinterpret_borrow<py::object>(PyExc_RuntimeError);
+  py::object value = type(msg);
+  if (lines.is_none()) {
+    py::object traceback = py::module::import("traceback");
+    lines = traceback.attr("format_exception_only")(type, value);
+  }
+  return py::make_tuple(value, type, lines);
+}
+
+/**
+ * \brief The loop run by each worker of a `pool`.
+ *
+ * Each task is `(id, f, star, args)`, and is answered with `(id, True,
+ * results)` or `(id, False, error)`. A `None` task stops the worker.
+ *
+ * Every task gets an answer, even if it can't be unpickled (the `id` is then
+ * `None`), or if its answer can't be sent as is.
+ */
+static py::object worker_loop(mpmc_channel tasks, mpmc_channel results) {
+  while (true) {
+    py::object id = py::none();
+    py::tuple reply;
+    py::tuple err;
+    try {
+      py::object task = tasks.receive_pyobj(true);
+      if (task.is_none())
+        return py::none();
+
+      py::tuple t = task;
+      id = t[0];
+      py::function f = t[1];
+      bool star = t[2].cast<bool>();
+      py::list args = t[3];
+
+      try {
+        std::vector<py::object> rets;
+        for (py::handle arg : args) {
+          rets.push_back(star ? f(*arg) : f(arg));
+        }
+        reply = py::make_tuple(id, true, pack_results(rets));
+      } catch (py::error_already_set &e) {
+        reply = py::make_tuple(id, false, task_error(e));
+      }
+
+      results.send_pyobj(reply, true);
+      continue;
+    } catch (py::error_already_set &e) {
+      // the task can't be unpickled, or the results or the exception can't
+      // be pickled, so send the error as a `RuntimeError` with the message of
+      // the original one
+      err = task_error(e);
+      if (reply.size() > 0 && !reply[1].cast<bool>())
+        err = reply[2];
+      err = runtime_error(py::str(err[0]), err[2]);
+    } catch (const std::exception &e) {
+      // e.g. the results don't fit in the channel
+      err = runtime_error(py::str(e.what()), py::none());
+    }
+    results.send_pyobj(py::make_tuple(id, false, err), true);
+  }
+}
+
+pool::pool(uint n_workers, const size_t size)
+    : n_workers(n_workers), disposed(false), tasks(size), results(size) {
+  // use default # of workers (i.e. # of physical cores)?
+  if (this->n_workers == 0) {
+    this->n_workers = std::thread::hardware_concurrency();
+  }
+
+  mpmc_channel task_channel = tasks;
+  mpmc_channel result_channel = results;
+  py::cpp_function loop = [task_channel, result_channel]() {
+    return worker_loop(task_channel, result_channel);
+  };
+
+  size_t n_nodes = util::get_numa_nodes().size();
+  workers.reserve(this->n_workers);
+  for (uint i = 0; i < this->n_workers; i++) {
+    thread t(loop);
+    if (n_nodes > 1)
+      t.set_numa_node(i * n_nodes / this->n_workers);
+    t.start();
+    workers.push_back(std::move(t));
+  }
+}
+
+py::object pool::_map(const py::function &f, const py::iterable &args,
+                      uint concurrency, uint chunksize, const bool star,
+                      const bool columnar) {
+  if (disposed) {
+    throw std::runtime_error("this pool has been disposed");
+  }
+
+  py::list arg_list = py::list(args); // assemble args
+
+  // use default concurrency (i.e. # of workers)?
+  if (concurrency == 0) {
+    concurrency = n_workers;
+  }
+
+  // use default chunk size?
+  if (chunksize == 0) {
+    chunksize = (arg_list.size() + concurrency - 1) / concurrency;
+  }
+
+  size_t n_chunks = chunksize == 0
+                        ? 0
+                        : (arg_list.size() + chunksize - 1) / chunksize;
+  std::vector<py::object> chunks(n_chunks);
+
+  // tasks are sent without blocking, and results are collected whenever the
+  // task channel is full, so that this process never waits on a full task
+  // channel while the workers wait on a full result channel
+  // a task that didn't fit is kept pickled until it's sent
+  const pickle_funcs &pickle = get_pickle_funcs();
+  py::object task = py::none();
+  py::object error = py::none();
+  size_t sent = 0;
+  size_t received = 0;
+  while (received < n_chunks) {
+    try {
+      while (sent < n_chunks) {
+        if (task.is_none()) {
+          // split args
+          py::list chunk;
+          size_t end = std::min((sent + 1) * chunksize, arg_list.size());
+          for (size_t i = sent * chunksize; i < end; i++)
+            chunk.append(arg_list[i]);
+          task = pickle.dumps(py::make_tuple(sent, f, star, chunk),
+                              pickle.protocol);
+        }
+
+        // with nothing in flight, the task channel is empty, so blocking
+        // only fails if the task can never fit
+        char *bytes = PyBytes_AS_STRING(task.ptr());
+        size_t len = PyBytes_GET_SIZE(task.ptr());
+        try {
+          tasks.send_bytes(bytes, len, sent == received);
+        } catch (const std::overflow_error &) {
+          if (sent == received)
+            throw;
+          break;
+        }
+        task = py::none();
+        sent++;
+      }
+    } catch (...) {
+      // collect the tasks in flight, so that the next call starts clean
+      for (; received < sent; received++)
+        results.receive_pyobj(true);
+      throw;
+    }
+
+    py::tuple reply = results.receive_pyobj(true);
+    received++;
+    if (reply[1].cast<bool>()) {
+      chunks[reply[0].cast<size_t>()] = reply[2];
+    } else if (error.is_none()) {
+      error = reply[2];
+    }
+  }
+
+  if (!error.is_none()) {
+    // re-raise the first exception, like `thread::get_result()`
+    py::tuple err = error;
+    py::print(py::str("").attr("join")(err[2]));
+    PyErr_SetObject(err[1].ptr(), err[0].ptr());
+    throw py::error_already_set();
+  }
+
+  return join_results(chunks, columnar);
+}
+
+py::object pool::map(const py::function &f, const py::iterable &args,
+                     uint concurrency, uint chunksize, bool columnar) {
+  return _map(f, args, concurrency, chunksize, false, columnar);
+}
+
+py::object pool::starmap(const py::function &f, const py::iterable &args,
+                         uint concurrency, uint chunksize, bool columnar) {
+  return _map(f, args, concurrency, chunksize, true, columnar);
+}
+
+void pool::dispose() {
+  if (disposed)
+    return;
+  disposed = true;
+
+  for (uint i = 0; i < n_workers; i++)
+    tasks.send_pyobj(py::none(), true);
+  for (thread &t : workers) {
+    t.join();
+    t.dispose();
+  }
+  workers.clear();
+
+  tasks.dispose();
+  results.dispose();
+}
+
+} // namespace snakefish
@@ -0,0 +1,165 @@
+/**
+ * \file pool.h
+ */
+
+#ifndef SNAKEFISH_POOL_H
+#define SNAKEFISH_POOL_H
+
+#include <vector>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "mpmc_channel.h"
+#include "thread.h"
+
+namespace snakefish {
+
+/**
+ * \brief A pool of long-lived worker processes, for running many `map()`s
+ * without forking new processes for each of them.
+ *
+ * The workers are forked when the pool is created, and wait on a task
+ * channel. A `map()` on the pool splits its arguments into chunks, sends the
+ * chunks as tasks, and collects the results from a result channel, so the
+ * only per-call cost is pickling the function, the arguments and the results.
+ *
+ * Since the function is sent to the workers, it must be picklable, i.e. a
+ * module-level function that existed when the pool was created. Global
+ * variables are not merged back, and changes a worker makes to them persist
+ * across tasks.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when a pool is no
+ * longer needed to stop the workers and release resources.
+ */
+class pool {
+public:
+  /**
+   * \brief No default constructor.
+   */
+  pool() = delete;
+
+  /**
+   * \brief Default destructor.
+   */
+  ~pool() = default;
+
+  /**
+   * \brief No copy constructor.
+   */
+  pool(const pool &t) = delete;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  pool &operator=(const pool &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  pool(pool &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  pool &operator=(pool &&t) = delete;
+
+  /**
+   * \brief Create a pool and start its workers.
+   *
+   * On NUMA systems, the workers are spread evenly over the nodes.
+   *
+   * \param n_workers The number of workers. If 0, this is set to the number
+   * of cores in the system.
+   *
+   * \param size The size of the task channel and of the result channel. Each
+   * chunk of arguments and each chunk of results must fit.
+   *
+   * \throws std::runtime_error If `fork()` failed.
+   */
+  explicit pool(uint n_workers = 0, size_t size = DEFAULT_MPMC_CHANNEL_SIZE);
+
+  /**
+   * \brief `map(f, args)` executed by the workers.
+   *
+   * \param f The Python function that should be applied to each argument.
+   * It must be picklable.
+   *
+   * \param args The arguments as a Python iterable.
+   *
+   * \param concurrency The number of chunks `args` are split into, when
+   * `chunksize` is not supplied. If 0, this is set to the number of workers.
+   *
+   * \param chunksize The size of each task. If not supplied, `args` are
+   * handed out evenly (see `concurrency`).
+   *
+   * \param columnar See documentation for `snakefish::map()`.
+   *
+   * \return The return values as a `list`, or an `array.array` (see
+   * `columnar`).
+   *
+   * \throws std::runtime_error If the pool has been disposed.
+   * \throws std::overflow_error If a chunk of arguments or results doesn't
+   * fit in the channels.
+   */
+  py::object map(const py::function &f, const py::iterable &args,
+                 uint concurrency = 0, uint chunksize = 0,
+                 bool columnar = false);
+
+  /**
+   * \brief `starmap(f, args)` executed by the workers.
+   *
+   * Same as `map()`, except that each argument is unpacked.
+   */
+  py::object starmap(const py::function &f, const py::iterable &args,
+                     uint concurrency = 0, uint chunksize = 0,
+                     bool columnar = false);
+
+  /**
+   * \brief Get the number of workers.
+   */
+  uint get_n_workers() { return n_workers; }
+
+  /**
+   * \brief Stop the workers and release resources held by this pool.
+   *
+   * Tasks already sent are finished first.
+   */
+  void dispose();
+
+protected:
+  /**
+   * \brief Common implementation of `map()` and `starmap()`.
+   */
+  py::object _map(const py::function &f, const py::iterable &args,
+                  uint concurrency, uint chunksize, bool star, bool columnar);
+
+  /**
+   * \brief Number of workers.
+   */
+  uint n_workers;
+
+  /**
+   * \brief Has this pool been disposed?
+   */
+  bool disposed;
+
+  /**
+   * \brief Channel the tasks are sent on.
+   */
+  mpmc_channel tasks;
+
+  /**
+   * \brief Channel the results are sent back on.
+   */
+  mpmc_channel results;
+
+  /**
+   * \brief The workers.
+   */
+  std::vector<thread> workers;
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_POOL_H
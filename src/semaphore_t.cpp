@@ -1,6 +1,10 @@
 #include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <stdexcept>
+#include <thread>
 
+#include <time.h>
 #include <unistd.h>
 
 #include "semaphore_t.h"
@@ -9,7 +13,11 @@
 namespace snakefish {
 
 #ifdef __APPLE__
-semaphore_t::semaphore_t(unsigned int val) : name("/snakefish-") {
+semaphore_t::semaphore_t(unsigned int val, sem_t *)
+    : semaphore_t(val) {}
+
+semaphore_t::semaphore_t(unsigned int val)
+    : owns_mem(false), max_spins(0), spin_budget(0), name("/snakefish-") {
   // randomly generate a semaphore name
   name.append(std::to_string(getpid()));
   name.append("-");
@@ -22,9 +30,14 @@ semaphore_t::semaphore_t(unsigned int val) : name("/snakefish-") {
   }
 }
 #else
-semaphore_t::semaphore_t(unsigned int val) {
-  sem = static_cast<sem_t *>(util::get_shared_mem(sizeof(sem_t), true));
+semaphore_t::semaphore_t(unsigned int val)
+    : semaphore_t(val, static_cast<sem_t *>(
+                           util::get_shared_mem(sizeof(sem_t), true))) {
+  owns_mem = true;
+}
 
+semaphore_t::semaphore_t(unsigned int val, sem_t *mem)
+    : sem(mem), owns_mem(false), max_spins(0), spin_budget(0) {
   if (sem_init(sem, 1, val)) {
     perror("sem_init() failed");
     throw std::runtime_error("sem_init() failed");
@@ -40,6 +53,10 @@ void semaphore_t::post() {
 }
 
 void semaphore_t::wait() {
+  if (util::spin_until([this]() { return trywait(); }, max_spins,
+                       spin_budget))
+    return;
+
   if (sem_wait(sem)) {
     perror("sem_wait() failed");
     throw std::runtime_error("sem_wait() failed");
@@ -58,6 +75,63 @@ bool semaphore_t::trywait() {
   return true;
 }
 
+#ifdef __APPLE__
+bool semaphore_t::timedwait(const double timeout) {
+  if (timeout < 0) {
+    wait();
+    return true;
+  }
+
+  if (util::spin_until([this]() { return trywait(); }, max_spins,
+                       spin_budget))
+    return true;
+
+  // macOS doesn't implement sem_timedwait(), so poll instead
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::duration<double>(timeout);
+  while (!trywait()) {
+    if (std::chrono::steady_clock::now() >= deadline)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+#else
+bool semaphore_t::timedwait(const double timeout) {
+  if (timeout < 0) {
+    wait();
+    return true;
+  }
+
+  if (util::spin_until([this]() { return trywait(); }, max_spins,
+                       spin_budget))
+    return true;
+
+  struct timespec ts;
+  if (clock_gettime(CLOCK_REALTIME, &ts)) {
+    perror("clock_gettime() failed");
+    throw std::runtime_error("clock_gettime() failed");
+  }
+  double secs = std::floor(timeout);
+  ts.tv_sec += static_cast<time_t>(secs);
+  ts.tv_nsec += static_cast<long>((timeout - secs) * 1e9);
+  if (ts.tv_nsec >= 1000000000l) {
+    ts.tv_sec += 1;
+    ts.tv_nsec -= 1000000000l;
+  }
+
+  while (sem_timedwait(sem, &ts)) {
+    if (errno == ETIMEDOUT) {
+      return false;
+    } else if (errno != EINTR) {
+      perror("sem_timedwait() failed");
+      throw std::runtime_error("sem_timedwait() failed");
+    }
+  }
+  return true;
+}
+#endif
+
 #if __APPLE__
 void semaphore_t::destroy() {
   if (sem_close(sem)) {
@@ -75,7 +149,7 @@ void semaphore_t::destroy() {
     perror("sem_destroy() failed");
     throw std::runtime_error("sem_destroy() failed");
   }
-  if (munmap(sem, sizeof(sem_t))) {
+  if (owns_mem && munmap(sem, sizeof(sem_t))) {
     perror("munmap() failed");
     throw std::runtime_error("munmap() failed");
   }
@@ -68,6 +68,31 @@ public:
    */
   explicit semaphore_t(unsigned int val);
 
+  /**
+   * \brief Create a semaphore with initial value `val` in `mem`.
+   *
+   * This allows several semaphores to share one mapping with other shared
+   * data. `mem` must be shared memory which stays mapped until `destroy()` is
+   * called, and is left mapped afterwards. On macOS, `mem` is unused.
+   *
+   * \throws std::runtime_error If `sem_init()` or `sem_open()` failed. Check
+   * `errno` for details.
+   */
+  semaphore_t(unsigned int val, sem_t *mem);
+
+  /**
+   * Spin for a while in `wait()` and `timedwait()` before sleeping in the
+   * kernel. This only affects the calling process.
+   *
+   * @param max_spins Maximum number of checks before sleeping. The actual
+   * number adapts to how long waits turn out to be (see `util::spin_until()`).
+   * If 0, waits go straight to the kernel. This is the default.
+   */
+  void set_spin(unsigned max_spins) {
+    this->max_spins = max_spins;
+    spin_budget = max_spins;
+  }
+
   /**
    * Increment the semaphore.
    *
@@ -91,6 +116,18 @@ public:
    */
   bool trywait();
 
+  /**
+   * Like `wait()`, but gives up after `timeout` seconds.
+   *
+   * @param timeout Maximum number of seconds to wait. If negative, this is the
+   * same as `wait()`.
+   *
+   * @return `true` on success. `false` if the call timed out.
+   *
+   * @throws std::runtime_error If `sem_timedwait()` failed.
+   */
+  bool timedwait(double timeout);
+
   /**
    * Destroy this semaphore and release resources.
    *
@@ -101,6 +138,9 @@ public:
 
 private:
   sem_t *sem;
+  bool owns_mem;        // was sem mapped by this semaphore?
+  unsigned max_spins;   // see set_spin()
+  unsigned spin_budget; // see util::spin_until()
 #ifdef __APPLE__
   std::string name;
 #endif
@@ -0,0 +1,82 @@
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+
+#include "shared_array.h"
+#include "util.h"
+
+namespace snakefish {
+
+/**
+ * \brief A supported element type.
+ */
+struct dtype_info {
+  const char *name;   // NumPy type name
+  const char *format; // struct format character
+  size_t itemsize;
+};
+
+static const dtype_info DTYPES[] = {
+    {"bool", "?", sizeof(bool)},        {"int8", "b", sizeof(int8_t)},
+    {"uint8", "B", sizeof(uint8_t)},    {"int16", "h", sizeof(int16_t)},
+    {"uint16", "H", sizeof(uint16_t)},  {"int32", "i", sizeof(int32_t)},
+    {"uint32", "I", sizeof(uint32_t)},  {"int64", "q", sizeof(int64_t)},
+    {"uint64", "Q", sizeof(uint64_t)},  {"float32", "f", sizeof(float)},
+    {"float64", "d", sizeof(double)},   {nullptr, "l", sizeof(long)},
+    {nullptr, "L", sizeof(unsigned long)},
+};
+
+shared_array::shared_array(const std::vector<size_t> &shape,
+                           const std::string &dtype)
+    : data(nullptr), nbytes(0), itemsize(0), shape(shape) {
+  for (const dtype_info &info : DTYPES) {
+    if (dtype == info.format || (info.name != nullptr && dtype == info.name)) {
+      format = info.format;
+      itemsize = info.itemsize;
+      break;
+    }
+  }
+  if (itemsize == 0) {
+    throw std::invalid_argument("invalid dtype");
+  }
+  if (shape.empty()) {
+    throw std::invalid_argument("invalid shape");
+  }
+
+  nbytes = itemsize;
+  for (size_t dim : shape) {
+    if (dim == 0) {
+      throw std::invalid_argument("invalid shape");
+    }
+    if (nbytes > SIZE_MAX / dim) {
+      throw std::overflow_error("array is too large");
+    }
+    nbytes *= dim;
+  }
+
+  // anonymous shared memory is zero-filled
+  data = util::get_shared_mem(nbytes, true);
+}
+
+py::buffer_info shared_array::get_buffer_info() {
+  // C order
+  std::vector<ssize_t> dims(shape.begin(), shape.end());
+  std::vector<ssize_t> strides(shape.size());
+  ssize_t stride = itemsize;
+  for (size_t i = shape.size(); i > 0; i--) {
+    strides[i - 1] = stride;
+    stride *= dims[i - 1];
+  }
+
+  return py::buffer_info(data, itemsize, format, dims.size(), dims, strides,
+                         false);
+}
+
+void shared_array::dispose() {
+  if (munmap(data, nbytes)) {
+    perror("munmap() failed");
+    abort();
+  }
+}
+
+} // namespace snakefish
@@ -0,0 +1,163 @@
+/**
+ * \file shared_array.h
+ */
+
+#ifndef SNAKEFISH_SHARED_ARRAY_H
+#define SNAKEFISH_SHARED_ARRAY_H
+
+#include <string>
+#include <vector>
+
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+namespace py = pybind11;
+
+namespace snakefish {
+
+/**
+ * \brief A fixed-size, C-contiguous array of numbers in shared memory.
+ *
+ * The memory is allocated when the array is created, so an array created
+ * before a `thread` or `generator` is started is shared with it, and what
+ * either side writes is seen by the other without any IPC. The array exposes
+ * the Python buffer protocol, so NumPy (`numpy.asarray()`) and `memoryview`
+ * can read and write it in place.
+ *
+ * Nothing synchronizes accesses. Processes should write disjoint parts of
+ * the array, and use a channel or `join()` to know when the writes are done.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when an array is no
+ * longer needed to release resources.
+ */
+class shared_array {
+public:
+  /**
+   * \brief No default constructor.
+   */
+  shared_array() = delete;
+
+  /**
+   * \brief Default destructor.
+   */
+  ~shared_array() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  shared_array(const shared_array &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  shared_array &operator=(const shared_array &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  shared_array(shared_array &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  shared_array &operator=(shared_array &&t) = delete;
+
+  /**
+   * \brief Create a zero-filled array.
+   *
+   * \param shape The size of each dimension.
+   * \param dtype The type of the elements, either a `struct` format character
+   * (e.g. `"d"`) or a NumPy type name (e.g. `"float64"`).
+   *
+   * \throws std::invalid_argument If `shape` is empty or has a 0, or if
+   * `dtype` is not supported.
+   *
+   * \throws std::overflow_error If the array is too large.
+   */
+  explicit shared_array(const std::vector<size_t> &shape,
+                        const std::string &dtype = "d");
+
+  /**
+   * \brief Create a zero-filled array of one dimension.
+   *
+   * \param len The number of elements.
+   * \param dtype See above.
+   *
+   * \throws std::invalid_argument If `len` is 0, or if `dtype` is not
+   * supported.
+   *
+   * \throws std::overflow_error If the array is too large.
+   */
+  explicit shared_array(size_t len, const std::string &dtype = "d")
+      : shared_array(std::vector<size_t>{len}, dtype) {}
+
+  /**
+   * \brief Get a pointer to the first element.
+   */
+  void *get_ptr() { return data; }
+
+  /**
+   * \brief Get the size of the array in bytes.
+   */
+  size_t get_nbytes() { return nbytes; }
+
+  /**
+   * \brief Get the size of an element in bytes.
+   */
+  size_t get_itemsize() { return itemsize; }
+
+  /**
+   * \brief Get the `struct` format character of the elements.
+   */
+  const std::string &get_format() { return format; }
+
+  /**
+   * \brief Get the size of each dimension.
+   */
+  const std::vector<size_t> &get_shape() { return shape; }
+
+  /**
+   * \brief Get the size of the first dimension.
+   */
+  size_t get_len() { return shape[0]; }
+
+  /**
+   * \brief Describe the array for the buffer protocol.
+   */
+  py::buffer_info get_buffer_info();
+
+  /**
+   * \brief Release resources held by this array. All views of it must be
+   * released beforehand.
+   */
+  void dispose();
+
+protected:
+  /**
+   * \brief The elements.
+   */
+  void *data;
+
+  /**
+   * \brief Size of `data` in bytes.
+   */
+  size_t nbytes;
+
+  /**
+   * \brief Size of an element in bytes.
+   */
+  size_t itemsize;
+
+  /**
+   * \brief The `struct` format character of the elements.
+   */
+  std::string format;
+
+  /**
+   * \brief The size of each dimension.
+   */
+  std::vector<size_t> shape;
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_SHARED_ARRAY_H
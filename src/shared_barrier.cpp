@@ -0,0 +1,77 @@
+#include <cstdio>
+#include <stdexcept>
+
+#include "shared_barrier.h"
+#include "util.h"
+
+namespace snakefish {
+
+shared_barrier::shared_barrier(const size_t n_parties)
+    : header(static_cast<shared_barrier_header *>(
+          util::get_shared_mem(sizeof(shared_barrier_header), true))),
+      n_parties(n_parties),
+      sems{semaphore_t(0, &header->sems[0]), semaphore_t(0, &header->sems[1])},
+      max_spins(0), spin_budget(0) {
+  if (n_parties == 0) {
+    throw std::invalid_argument("invalid number of parties");
+  }
+
+  header->count.store(0);
+  header->generation.store(0);
+
+  // ensure that shared atomic variables are lock free
+  if (!header->count.is_lock_free()) {
+    fprintf(stderr, "std::atomic_size_t is not lock free!\n");
+    abort();
+  }
+}
+
+void shared_barrier::set_spin(const unsigned max_spins) {
+  this->max_spins = max_spins;
+  spin_budget = max_spins;
+}
+
+size_t shared_barrier::wait() {
+  size_t gen = header->generation.load(std::memory_order_acquire);
+  size_t idx = header->count.fetch_add(1);
+  semaphore_t &sem = sems[gen % 2];
+
+  // the last one to arrive releases the others
+  // nobody can arrive for the next generation before it's bumped
+  if (idx == n_parties - 1) {
+    header->count.store(0);
+    header->generation.store(gen + 1, std::memory_order_release);
+    for (size_t i = 0; i < n_parties - 1; i++)
+      sem.post();
+    return idx;
+  }
+
+  // every waiter takes exactly one post of its generation, so posts are never
+  // left over for the next one
+  // nobody can wait on the same semaphore again until all waiters of this
+  // generation have arrived at the next barrier, i.e. taken their posts
+  // spinning only saves going to sleep, since the post follows the bump
+  util::spin_until(
+      [this, gen]() {
+        return header->generation.load(std::memory_order_acquire) != gen;
+      },
+      max_spins, spin_budget);
+  sem.wait();
+  return idx;
+}
+
+void shared_barrier::dispose() {
+  for (semaphore_t &sem : sems) {
+    try {
+      sem.destroy();
+    } catch (...) {
+      abort();
+    }
+  }
+  if (munmap(header, sizeof(shared_barrier_header))) {
+    perror("munmap() failed");
+    abort();
+  }
+}
+
+} // namespace snakefish
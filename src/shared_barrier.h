@@ -0,0 +1,138 @@
+/**
+ * \file shared_barrier.h
+ */
+
+#ifndef SNAKEFISH_SHARED_BARRIER_H
+#define SNAKEFISH_SHARED_BARRIER_H
+
+#include <atomic>
+
+#include <semaphore.h>
+
+#include "semaphore_t.h"
+
+namespace snakefish {
+
+/**
+ * \brief The shared state of a `shared_barrier`.
+ */
+struct shared_barrier_header {
+  std::atomic_size_t count;      // number of processes waiting
+  std::atomic_size_t generation; // number of times the barrier was passed
+  sem_t sems[2];                 // one per generation parity
+};
+
+/**
+ * \brief A barrier shared by processes.
+ *
+ * Each process calling `wait()` blocks until `n_parties` processes have
+ * called it, at which point they are all released and the barrier can be
+ * used again right away, e.g. once per step of an iterative algorithm.
+ *
+ * The last process to arrive releases the others, and never sleeps.
+ *
+ * The barrier must be created before the processes sharing it are forked.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when a barrier is no
+ * longer needed to release resources.
+ */
+class shared_barrier {
+public:
+  /**
+   * \brief No default constructor.
+   */
+  shared_barrier() = delete;
+
+  /**
+   * \brief Default destructor.
+   */
+  ~shared_barrier() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  shared_barrier(const shared_barrier &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  shared_barrier &operator=(const shared_barrier &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  shared_barrier(shared_barrier &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  shared_barrier &operator=(shared_barrier &&t) = delete;
+
+  /**
+   * \brief Create a barrier for `n_parties` processes.
+   *
+   * \throws std::invalid_argument If `n_parties` is 0.
+   *
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  explicit shared_barrier(size_t n_parties);
+
+  /**
+   * \brief Wait until `n_parties` processes have called this function.
+   *
+   * \returns The order of arrival of the calling process, from 0 to
+   * `n_parties - 1`. Exactly one process gets each value.
+   *
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  size_t wait();
+
+  /**
+   * \brief Get the number of processes needed to pass the barrier.
+   */
+  size_t get_n_parties() { return n_parties; }
+
+  /**
+   * \brief Spin for a while before sleeping at the barrier. This only affects
+   * the calling process.
+   *
+   * \param max_spins See `semaphore_t::set_spin()`.
+   */
+  void set_spin(unsigned max_spins);
+
+  /**
+   * \brief Release resources held by this barrier.
+   */
+  void dispose();
+
+protected:
+  /**
+   * \brief The shared state of this barrier.
+   */
+  shared_barrier_header *header;
+
+  /**
+   * \brief Number of processes needed to pass the barrier.
+   */
+  size_t n_parties;
+
+  /**
+   * \brief Where waiters sleep. Waiters of a generation sleep on the
+   * semaphore of its parity.
+   */
+  semaphore_t sems[2];
+
+  /**
+   * \brief Maximum number of checks before sleeping (see `set_spin()`).
+   */
+  unsigned max_spins;
+
+  /**
+   * \brief Current spin budget (see `util::spin_until()`).
+   */
+  unsigned spin_budget;
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_SHARED_BARRIER_H
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#include "shared_event.h"
+#include "util.h"
+
+namespace snakefish {
+
+shared_event::shared_event()
+    : header(static_cast<shared_event_header *>(
+          util::get_shared_mem(sizeof(shared_event_header), true))),
+      max_spins(0), spin_budget(0) {
+  header->flag.store(false);
+  header->seq.store(0);
+  header->waiters.store(0);
+
+  // ensure that shared atomic variables are lock free
+  if (!header->flag.is_lock_free() || !header->seq.is_lock_free()) {
+    fprintf(stderr, "std::atomic_uint32_t is not lock free!\n");
+    abort();
+  }
+}
+
+void shared_event::set_spin(const unsigned max_spins) {
+  this->max_spins = max_spins;
+  spin_budget = max_spins;
+}
+
+void shared_event::set() {
+  header->flag.store(true);
+  header->seq.fetch_add(1);
+
+  // the fence pairs with the one in wait() so that either the waiter sees the
+  // new seq (and doesn't sleep) or this sees the waiter
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (header->waiters.load(std::memory_order_relaxed) > 0)
+    util::wake_all(&header->seq);
+}
+
+bool shared_event::wait(const double timeout) {
+  // fast path
+  if (header->flag.load())
+    return true;
+
+  // the event may be about to be set
+  uint32_t seq = header->seq.load();
+  if (util::spin_until(
+          [this, seq]() {
+            return header->seq.load() != seq || header->flag.load();
+          },
+          max_spins, spin_budget))
+    return true;
+
+  // announce that we are going to sleep, then check again in case the event
+  // was set before it could see the announcement
+  // the futex only sleeps while seq is unchanged, so a set() after the check
+  // can't be missed either
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::duration<double>(std::max(timeout, 0.0));
+  header->waiters.fetch_add(1);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  while (header->seq.load() == seq && !header->flag.load()) {
+    double remaining = -1;
+    if (timeout >= 0) {
+      remaining = std::chrono::duration<double>(
+                      deadline - std::chrono::steady_clock::now())
+                      .count();
+      if (remaining <= 0)
+        break;
+    }
+    try {
+      util::wait_on(&header->seq, seq, remaining);
+    } catch (...) {
+      header->waiters.fetch_sub(1);
+      throw;
+    }
+  }
+  header->waiters.fetch_sub(1);
+
+  return header->seq.load() != seq || header->flag.load();
+}
+
+void shared_event::dispose() {
+  if (munmap(header, sizeof(shared_event_header))) {
+    perror("munmap() failed");
+    abort();
+  }
+}
+
+} // namespace snakefish
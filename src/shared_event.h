@@ -0,0 +1,132 @@
+/**
+ * \file shared_event.h
+ */
+
+#ifndef SNAKEFISH_SHARED_EVENT_H
+#define SNAKEFISH_SHARED_EVENT_H
+
+#include <atomic>
+
+namespace snakefish {
+
+/**
+ * \brief The shared state of a `shared_event`.
+ */
+struct shared_event_header {
+  std::atomic_bool flag;        // is the event set?
+  std::atomic_uint32_t seq;     // number of calls to set(), wrapping around
+  std::atomic_uint32_t waiters; // number of processes (about to be) sleeping
+};
+
+/**
+ * \brief An event shared by processes.
+ *
+ * An event is a flag that processes can wait for. `set()` wakes up every
+ * process waiting, and later calls to `wait()` return right away until
+ * `clear()` is called.
+ *
+ * Checking a set event costs an atomic load. Waiters sleep on a futex on the
+ * number of calls to `set()`, so a waiter wakes up even if the event is
+ * cleared again right away, and `set()` only makes a system call when someone
+ * might be sleeping.
+ *
+ * The event must be created before the processes sharing it are forked.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when an event is no
+ * longer needed to release resources.
+ */
+class shared_event {
+public:
+  /**
+   * \brief Create an event that is not set.
+   */
+  shared_event();
+
+  /**
+   * \brief Default destructor.
+   */
+  ~shared_event() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  shared_event(const shared_event &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  shared_event &operator=(const shared_event &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  shared_event(shared_event &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  shared_event &operator=(shared_event &&t) = delete;
+
+  /**
+   * \brief Set the event, waking up every process waiting for it.
+   *
+   * \throws std::runtime_error If `futex()` failed.
+   */
+  void set();
+
+  /**
+   * \brief Clear the event.
+   */
+  void clear() { header->flag.store(false); }
+
+  /**
+   * \brief Check whether the event is set.
+   */
+  bool is_set() { return header->flag.load(); }
+
+  /**
+   * \brief Wait until the event is set.
+   *
+   * \param timeout Maximum number of seconds to wait. If negative, wait for as
+   * long as it takes.
+   *
+   * \returns `true` if the event is set, or was set while waiting. `false` if
+   * the call timed out.
+   *
+   * \throws std::runtime_error If `futex()` failed.
+   */
+  bool wait(double timeout = -1);
+
+  /**
+   * \brief Spin for a while before sleeping. This only affects the calling
+   * process.
+   *
+   * \param max_spins See `semaphore_t::set_spin()`.
+   */
+  void set_spin(unsigned max_spins);
+
+  /**
+   * \brief Release resources held by this event.
+   */
+  void dispose();
+
+protected:
+  /**
+   * \brief The shared state of this event.
+   */
+  shared_event_header *header;
+
+  /**
+   * \brief Maximum number of checks before sleeping (see `set_spin()`).
+   */
+  unsigned max_spins;
+
+  /**
+   * \brief Current spin budget (see `util::spin_until()`).
+   */
+  unsigned spin_budget;
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_SHARED_EVENT_H
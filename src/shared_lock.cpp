@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+
+#include "shared_lock.h"
+#include "util.h"
+
+namespace snakefish {
+
+shared_lock::shared_lock()
+    : header(static_cast<shared_lock_header *>(
+          util::get_shared_mem(sizeof(shared_lock_header), true))),
+      sem(0, &header->sem), max_spins(0), spin_budget(0) {
+  header->state.store(0);
+
+  // ensure that shared atomic variables are lock free
+  if (!header->state.is_lock_free()) {
+    fprintf(stderr, "std::atomic_uint is not lock free!\n");
+    abort();
+  }
+}
+
+void shared_lock::set_spin(const unsigned max_spins) {
+  this->max_spins = max_spins;
+  spin_budget = max_spins;
+}
+
+bool shared_lock::acquire(const bool block, const double timeout) {
+  // fast path
+  unsigned c = 0;
+  if (header->state.compare_exchange_strong(c, 1))
+    return true;
+  if (!block)
+    return false;
+
+  // the holder may be about to release it
+  if (util::spin_until(
+          [this]() {
+            unsigned c = 0;
+            return header->state.compare_exchange_strong(c, 1);
+          },
+          max_spins, spin_budget))
+    return true;
+
+  // announce that we are going to sleep, and take the lock if it was released
+  // in the meantime
+  // the lock is then marked as having waiters even if there are none left,
+  // which only causes a spurious post on release, handled by the loop
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::duration<double>(std::max(timeout, 0.0));
+  while (header->state.exchange(2) != 0) {
+    double remaining = -1;
+    if (timeout >= 0) {
+      remaining = std::chrono::duration<double>(
+                      deadline - std::chrono::steady_clock::now())
+                      .count();
+      if (remaining <= 0)
+        return false;
+    }
+    if (!sem.timedwait(remaining))
+      return false;
+  }
+  return true;
+}
+
+void shared_lock::release() {
+  unsigned c = header->state.load();
+  do {
+    if (c == 0) {
+      throw std::runtime_error("lock is not locked");
+    }
+  } while (!header->state.compare_exchange_weak(c, 0));
+
+  // wake up one waiter, which will mark the lock as having waiters again
+  if (c == 2)
+    sem.post();
+}
+
+void shared_lock::dispose() {
+  try {
+    sem.destroy();
+  } catch (...) {
+    abort();
+  }
+  if (munmap(header, sizeof(shared_lock_header))) {
+    perror("munmap() failed");
+    abort();
+  }
+}
+
+} // namespace snakefish
@@ -0,0 +1,135 @@
+/**
+ * \file shared_lock.h
+ */
+
+#ifndef SNAKEFISH_SHARED_LOCK_H
+#define SNAKEFISH_SHARED_LOCK_H
+
+#include <atomic>
+
+#include <semaphore.h>
+
+#include "semaphore_t.h"
+
+namespace snakefish {
+
+/**
+ * \brief The shared state of a `shared_lock`.
+ */
+struct shared_lock_header {
+  std::atomic_uint state; // 0: unlocked, 1: locked, 2: locked with waiters
+  sem_t sem;
+};
+
+/**
+ * \brief A lock shared by processes.
+ *
+ * The lock is a word in shared memory, so taking and releasing it costs an
+ * atomic operation when there's no contention. Processes that have to wait
+ * sleep on a semaphore, which is only posted when someone might be sleeping.
+ *
+ * The lock is not owned by a process: any process may release it.
+ *
+ * The lock must be created before the processes sharing it are forked.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when a lock is no
+ * longer needed to release resources.
+ */
+class shared_lock {
+public:
+  /**
+   * \brief Create an unlocked lock.
+   *
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  shared_lock();
+
+  /**
+   * \brief Default destructor.
+   */
+  ~shared_lock() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  shared_lock(const shared_lock &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  shared_lock &operator=(const shared_lock &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  shared_lock(shared_lock &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  shared_lock &operator=(shared_lock &&t) = delete;
+
+  /**
+   * \brief Take the lock.
+   *
+   * \param block If `false`, give up right away if the lock is taken.
+   * \param timeout Maximum number of seconds to wait. If negative, wait for as
+   * long as it takes.
+   *
+   * \returns `true` if the lock was taken.
+   *
+   * \throws std::runtime_error If some semaphore error occurred.
+   */
+  bool acquire(bool block = true, double timeout = -1);
+
+  /**
+   * \brief Release the lock.
+   *
+   * \throws std::runtime_error If the lock is not locked, or if some semaphore
+   * error occurred.
+   */
+  void release();
+
+  /**
+   * \brief Check whether the lock is taken.
+   */
+  bool locked() { return header->state.load() != 0; }
+
+  /**
+   * \brief Spin for a while before sleeping when the lock is taken. This only
+   * affects the calling process.
+   *
+   * \param max_spins See `semaphore_t::set_spin()`.
+   */
+  void set_spin(unsigned max_spins);
+
+  /**
+   * \brief Release resources held by this lock.
+   */
+  void dispose();
+
+protected:
+  /**
+   * \brief The shared state of this lock.
+   */
+  shared_lock_header *header;
+
+  /**
+   * \brief Where waiters sleep.
+   */
+  semaphore_t sem;
+
+  /**
+   * \brief Maximum number of checks before sleeping (see `set_spin()`).
+   */
+  unsigned max_spins;
+
+  /**
+   * \brief Current spin budget (see `util::spin_until()`).
+   */
+  unsigned spin_budget;
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_SHARED_LOCK_H
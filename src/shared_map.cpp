@@ -0,0 +1,254 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "shared_map.h"
+#include "util.h"
+
+namespace snakefish {
+
+/**
+ * \brief The tag of a slot with no key.
+ */
+static const uint64_t SLOT_EMPTY = 0;
+
+/**
+ * \brief The tag of a slot whose key is being written.
+ */
+static const uint64_t SLOT_BUSY = 1;
+
+/**
+ * \brief Get the tag of a slot holding a key, from the hash of the key. The
+ * top bit is set so that it's never `SLOT_EMPTY` or `SLOT_BUSY`.
+ */
+static uint64_t hash_key(const char *key, const size_t key_len,
+                         const int kind) {
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ull;
+  hash = (hash ^ static_cast<unsigned char>(kind)) * 0x100000001b3ull;
+  for (size_t i = 0; i < key_len; i++)
+    hash = (hash ^ static_cast<unsigned char>(key[i])) * 0x100000001b3ull;
+  return hash | (static_cast<uint64_t>(1) << 63);
+}
+
+/**
+ * \brief Get the bytes of a Python key.
+ *
+ * \param key The key.
+ * \param int_key Storage for the bytes of an `int` key.
+ * \param ptr Set to the start of the bytes.
+ * \param len Set to the number of bytes.
+ *
+ * \returns The `key_kind` of the key.
+ *
+ * \throws std::invalid_argument If `key` is not an `int` (that fits in 64
+ * bits) or `bytes`.
+ */
+static int key_of(const py::object &key, int64_t &int_key, const char *&ptr,
+                  size_t &len) {
+  PyObject *p = key.ptr();
+  if (PyLong_CheckExact(p)) {
+    int overflow = 0;
+    int_key = PyLong_AsLongLongAndOverflow(p, &overflow);
+    if (overflow) {
+      throw std::invalid_argument("invalid key");
+    }
+    ptr = reinterpret_cast<const char *>(&int_key);
+    len = sizeof(int_key);
+    return key_kind::INT_KEY;
+  } else if (PyBytes_CheckExact(p)) {
+    ptr = PyBytes_AS_STRING(p);
+    len = PyBytes_GET_SIZE(p);
+    return key_kind::BYTES_KEY;
+  }
+
+  throw std::invalid_argument("invalid key");
+}
+
+shared_map::shared_map(const size_t capacity, size_t max_key_len)
+    : slots(nullptr), n_slots(1), slot_size(0), capacity(capacity),
+      max_key_len(0), header(nullptr) {
+  if (capacity == 0 || capacity > SIZE_MAX / 4) {
+    throw std::invalid_argument("invalid map capacity");
+  }
+  if (max_key_len > UINT32_MAX) {
+    throw std::invalid_argument("invalid maximum key length");
+  }
+
+  // int keys always fit
+  max_key_len = std::max(max_key_len, sizeof(int64_t));
+  this->max_key_len = max_key_len;
+  slot_size = (sizeof(shared_map_slot) + max_key_len + 7) / 8 * 8;
+  while (n_slots < 2 * capacity)
+    n_slots *= 2;
+  if (n_slots > SIZE_MAX / slot_size) {
+    throw std::invalid_argument("invalid map capacity");
+  }
+
+  // create shared memory
+  // anonymous shared memory is zero-filled, so every slot starts empty
+  header = static_cast<shared_map_header *>(
+      util::get_shared_mem(sizeof(shared_map_header), true));
+  slots = static_cast<char *>(util::get_shared_mem(n_slots * slot_size, true));
+  header->size.store(0);
+
+  // ensure that shared atomic variables are lock free
+  if (!slot_at(0)->tag.is_lock_free() || !slot_at(0)->value.is_lock_free()) {
+    fprintf(stderr, "std::atomic_uint64_t is not lock free!\n");
+    abort();
+  }
+}
+
+shared_map_slot *shared_map::find(const char *key, const size_t key_len,
+                                  const int kind, const bool insert) {
+  if (key_len > max_key_len) {
+    throw std::invalid_argument("key is too long");
+  }
+
+  uint64_t tag = hash_key(key, key_len, kind);
+  size_t mask = n_slots - 1;
+  for (size_t i = tag & mask;; i = (i + 1) & mask) {
+    shared_map_slot *slot = slot_at(i);
+    char *slot_key = reinterpret_cast<char *>(slot) + sizeof(shared_map_slot);
+    uint64_t t = slot->tag.load(std::memory_order_acquire);
+
+    while (t == SLOT_EMPTY || t == SLOT_BUSY) {
+      if (t == SLOT_BUSY) {
+        // the key of the slot is being written, or the slot is being given
+        // back because the map is full
+        util::cpu_relax();
+        t = slot->tag.load(std::memory_order_acquire);
+        continue;
+      }
+      if (!insert)
+        return nullptr;
+
+      // claim the slot first, so that racing inserts of the same key only
+      // count once, then reserve room for the key
+      // there are twice as many slots as keys, so probing always ends
+      if (slot->tag.compare_exchange_strong(t, SLOT_BUSY)) {
+        if (header->size.fetch_add(1) >= capacity) {
+          header->size.fetch_sub(1);
+          slot->tag.store(SLOT_EMPTY, std::memory_order_release);
+          throw std::overflow_error("map is full");
+        }
+        slot->key_len = key_len;
+        slot->kind = kind;
+        memcpy(slot_key, key, key_len);
+        slot->tag.store(tag, std::memory_order_release);
+        return slot;
+      }
+
+      // someone else took the slot, maybe for the same key
+    }
+
+    if (t == tag && slot->kind == static_cast<uint32_t>(kind) &&
+        slot->key_len == key_len && memcmp(slot_key, key, key_len) == 0)
+      return slot;
+  }
+}
+
+int64_t shared_map::add(const char *key, const size_t key_len, const int kind,
+                        const int64_t delta) {
+  shared_map_slot *slot = find(key, key_len, kind, true);
+  return slot->value.fetch_add(delta) + delta;
+}
+
+void shared_map::set(const char *key, const size_t key_len, const int kind,
+                     const int64_t val) {
+  shared_map_slot *slot = find(key, key_len, kind, true);
+  slot->value.store(val);
+}
+
+bool shared_map::get(const char *key, const size_t key_len, const int kind,
+                     int64_t &val) {
+  if (key_len > max_key_len)
+    return false;
+  shared_map_slot *slot = find(key, key_len, kind, false);
+  if (slot == nullptr)
+    return false;
+  val = slot->value.load();
+  return true;
+}
+
+int64_t shared_map::add_py(const py::object &key, const int64_t delta) {
+  int64_t int_key = 0;
+  const char *ptr = nullptr;
+  size_t len = 0;
+  int kind = key_of(key, int_key, ptr, len);
+  return add(ptr, len, kind, delta);
+}
+
+void shared_map::set_py(const py::object &key, const int64_t val) {
+  int64_t int_key = 0;
+  const char *ptr = nullptr;
+  size_t len = 0;
+  int kind = key_of(key, int_key, ptr, len);
+  set(ptr, len, kind, val);
+}
+
+py::object shared_map::get_py(const py::object &key,
+                              const py::object &default_val) {
+  int64_t int_key = 0;
+  const char *ptr = nullptr;
+  size_t len = 0;
+  int kind = key_of(key, int_key, ptr, len);
+
+  int64_t val = 0;
+  if (!get(ptr, len, kind, val))
+    return default_val;
+  PyObject *obj = PyLong_FromLongLong(val);
+  if (obj == nullptr)
+    throw py::error_already_set();
+  return py::reinterpret_steal<py::object>(obj);
+}
+
+py::dict shared_map::to_dict() {
+  py::dict dict;
+  for (size_t i = 0; i < n_slots; i++) {
+    shared_map_slot *slot = slot_at(i);
+    uint64_t t = slot->tag.load(std::memory_order_acquire);
+    if (t == SLOT_EMPTY || t == SLOT_BUSY)
+      continue;
+
+    const char *slot_key =
+        reinterpret_cast<const char *>(slot) + sizeof(shared_map_slot);
+    PyObject *key;
+    if (slot->kind == key_kind::INT_KEY) {
+      int64_t int_key = 0;
+      memcpy(&int_key, slot_key, sizeof(int_key));
+      key = PyLong_FromLongLong(int_key);
+    } else {
+      key = PyBytes_FromStringAndSize(slot_key, slot->key_len);
+    }
+    if (key == nullptr)
+      throw py::error_already_set();
+    py::object key_obj = py::reinterpret_steal<py::object>(key);
+
+    PyObject *val = PyLong_FromLongLong(slot->value.load());
+    if (val == nullptr)
+      throw py::error_already_set();
+    py::object val_obj = py::reinterpret_steal<py::object>(val);
+
+    if (PyDict_SetItem(dict.ptr(), key_obj.ptr(), val_obj.ptr()))
+      throw py::error_already_set();
+  }
+  return dict;
+}
+
+void shared_map::dispose() {
+  if (munmap(slots, n_slots * slot_size)) {
+    perror("munmap() failed");
+    abort();
+  }
+  if (munmap(header, sizeof(shared_map_header))) {
+    perror("munmap() failed");
+    abort();
+  }
+}
+
+} // namespace snakefish
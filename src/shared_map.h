@@ -0,0 +1,230 @@
+/**
+ * \file shared_map.h
+ */
+
+#ifndef SNAKEFISH_SHARED_MAP_H
+#define SNAKEFISH_SHARED_MAP_H
+
+#include <atomic>
+#include <cstdint>
+
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+namespace snakefish {
+
+/**
+ * \brief The default maximum key length of a `shared_map`.
+ */
+const size_t DEFAULT_MAX_KEY_LEN = 24;
+
+/**
+ * \brief An enum indicating the type of a key of a `shared_map`.
+ */
+enum key_kind { INT_KEY = 1, BYTES_KEY };
+
+/**
+ * \brief The header of a slot of a `shared_map`. The key follows right after
+ * it.
+ */
+struct shared_map_slot {
+  std::atomic_uint64_t tag;  // SLOT_EMPTY, SLOT_BUSY, or the key hash (tagged)
+  std::atomic_int64_t value; // the value
+  uint32_t key_len;          // length of the key
+  uint32_t kind;             // a key_kind
+};
+
+/**
+ * \brief The shared state of a `shared_map`.
+ */
+struct shared_map_header {
+  std::atomic_size_t size; // number of keys
+};
+
+/**
+ * \brief A fixed-capacity hash map from integers and bytes to integers in
+ * shared memory, e.g. for counting.
+ *
+ * The map is allocated when it's created, so a map created before a `thread`
+ * or `generator` is started is shared with it, and every process can add
+ * keys and update values at the same time without a lock. Nothing has to be
+ * merged at the end.
+ *
+ * Keys are never removed. The map uses open addressing with linear probing,
+ * and keys are stored inline, up to a fixed length.
+ *
+ * **IMPORTANT**: The `dispose()` function must be called when a map is no
+ * longer needed to release resources.
+ */
+class shared_map {
+public:
+  /**
+   * \brief No default constructor.
+   */
+  shared_map() = delete;
+
+  /**
+   * \brief Default destructor.
+   */
+  ~shared_map() = default;
+
+  /**
+   * \brief Default copy constructor.
+   */
+  shared_map(const shared_map &t) = default;
+
+  /**
+   * \brief No copy assignment operator.
+   */
+  shared_map &operator=(const shared_map &t) = delete;
+
+  /**
+   * \brief Default move constructor.
+   */
+  shared_map(shared_map &&t) = default;
+
+  /**
+   * \brief No move assignment operator.
+   */
+  shared_map &operator=(shared_map &&t) = delete;
+
+  /**
+   * \brief Create a map with room for `capacity` keys of at most
+   * `max_key_len` bytes.
+   *
+   * The number of slots is twice `capacity`, rounded up to a power of 2, so
+   * that probe sequences stay short.
+   *
+   * \throws std::invalid_argument If `capacity` is 0 or too large.
+   */
+  explicit shared_map(size_t capacity,
+                      size_t max_key_len = DEFAULT_MAX_KEY_LEN);
+
+  /**
+   * \brief Add `delta` to the value of a key, adding the key with value 0
+   * first if needed.
+   *
+   * \returns The new value.
+   *
+   * \throws std::invalid_argument If the key is too long.
+   *
+   * \throws std::overflow_error If the key is new and the map is full.
+   */
+  int64_t add(const char *key, size_t key_len, int kind, int64_t delta);
+
+  /**
+   * \brief Set the value of a key, adding the key if needed.
+   *
+   * \throws std::invalid_argument If the key is too long.
+   *
+   * \throws std::overflow_error If the key is new and the map is full.
+   */
+  void set(const char *key, size_t key_len, int kind, int64_t val);
+
+  /**
+   * \brief Get the value of a key.
+   *
+   * \returns `true` if the key was found, in which case `val` is set.
+   */
+  bool get(const char *key, size_t key_len, int kind, int64_t &val);
+
+  /**
+   * \brief Python version of `add()`.
+   *
+   * \throws std::invalid_argument If `key` is not an `int` (that fits in 64
+   * bits) or `bytes`, or if it's too long.
+   */
+  int64_t add_py(const py::object &key, int64_t delta);
+
+  /**
+   * \brief Python version of `set()`.
+   *
+   * \throws std::invalid_argument If `key` is not an `int` (that fits in 64
+   * bits) or `bytes`, or if it's too long.
+   */
+  void set_py(const py::object &key, int64_t val);
+
+  /**
+   * \brief Python version of `get()`.
+   *
+   * \returns The value, or `default_val` if the key wasn't found.
+   */
+  py::object get_py(const py::object &key, const py::object &default_val);
+
+  /**
+   * \brief Get all keys and values, as a `dict`.
+   *
+   * Each value is read atomically, but not all of them at once.
+   */
+  py::dict to_dict();
+
+  /**
+   * \brief Get the number of keys.
+   */
+  size_t get_size() { return header->size.load(); }
+
+  /**
+   * \brief Get the maximum number of keys.
+   */
+  size_t get_capacity() { return capacity; }
+
+  /**
+   * \brief Release resources held by this map.
+   */
+  void dispose();
+
+protected:
+  /**
+   * \brief Find the slot of a key, adding the key if `insert` is `true`.
+   *
+   * \returns The slot, or `null` if the key wasn't found and `insert` is
+   * `false`.
+   *
+   * \throws std::invalid_argument If the key is too long.
+   *
+   * \throws std::overflow_error If the key is new and the map is full.
+   */
+  shared_map_slot *find(const char *key, size_t key_len, int kind,
+                        bool insert);
+
+  /**
+   * \brief Get slot `i`.
+   */
+  shared_map_slot *slot_at(const size_t i) {
+    return reinterpret_cast<shared_map_slot *>(slots + i * slot_size);
+  }
+
+  /**
+   * \brief The slots.
+   */
+  char *slots;
+
+  /**
+   * \brief Number of slots, a power of 2.
+   */
+  size_t n_slots;
+
+  /**
+   * \brief Size of a slot, including the key.
+   */
+  size_t slot_size;
+
+  /**
+   * \brief Maximum number of keys.
+   */
+  size_t capacity;
+
+  /**
+   * \brief Maximum key length.
+   */
+  size_t max_key_len;
+
+  /**
+   * \brief The shared state of this map.
+   */
+  shared_map_header *header;
+};
+
+} // namespace snakefish
+
+#endif // SNAKEFISH_SHARED_MAP_H
@@ -1,5 +1,27 @@
 #include "snakefish.h"
 
+/**
+ * \brief The `bf_getbuffer` slot of `ChannelView`, which counts the buffers
+ * exported by a view so that it can't be released under them.
+ */
+static int channel_view_getbuffer(PyObject *obj, Py_buffer *view,
+                                  int flags) {
+  snakefish::channel_view &v =
+      py::handle(obj).cast<snakefish::channel_view &>();
+  if (PyBuffer_FillInfo(view, obj, const_cast<void *>(v.get_ptr()),
+                        v.get_len(), v.is_readonly(), flags))
+    return -1;
+  v.add_export();
+  return 0;
+}
+
+/**
+ * \brief The `bf_releasebuffer` slot of `ChannelView`.
+ */
+static void channel_view_releasebuffer(PyObject *obj, Py_buffer *) {
+  py::handle(obj).cast<snakefish::channel_view &>().remove_export();
+}
+
 PYBIND11_MODULE(snakefish, m) {
   py::class_<snakefish::thread>(m, "Thread")
       .def(py::init<py::function>())
@@ -10,6 +32,8 @@ PYBIND11_MODULE(snakefish, m) {
       .def("is_alive", &snakefish::thread::is_alive)
       .def("get_exit_status", &snakefish::thread::get_exit_status)
       .def("get_result", &snakefish::thread::get_result)
+      .def("set_numa_node", &snakefish::thread::set_numa_node,
+           py::arg("node") = -1)
       .def("dispose", &snakefish::thread::dispose);
 
   py::class_<snakefish::generator>(m, "Generator")
@@ -20,29 +44,215 @@ PYBIND11_MODULE(snakefish, m) {
       .def("join", &snakefish::generator::join)
       .def("try_join", &snakefish::generator::try_join)
       .def("get_exit_status", &snakefish::generator::get_exit_status)
+      .def("set_spin", &snakefish::generator::set_spin)
+      .def("set_numa_node", &snakefish::generator::set_numa_node,
+           py::arg("node") = -1)
       .def("dispose", &snakefish::generator::dispose);
 
+  py::class_<snakefish::pool>(m, "Pool")
+      .def(py::init<uint>(), py::arg("n_workers") = 0)
+      .def(py::init<uint, size_t>(), py::arg("n_workers"), py::arg("size"))
+      .def("map", &snakefish::pool::map, py::arg("f"), py::arg("args"),
+           py::arg("concurrency") = 0, py::arg("chunksize") = 0,
+           py::arg("columnar") = false)
+      .def("starmap", &snakefish::pool::starmap, py::arg("f"),
+           py::arg("args"), py::arg("concurrency") = 0,
+           py::arg("chunksize") = 0, py::arg("columnar") = false)
+      .def("get_n_workers", &snakefish::pool::get_n_workers)
+      .def("__enter__", [](py::object self) { return self; })
+      .def("__exit__", [](snakefish::pool &p, py::args) { p.dispose(); })
+      .def("dispose", &snakefish::pool::dispose);
+
+  py::enum_<snakefish::channel_mode>(m, "ChannelMode")
+      .value("LOCKED", snakefish::channel_mode::LOCKED)
+      .value("SPSC", snakefish::channel_mode::SPSC);
+
+  py::enum_<snakefish::page_policy>(m, "PagePolicy")
+      .value("DEFAULT", snakefish::page_policy::DEFAULT_PAGES)
+      .value("TRANSPARENT_HUGE", snakefish::page_policy::TRANSPARENT_HUGE_PAGES)
+      .value("HUGETLB", snakefish::page_policy::HUGETLB_PAGES);
+
   py::class_<snakefish::channel>(m, "Channel")
       .def(py::init<>())
       .def(py::init<size_t>())
-      .def("send_pyobj", &snakefish::channel::send_pyobj)
+      .def(py::init<snakefish::channel_mode>())
+      .def(py::init<size_t, snakefish::channel_mode>())
+      .def(py::init<size_t, size_t, snakefish::channel_mode>())
+      .def("send_pyobj", &snakefish::channel::send_pyobj, py::arg("obj"),
+           py::arg("block") = false, py::arg("timeout") = -1.0)
       .def("receive_pyobj", &snakefish::channel::receive_pyobj)
+      .def("receive_view", &snakefish::channel::receive_view)
+      .def("send_many", &snakefish::channel::send_many, py::arg("objs"),
+           py::arg("block") = false, py::arg("timeout") = -1.0)
+      .def("receive_many", &snakefish::channel::receive_many)
+      .def("reserve", &snakefish::channel::reserve, py::arg("size"),
+           py::arg("block") = false, py::arg("timeout") = -1.0)
+      .def("write", static_cast<size_t (snakefish::channel::*)(
+                        const py::buffer &)>(&snakefish::channel::write))
+      .def("commit", &snakefish::channel::commit)
+      .def("cancel", &snakefish::channel::cancel)
+      .def("set_spin", &snakefish::channel::set_spin)
+      .def("enable_stats", &snakefish::channel::enable_stats,
+           py::arg("enabled") = true)
+      .def("reset_stats", &snakefish::channel::reset_stats)
+      .def("stats", &snakefish::channel::stats)
+      .def("set_page_policy", &snakefish::channel::set_page_policy,
+           py::arg("policy"), py::arg("prefault") = false)
+      .def("set_trim_threshold", &snakefish::channel::set_trim_threshold)
+      .def("set_numa_node", &snakefish::channel::set_numa_node,
+           py::arg("node") = -1)
       .def("dispose", &snakefish::channel::dispose);
 
+  py::class_<snakefish::mpmc_channel>(m, "MPMCChannel")
+      .def(py::init<>())
+      .def(py::init<size_t>())
+      .def("send_pyobj", &snakefish::mpmc_channel::send_pyobj, py::arg("obj"),
+           py::arg("block") = false, py::arg("timeout") = -1.0)
+      .def("receive_pyobj", &snakefish::mpmc_channel::receive_pyobj)
+      .def("set_spin", &snakefish::mpmc_channel::set_spin)
+      .def("dispose", &snakefish::mpmc_channel::dispose);
+
+  py::class_<snakefish::object_store>(m, "ObjectStore")
+      .def(py::init<>())
+      .def(py::init<size_t>())
+      .def("put", &snakefish::object_store::put)
+      .def("get", &snakefish::object_store::get)
+      .def("retain", &snakefish::object_store::retain)
+      .def("release", &snakefish::object_store::release)
+      .def("get_used", &snakefish::object_store::get_used)
+      .def("dispose", &snakefish::object_store::dispose);
+
+  py::class_<snakefish::object_store_view>(m, "ObjectStoreView",
+                                           py::buffer_protocol())
+      .def_buffer([](snakefish::object_store_view &v) -> py::buffer_info {
+        return py::buffer_info(const_cast<void *>(v.get_ptr()), 1, "B", 1,
+                               {static_cast<ssize_t>(v.get_len())}, {1},
+                               true);
+      })
+      .def("__len__", &snakefish::object_store_view::get_len);
+
+  py::class_<snakefish::shared_array>(m, "SharedArray", py::buffer_protocol())
+      .def(py::init<std::vector<size_t>, std::string>(), py::arg("shape"),
+           py::arg("dtype") = "d")
+      .def(py::init<size_t, std::string>(), py::arg("shape"),
+           py::arg("dtype") = "d")
+      .def_buffer(&snakefish::shared_array::get_buffer_info)
+      .def("__len__", &snakefish::shared_array::get_len)
+      .def_property_readonly("shape", &snakefish::shared_array::get_shape)
+      .def_property_readonly("dtype", &snakefish::shared_array::get_format)
+      .def_property_readonly("nbytes", &snakefish::shared_array::get_nbytes)
+      .def("dispose", &snakefish::shared_array::dispose);
+
+  py::class_<snakefish::atomic_array<int64_t>>(m, "AtomicInt")
+      .def(py::init<size_t>(), py::arg("len") = 1)
+      .def("load", &snakefish::atomic_array<int64_t>::load, py::arg("i") = 0)
+      .def("store", &snakefish::atomic_array<int64_t>::store, py::arg("val"),
+           py::arg("i") = 0)
+      .def("fetch_add", &snakefish::atomic_array<int64_t>::fetch_add,
+           py::arg("val"), py::arg("i") = 0)
+      .def("compare_exchange",
+           &snakefish::atomic_array<int64_t>::compare_exchange,
+           py::arg("expected"), py::arg("desired"), py::arg("i") = 0)
+      .def("to_list", &snakefish::atomic_array<int64_t>::to_list)
+      .def("__len__", &snakefish::atomic_array<int64_t>::get_len)
+      .def("dispose", &snakefish::atomic_array<int64_t>::dispose);
+
+  py::class_<snakefish::atomic_array<double>>(m, "AtomicFloat")
+      .def(py::init<size_t>(), py::arg("len") = 1)
+      .def("load", &snakefish::atomic_array<double>::load, py::arg("i") = 0)
+      .def("store", &snakefish::atomic_array<double>::store, py::arg("val"),
+           py::arg("i") = 0)
+      .def("fetch_add", &snakefish::atomic_array<double>::fetch_add,
+           py::arg("val"), py::arg("i") = 0)
+      .def("compare_exchange",
+           &snakefish::atomic_array<double>::compare_exchange,
+           py::arg("expected"), py::arg("desired"), py::arg("i") = 0)
+      .def("to_list", &snakefish::atomic_array<double>::to_list)
+      .def("__len__", &snakefish::atomic_array<double>::get_len)
+      .def("dispose", &snakefish::atomic_array<double>::dispose);
+
+  py::class_<snakefish::shared_map>(m, "SharedMap")
+      .def(py::init<size_t, size_t>(), py::arg("capacity"),
+           py::arg("max_key_len") = snakefish::DEFAULT_MAX_KEY_LEN)
+      .def("add", &snakefish::shared_map::add_py, py::arg("key"),
+           py::arg("delta") = 1)
+      .def("set", &snakefish::shared_map::set_py)
+      .def("get", &snakefish::shared_map::get_py, py::arg("key"),
+           py::arg("default") = py::none())
+      .def("to_dict", &snakefish::shared_map::to_dict)
+      .def("get_capacity", &snakefish::shared_map::get_capacity)
+      .def("__len__", &snakefish::shared_map::get_size)
+      .def("dispose", &snakefish::shared_map::dispose);
+
+  py::class_<snakefish::shared_lock>(m, "Lock")
+      .def(py::init<>())
+      .def("acquire", &snakefish::shared_lock::acquire,
+           py::arg("block") = true, py::arg("timeout") = -1.0)
+      .def("release", &snakefish::shared_lock::release)
+      .def("locked", &snakefish::shared_lock::locked)
+      .def("__enter__",
+           [](snakefish::shared_lock &lock) { return lock.acquire(); })
+      .def("__exit__",
+           [](snakefish::shared_lock &lock, py::args) { lock.release(); })
+      .def("set_spin", &snakefish::shared_lock::set_spin)
+      .def("dispose", &snakefish::shared_lock::dispose);
+
+  py::class_<snakefish::shared_barrier>(m, "Barrier")
+      .def(py::init<size_t>())
+      .def("wait", &snakefish::shared_barrier::wait)
+      .def("get_n_parties", &snakefish::shared_barrier::get_n_parties)
+      .def("set_spin", &snakefish::shared_barrier::set_spin)
+      .def("dispose", &snakefish::shared_barrier::dispose);
+
+  py::class_<snakefish::shared_event>(m, "Event")
+      .def(py::init<>())
+      .def("set", &snakefish::shared_event::set)
+      .def("clear", &snakefish::shared_event::clear)
+      .def("is_set", &snakefish::shared_event::is_set)
+      .def("wait", &snakefish::shared_event::wait, py::arg("timeout") = -1.0)
+      .def("set_spin", &snakefish::shared_event::set_spin)
+      .def("dispose", &snakefish::shared_event::dispose);
+
+  py::class_<snakefish::broadcast_channel>(m, "BroadcastChannel")
+      .def(py::init<size_t>())
+      .def(py::init<size_t, size_t>())
+      .def("send_pyobj", &snakefish::broadcast_channel::send_pyobj,
+           py::arg("obj"), py::arg("block") = false, py::arg("timeout") = -1.0)
+      .def("receive_pyobj", &snakefish::broadcast_channel::receive_pyobj)
+      .def("poll", &snakefish::broadcast_channel::poll)
+      .def("get_n_receivers", &snakefish::broadcast_channel::get_n_receivers)
+      .def("set_spin", &snakefish::broadcast_channel::set_spin)
+      .def("dispose", &snakefish::broadcast_channel::dispose);
+
+  py::class_<snakefish::channel_view> channel_view(m, "ChannelView",
+                                                   py::buffer_protocol());
+  channel_view.def("__len__", &snakefish::channel_view::get_len)
+      .def("release", &snakefish::channel_view::release);
+  // exports are counted, which pybind11's buffer protocol support can't do
+  PyBufferProcs *procs =
+      reinterpret_cast<PyTypeObject *>(channel_view.ptr())->tp_as_buffer;
+  procs->bf_getbuffer = channel_view_getbuffer;
+  procs->bf_releasebuffer = channel_view_releasebuffer;
+
   m.def("get_timestamp", &snakefish::get_timestamp);
   m.def("get_timestamp_serialized", &snakefish::get_timestamp_serialized);
 
+  m.def("select", &snakefish::select, py::arg("objs"),
+        py::arg("timeout") = -1.0);
+
   m.def("map", &snakefish::map, py::arg("f"), py::arg("args"),
-        py::arg("concurrency") = 0, py::arg("chunksize") = 0);
+        py::arg("concurrency") = 0, py::arg("chunksize") = 0,
+        py::arg("columnar") = false);
   m.def("map", &snakefish::map_merge, py::arg("f"), py::arg("args"),
         py::arg("extract"), py::arg("merge"), py::arg("concurrency") = 0,
-        py::arg("chunksize") = 0);
+        py::arg("chunksize") = 0, py::arg("columnar") = false);
 
   m.def("starmap", &snakefish::starmap, py::arg("f"), py::arg("args"),
-        py::arg("concurrency") = 0, py::arg("chunksize") = 0);
+        py::arg("concurrency") = 0, py::arg("chunksize") = 0,
+        py::arg("columnar") = false);
   m.def("starmap", &snakefish::starmap_merge, py::arg("f"), py::arg("args"),
         py::arg("extract"), py::arg("merge"), py::arg("concurrency") = 0,
-        py::arg("chunksize") = 0);
+        py::arg("chunksize") = 0, py::arg("columnar") = false);
 
   py::register_exception<std::runtime_error>(m, "RuntimeError");
 }
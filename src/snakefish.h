@@ -1,9 +1,19 @@
 #ifndef SNAKEFISH_H
 #define SNAKEFISH_H
 
+#include "atomic_array.h"
+#include "broadcast_channel.h"
 #include "channel.h"
 #include "generator.h"
 #include "misc.h"
+#include "mpmc_channel.h"
+#include "object_store.h"
+#include "pool.h"
+#include "shared_array.h"
+#include "shared_barrier.h"
+#include "shared_event.h"
+#include "shared_lock.h"
+#include "shared_map.h"
 #include "thread.h"
 
 #endif // SNAKEFISH_H
@@ -0,0 +1,81 @@
+#ifndef SNAKEFISH_ATOMIC_ARRAY_TESTS_H
+#define SNAKEFISH_ATOMIC_ARRAY_TESTS_H
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "atomic_array.h"
+using namespace snakefish;
+
+TEST(AtomicArrayTest, Ops) {
+  atomic_array<int64_t> ints = atomic_array<int64_t>(3);
+  ASSERT_EQ(ints.get_len(), 3);
+  ASSERT_EQ(ints.to_list(), std::vector<int64_t>({0, 0, 0}));
+
+  ints.store(5, 1);
+  ASSERT_EQ(ints.fetch_add(-2, 1), 5);
+  ASSERT_EQ(ints.load(1), 3);
+  ASSERT_FALSE(ints.compare_exchange(4, 10, 1));
+  ASSERT_TRUE(ints.compare_exchange(3, 10, 1));
+  ASSERT_EQ(ints.fetch_add(1), 0);
+  ASSERT_EQ(ints.to_list(), std::vector<int64_t>({1, 10, 0}));
+
+  try {
+    ints.load(3);
+    FAIL();
+  } catch (const std::out_of_range &e) {
+    ASSERT_EQ(std::string(e.what()), "index out of range");
+  }
+  try {
+    atomic_array<int64_t>(0);
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid array size");
+  }
+  ints.dispose();
+
+  atomic_array<double> floats = atomic_array<double>(1);
+  ASSERT_EQ(floats.fetch_add(1.5), 0.0);
+  ASSERT_EQ(floats.fetch_add(0.25), 1.5);
+  ASSERT_TRUE(floats.compare_exchange(1.75, -1.0));
+  ASSERT_EQ(floats.load(), -1.0);
+  floats.dispose();
+}
+
+TEST(AtomicArrayTest, Ipc) {
+  const size_t n_procs = 4;
+  const size_t n_iters = 10000;
+  atomic_array<int64_t> counts = atomic_array<int64_t>(2);
+  atomic_array<double> sum = atomic_array<double>(1);
+
+  // every process hits the same cells
+  pid_t pids[n_procs];
+  for (size_t p = 0; p < n_procs; p++) {
+    pids[p] = fork();
+    if (pids[p] == 0) {
+      for (size_t i = 0; i < n_iters; i++) {
+        counts.fetch_add(1, i % 2);
+        sum.fetch_add(0.5);
+      }
+      exit(0);
+    }
+  }
+  for (pid_t pid : pids) {
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+  }
+
+  ASSERT_EQ(counts.load(0), n_procs * n_iters / 2);
+  ASSERT_EQ(counts.load(1), n_procs * n_iters / 2);
+  ASSERT_EQ(sum.load(), n_procs * n_iters * 0.5);
+
+  counts.dispose();
+  sum.dispose();
+}
+
+#endif // SNAKEFISH_ATOMIC_ARRAY_TESTS_H
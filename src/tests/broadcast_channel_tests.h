@@ -0,0 +1,160 @@
+#ifndef SNAKEFISH_BROADCAST_CHANNEL_TESTS_H
+#define SNAKEFISH_BROADCAST_CHANNEL_TESTS_H
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <pybind11/embed.h>
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "broadcast_channel.h"
+#include "test_util.h"
+using namespace snakefish;
+
+class broadcast_channel_test : public broadcast_channel {
+public:
+  using broadcast_channel::capacity;
+  using broadcast_channel::cursors;
+  using broadcast_channel::header;
+  using broadcast_channel::broadcast_channel;
+};
+
+TEST(BroadcastChannelTest, ReadWrite) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  broadcast_channel_test channel = broadcast_channel_test(3, 1);
+  ASSERT_EQ(channel.capacity, page_size);
+
+  // go around the buffer a few times, so that messages wrap
+  size_t len = page_size / 3;
+  for (size_t i = 0; i < 10; i++) {
+    buffer bytes = get_random_bytes(len);
+    channel.send_bytes(bytes.get_ptr(), len);
+    for (size_t r = 0; r < 3; r++) {
+      ASSERT_EQ(channel.poll(r), true);
+      buffer read_bytes = channel.receive_bytes(r, false);
+      ASSERT_EQ(read_bytes.get_len(), len);
+      ASSERT_EQ(memcmp(bytes.get_ptr(), read_bytes.get_ptr(), len), 0);
+      ASSERT_EQ(channel.poll(r), false);
+    }
+  }
+  for (size_t r = 0; r < 3; r++)
+    ASSERT_EQ(channel.cursors[r].pos.load(), channel.header->write_pos.load());
+
+  try {
+    channel.receive_bytes(0, false);
+    FAIL();
+  } catch (const std::out_of_range &e) {
+    ASSERT_EQ(std::string(e.what()), "out-of-bounds read detected");
+  }
+  try {
+    channel.receive_bytes(3, false);
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid receiver index");
+  }
+
+  channel.dispose();
+}
+
+TEST(BroadcastChannelTest, SlowestReceiver) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  broadcast_channel_test channel = broadcast_channel_test(2, page_size);
+
+  // space is only reclaimed once both receivers are done with a message
+  buffer bytes = get_random_bytes(page_size);
+  size_t len = page_size / 2 - sizeof(size_t);
+  channel.send_bytes(bytes.get_ptr(), len);
+  channel.send_bytes(bytes.get_ptr(), len);
+  channel.receive_bytes(0, false);
+  try {
+    channel.send_bytes(bytes.get_ptr(), 1);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+
+  // times out when the slowest receiver doesn't move on
+  try {
+    channel.send_bytes(bytes.get_ptr(), 1, true, 0.01);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+
+  channel.receive_bytes(1, false);
+  channel.send_bytes(bytes.get_ptr(), 1);
+
+  // fails right away when the message can never fit
+  try {
+    channel.send_bytes(bytes.get_ptr(), page_size, true, -1);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+
+  channel.dispose();
+}
+
+TEST(BroadcastChannelTest, IpcOneToMany) {
+  const size_t n_receivers = 4;
+  const size_t n_msgs = 5000;
+  const size_t max_filler = 300;
+  size_t size_t_size = sizeof(size_t);
+
+  // a small buffer, so that the sender has to wait and messages wrap
+  broadcast_channel_test channel = broadcast_channel_test(n_receivers, 1);
+
+  // every receiver checks that it gets every message, in order
+  std::vector<pid_t> receivers;
+  for (size_t r = 0; r < n_receivers; r++) {
+    pid_t result = fork();
+    if (result == 0) {
+      for (size_t i = 0; i < n_msgs; i++) {
+        buffer msg = channel.receive_bytes(r, true);
+        const char *bytes = static_cast<const char *>(msg.get_ptr());
+        size_t seq = 0;
+        memcpy(&seq, bytes, size_t_size);
+        if (seq != i || msg.get_len() != size_t_size + i % max_filler)
+          std::exit(1);
+        for (size_t j = size_t_size; j < msg.get_len(); j++) {
+          if (bytes[j] != static_cast<char>(i))
+            std::exit(1);
+        }
+      }
+
+      std::exit(0);
+    } else if (result > 0) {
+      receivers.push_back(result);
+    } else {
+      perror("fork() failed");
+      abort();
+    }
+  }
+
+  char msg[sizeof(size_t) + max_filler];
+  for (size_t i = 0; i < n_msgs; i++) {
+    memcpy(msg, &i, size_t_size);
+    memset(msg + size_t_size, static_cast<char>(i), i % max_filler);
+    channel.send_bytes(msg, size_t_size + i % max_filler, true, -1);
+  }
+
+  for (pid_t pid : receivers) {
+    int status = 0;
+    if (waitpid(pid, &status, 0) == -1) {
+      perror("waitpid() failed");
+      abort();
+    } else {
+      ASSERT_EQ(WIFEXITED(status), 1);
+      ASSERT_EQ(WEXITSTATUS(status), 0);
+    }
+  }
+  for (size_t r = 0; r < n_receivers; r++)
+    ASSERT_EQ(channel.cursors[r].pos.load(), channel.header->write_pos.load());
+
+  // release resources
+  channel.dispose();
+}
+
+#endif // SNAKEFISH_BROADCAST_CHANNEL_TESTS_H
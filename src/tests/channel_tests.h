@@ -1,6 +1,9 @@
 #ifndef SNAKEFISH_CHANNEL_TESTS_H
 #define SNAKEFISH_CHANNEL_TESTS_H
 
+#include <poll.h>
+#include <sys/stat.h>
+
 #include <gtest/gtest.h>
 
 #include <pybind11/embed.h>
@@ -8,7 +11,9 @@
 namespace py = pybind11;
 
 #include "channel.h"
+#include "codec.h"
 #include "test_util.h"
+#include "util.h"
 using namespace snakefish;
 
 static const size_t TEST_CAPACITY = 1024;
@@ -16,12 +21,17 @@ static const size_t TEST_CAPACITY = 1024;
 class channel_test : public channel {
 public:
   using channel::shared_mem;
+  using channel::header;
   using channel::lock;
   using channel::start;
   using channel::end;
+  using channel::read;
+  using channel::n_pending;
   using channel::full;
   using channel::n_unread;
   using channel::capacity;
+  using channel::mirrored;
+  using channel::shared_fd;
   using channel::channel;
 };
 
@@ -55,6 +65,60 @@ TEST(ChannelTest, ReadWriteNoWrapping) {
   channel.dispose();
 }
 
+TEST(ChannelTest, ControlBlock) {
+  channel_test channel = channel_test(TEST_CAPACITY);
+
+  // senders and receivers write to different cache lines
+  auto line_of = [](const void *p) {
+    return reinterpret_cast<uintptr_t>(p) / CACHE_LINE_SIZE;
+  };
+  ASSERT_NE(line_of(channel.start), line_of(channel.end));
+  ASSERT_NE(line_of(channel.read), line_of(channel.end));
+  ASSERT_EQ(line_of(channel.start), line_of(channel.read));
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, Stats) {
+  channel_test channel = channel_test(TEST_CAPACITY);
+  channel_stats &stats = channel.header->stats;
+  size_t size_t_size = sizeof(size_t);
+  buffer bytes = get_random_bytes(TEST_CAPACITY);
+
+  // nothing is counted until statistics are enabled
+  channel.send_bytes(bytes.get_ptr(), 10);
+  channel.receive_bytes(false);
+  ASSERT_EQ(stats.msgs_sent.load(), 0);
+  ASSERT_EQ(stats.msgs_received.load(), 0);
+
+  channel.enable_stats();
+  channel.send_bytes(bytes.get_ptr(), 10);
+  channel.send_bytes(bytes.get_ptr(), 20);
+  ASSERT_EQ(stats.msgs_sent.load(), 2);
+  ASSERT_EQ(stats.bytes_sent.load(), 30);
+  ASSERT_EQ(stats.max_used.load(), 30 + 2 * size_t_size);
+
+  channel.receive_bytes(false);
+  ASSERT_EQ(stats.msgs_received.load(), 1);
+  ASSERT_EQ(stats.bytes_received.load(), 10);
+
+  try {
+    channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(stats.n_full.load(), 1);
+  }
+  ASSERT_EQ(stats.msgs_sent.load(), 2);
+
+  channel.reset_stats();
+  ASSERT_EQ(stats.msgs_sent.load(), 0);
+  ASSERT_EQ(stats.bytes_received.load(), 0);
+  ASSERT_EQ(stats.n_full.load(), 0);
+  ASSERT_EQ(stats.max_used.load(), 0);
+
+  channel.dispose();
+}
+
 TEST(ChannelTest, ReadWriteWithWrapping) {
   size_t capacity = TEST_CAPACITY + sizeof(size_t);
   channel_test channel = channel_test(capacity);
@@ -314,6 +378,916 @@ TEST(ChannelTest, IpcReadWrite) {
   }
 }
 
+TEST(ChannelTest, SpscReadWriteWithWrapping) {
+  size_t capacity = TEST_CAPACITY + 2 * sizeof(size_t);
+  channel_test channel = channel_test(capacity, channel_mode::SPSC);
+  ASSERT_EQ((channel.start)->load(), 0);
+  ASSERT_EQ((channel.end)->load(), 0);
+
+  buffer bytes = get_random_bytes(TEST_CAPACITY / 2);
+  buffer copy = duplicate_bytes(bytes.get_ptr(), TEST_CAPACITY / 2);
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 2);
+  ASSERT_EQ((channel.start)->load(), 0);
+  ASSERT_EQ((channel.end)->load(), capacity / 2);
+
+  buffer read_bytes = channel.receive_bytes(false);
+  ASSERT_EQ(read_bytes.get_len(), TEST_CAPACITY / 2);
+  ASSERT_EQ(memcmp(copy.get_ptr(), read_bytes.get_ptr(), TEST_CAPACITY / 2), 0);
+  ASSERT_EQ((channel.start)->load(), capacity / 2);
+  ASSERT_EQ((channel.end)->load(), capacity / 2);
+
+  // fill the buffer completely, wrapping around the end
+  buffer bytes2 = get_random_bytes(capacity - sizeof(size_t));
+  buffer copy2 = duplicate_bytes(bytes2.get_ptr(), capacity - sizeof(size_t));
+  channel.send_bytes(bytes2.get_ptr(), capacity - sizeof(size_t));
+  ASSERT_EQ((channel.start)->load(), capacity / 2);
+  ASSERT_EQ((channel.end)->load(), capacity / 2 + capacity);
+
+  try {
+    channel.send_bytes(bytes.get_ptr(), 1);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+
+  buffer read_bytes2 = channel.receive_bytes(true);
+  ASSERT_EQ(read_bytes2.get_len(), capacity - sizeof(size_t));
+  ASSERT_EQ(
+      memcmp(copy2.get_ptr(), read_bytes2.get_ptr(), capacity - sizeof(size_t)),
+      0);
+  ASSERT_EQ((channel.start)->load(), capacity / 2 + capacity);
+  ASSERT_EQ((channel.end)->load(), capacity / 2 + capacity);
+
+  try {
+    buffer read_bytes3 = channel.receive_bytes(false);
+    FAIL();
+  } catch (const std::out_of_range &e) {
+    ASSERT_EQ(std::string(e.what()), "out-of-bounds read detected");
+  }
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, SpscIpcReadWrite) {
+  const size_t n_msgs = 10000;
+  channel_test channel = channel_test(TEST_CAPACITY, channel_mode::SPSC);
+
+  pid_t result = fork();
+  if (result == 0) {
+    // child writes, retrying whenever the buffer is full
+    for (size_t i = 0; i < n_msgs; i++) {
+      while (true) {
+        try {
+          channel.send_bytes(&i, sizeof(size_t));
+          break;
+        } catch (const std::overflow_error &e) {
+          sched_yield();
+        }
+      }
+    }
+
+    std::exit(0);
+  } else if (result > 0) {
+    // parent reads concurrently
+    for (size_t i = 0; i < n_msgs; i++) {
+      buffer read_bytes = channel.receive_bytes(true);
+      ASSERT_EQ(read_bytes.get_len(), sizeof(size_t));
+      ASSERT_EQ(*static_cast<size_t *>(read_bytes.get_ptr()), i);
+    }
+
+    // check child status
+    int status = 0;
+    if (waitpid(result, &status, 0) == -1) {
+      perror("waitpid() failed");
+      abort();
+    } else {
+      ASSERT_EQ(WIFEXITED(status), 1);
+      ASSERT_EQ(WEXITSTATUS(status), 0);
+    }
+    ASSERT_EQ((channel.start)->load(), (channel.end)->load());
+
+    // release resources
+    channel.dispose();
+  } else {
+    perror("fork() failed");
+    abort();
+  }
+}
+
+TEST(ChannelTest, BlockingSend) {
+  size_t capacity = TEST_CAPACITY + sizeof(size_t);
+  channel_test channel = channel_test(capacity);
+
+  buffer bytes = get_random_bytes(TEST_CAPACITY);
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY, true, 0.01);
+
+  // times out when nothing is received
+  try {
+    channel.send_bytes(bytes.get_ptr(), 1, true, 0.01);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+
+  // fails right away when the message can never fit
+  channel.receive_bytes(false);
+  try {
+    channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY + 1, true, -1);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+  ASSERT_EQ((channel.start)->load(), (channel.end)->load());
+  ASSERT_EQ((channel.full)->load(), false);
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, IpcBlockingSend) {
+  const size_t n_msgs = 10000;
+  channel_mode modes[] = {channel_mode::LOCKED, channel_mode::SPSC};
+
+  for (channel_mode mode : modes) {
+    channel_test channel = channel_test(TEST_CAPACITY, mode);
+
+    pid_t result = fork();
+    if (result == 0) {
+      // child writes, waiting whenever the buffer is full
+      for (size_t i = 0; i < n_msgs; i++)
+        channel.send_bytes(&i, sizeof(size_t), true, -1);
+
+      std::exit(0);
+    } else if (result > 0) {
+      // parent reads concurrently
+      for (size_t i = 0; i < n_msgs; i++) {
+        buffer read_bytes = channel.receive_bytes(true);
+        ASSERT_EQ(read_bytes.get_len(), sizeof(size_t));
+        ASSERT_EQ(*static_cast<size_t *>(read_bytes.get_ptr()), i);
+      }
+
+      // check child status
+      int status = 0;
+      if (waitpid(result, &status, 0) == -1) {
+        perror("waitpid() failed");
+        abort();
+      } else {
+        ASSERT_EQ(WIFEXITED(status), 1);
+        ASSERT_EQ(WEXITSTATUS(status), 0);
+      }
+      ASSERT_EQ((channel.start)->load(), (channel.end)->load());
+
+      // release resources
+      channel.dispose();
+    } else {
+      perror("fork() failed");
+      abort();
+    }
+  }
+}
+
+TEST(ChannelTest, IpcNotify) {
+  channel_mode modes[] = {channel_mode::LOCKED, channel_mode::SPSC};
+
+  for (channel_mode mode : modes) {
+    channel_test channel = channel_test(TEST_CAPACITY, mode);
+    notifier &ready = channel.get_notifier();
+    ready.subscribe();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    ASSERT_EQ(channel.poll(), false);
+
+    pid_t result = fork();
+    if (result == 0) {
+      // child writes after a while
+      usleep(10000);
+      size_t n = 42;
+      channel.send_bytes(&n, sizeof(size_t));
+
+      std::exit(0);
+    } else if (result > 0) {
+      // parent sleeps until notified
+      struct pollfd fd = {ready.get_fd(), POLLIN, 0};
+      ASSERT_EQ(poll(&fd, 1, 5000), 1);
+      ready.unsubscribe();
+      ready.drain();
+      ASSERT_EQ(channel.poll(), true);
+
+      buffer read_bytes = channel.receive_bytes(false);
+      ASSERT_EQ(*static_cast<size_t *>(read_bytes.get_ptr()), 42);
+      ASSERT_EQ(channel.poll(), false);
+
+      // check child status
+      int status = 0;
+      if (waitpid(result, &status, 0) == -1) {
+        perror("waitpid() failed");
+        abort();
+      } else {
+        ASSERT_EQ(WIFEXITED(status), 1);
+        ASSERT_EQ(WEXITSTATUS(status), 0);
+      }
+
+      // nothing is signalled without subscribers
+      channel.send_bytes(&status, sizeof(int));
+      ASSERT_EQ(poll(&fd, 1, 0), 0);
+      ASSERT_EQ(channel.poll(), true);
+
+      // release resources
+      channel.dispose();
+    } else {
+      perror("fork() failed");
+      abort();
+    }
+  }
+}
+
+TEST(ChannelTest, IpcSpinPingPong) {
+  const size_t n_msgs = 10000;
+  channel_mode modes[] = {channel_mode::LOCKED, channel_mode::SPSC};
+
+  for (channel_mode mode : modes) {
+    channel_test ping = channel_test(TEST_CAPACITY, mode);
+    channel_test pong = channel_test(TEST_CAPACITY, mode);
+    ping.set_spin(1000);
+    pong.set_spin(1000);
+
+    pid_t result = fork();
+    if (result == 0) {
+      // child echoes
+      for (size_t i = 0; i < n_msgs; i++) {
+        buffer read_bytes = ping.receive_bytes(true);
+        pong.send_bytes(read_bytes.get_ptr(), read_bytes.get_len(), true, -1);
+      }
+
+      std::exit(0);
+    } else if (result > 0) {
+      // parent waits for each echo before sending the next message
+      for (size_t i = 0; i < n_msgs; i++) {
+        ping.send_bytes(&i, sizeof(size_t), true, -1);
+        buffer read_bytes = pong.receive_bytes(true);
+        ASSERT_EQ(read_bytes.get_len(), sizeof(size_t));
+        ASSERT_EQ(*static_cast<size_t *>(read_bytes.get_ptr()), i);
+      }
+
+      // check child status
+      int status = 0;
+      if (waitpid(result, &status, 0) == -1) {
+        perror("waitpid() failed");
+        abort();
+      } else {
+        ASSERT_EQ(WIFEXITED(status), 1);
+        ASSERT_EQ(WEXITSTATUS(status), 0);
+      }
+
+      // release resources
+      ping.dispose();
+      pong.dispose();
+    } else {
+      perror("fork() failed");
+      abort();
+    }
+  }
+}
+
+TEST(ChannelTest, Grow) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t size_t_size = sizeof(size_t);
+  channel_test channel = channel_test(64, 4 * page_size, channel_mode::LOCKED);
+
+  buffer bytes = get_random_bytes(page_size);
+  buffer copy = duplicate_bytes(bytes.get_ptr(), page_size);
+
+  // the buffer can't grow while a view refers to the part of the data that
+  // wraps around
+  channel.send_bytes(bytes.get_ptr(), 24);
+  channel.receive_bytes(false);
+  channel.send_bytes(bytes.get_ptr(), 24);
+  channel.send_bytes(bytes.get_ptr(), 8);
+  ASSERT_EQ((channel.end)->load(), 16);
+  channel_view view1 = channel.receive_view(false);
+  channel_view view2 = channel.receive_view(false);
+  try {
+    channel.send_bytes(bytes.get_ptr(), 30);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+  ASSERT_EQ(channel.capacity, 64);
+  view1.release();
+  view2.release();
+  ASSERT_EQ((channel.start)->load(), 16);
+
+  // otherwise, the wrapped part is moved to the end of the old buffer, and
+  // the buffer grows in whole pages
+  channel.send_bytes(bytes.get_ptr(), 16);
+  channel.receive_bytes(false);
+  channel.send_bytes(bytes.get_ptr(), 40);
+  ASSERT_EQ((channel.end)->load(), 24);
+  channel.send_bytes(bytes.get_ptr(), 30);
+  ASSERT_EQ(channel.capacity, page_size);
+  ASSERT_EQ((channel.start)->load(), 40);
+  ASSERT_EQ((channel.end)->load(), 88 + 30 + size_t_size);
+  buffer read_bytes = channel.receive_bytes(false);
+  ASSERT_EQ(memcmp(copy.get_ptr(), read_bytes.get_ptr(), 40), 0);
+  buffer read_bytes2 = channel.receive_bytes(false);
+  ASSERT_EQ(memcmp(copy.get_ptr(), read_bytes2.get_ptr(), 30), 0);
+
+  // the same goes for a message that is being written
+  size_t head = page_size - 40;
+  channel.send_bytes(bytes.get_ptr(), head - 126 - size_t_size);
+  channel.receive_bytes(false);
+  channel.send_bytes(bytes.get_ptr(), 100);
+  ASSERT_EQ((channel.end)->load(), 100 + size_t_size - 40);
+  channel.reserve(0);
+  channel.write(bytes.get_ptr(), 100);
+  channel.write(bytes.get_ptr(), page_size);
+  channel.commit();
+  ASSERT_EQ(channel.capacity, 2 * page_size);
+  ASSERT_EQ((channel.start)->load(), head);
+  ASSERT_EQ((channel.end)->load(),
+            head + 2 * (100 + size_t_size) + page_size - 2 * page_size);
+  buffer read_bytes3 = channel.receive_bytes(false);
+  ASSERT_EQ(memcmp(copy.get_ptr(), read_bytes3.get_ptr(), 100), 0);
+  buffer read_bytes4 = channel.receive_bytes(false);
+  ASSERT_EQ(read_bytes4.get_len(), 100 + page_size);
+  ASSERT_EQ(memcmp(copy.get_ptr(), read_bytes4.get_ptr(), 100), 0);
+  ASSERT_EQ(memcmp(copy.get_ptr(),
+                   static_cast<char *>(read_bytes4.get_ptr()) + 100,
+                   page_size),
+            0);
+
+  // but not beyond the maximum size
+  buffer large_bytes = get_random_bytes(4 * page_size);
+  try {
+    channel.send_bytes(large_bytes.get_ptr(), 4 * page_size);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, SpscGrowWrapped) {
+  size_t size_t_size = sizeof(size_t);
+  channel_test channel = channel_test(channel_mode::SPSC);
+
+  // leave start near the end of the buffer
+  buffer bytes = get_random_bytes(64 * 1024);
+  buffer copy = duplicate_bytes(bytes.get_ptr(), 64 * 1024);
+  channel.send_bytes(bytes.get_ptr(), 60 * 1024);
+  channel.receive_bytes(false);
+
+  // the message being written wraps around, but it's all there is in the
+  // buffer, so it moves to the start of the grown buffer
+  channel.reserve(0);
+  channel.write(bytes.get_ptr(), 10 * 1024);
+  channel.write(bytes.get_ptr(), 64 * 1024);
+  channel.commit();
+  ASSERT_EQ(channel.capacity, 2 * DEFAULT_INITIAL_CHANNEL_SIZE);
+  ASSERT_EQ((channel.end)->load(),
+            60 * 1024 + 74 * 1024 + 2 * size_t_size);
+  buffer read_bytes = channel.receive_bytes(false);
+  ASSERT_EQ(read_bytes.get_len(), 74 * 1024);
+  ASSERT_EQ(memcmp(copy.get_ptr(), read_bytes.get_ptr(), 10 * 1024), 0);
+  ASSERT_EQ(memcmp(copy.get_ptr(),
+                   static_cast<char *>(read_bytes.get_ptr()) + 10 * 1024,
+                   64 * 1024),
+            0);
+
+  // published data that wraps around still can't move
+  buffer large_bytes = get_random_bytes(2 * DEFAULT_INITIAL_CHANNEL_SIZE);
+  channel.send_bytes(bytes.get_ptr(), 60 * 1024);
+  try {
+    channel.send_bytes(large_bytes.get_ptr(), 2 * DEFAULT_INITIAL_CHANNEL_SIZE);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+  ASSERT_EQ(channel.capacity, 2 * DEFAULT_INITIAL_CHANNEL_SIZE);
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, GrowDefaultObj) {
+  channel_test channel;
+  size_t capacity = channel.capacity;
+
+  // wrap the data around, then send more than the initial size
+  py::object b1 = py::eval("b'x' * 30000");
+  channel.send_pyobj(b1);
+  channel.receive_pyobj(false);
+  channel.send_pyobj(b1);
+  channel.receive_pyobj(false);
+  for (int i = 0; i < 4; i++)
+    channel.send_pyobj(b1, false);
+  ASSERT_GT(channel.capacity, capacity);
+  for (int i = 0; i < 4; i++)
+    ASSERT_TRUE(channel.receive_pyobj(false).equal(b1));
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, PagePolicy) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  channel_mode modes[] = {channel_mode::LOCKED, channel_mode::SPSC};
+
+  // leave room to grow on huge pages too
+  size_t max_size = std::max(64 * page_size, 2 * util::get_huge_page_size());
+
+  for (channel_mode mode : modes) {
+    channel_test channel = channel_test(page_size, max_size, mode);
+    ASSERT_EQ(channel.set_page_policy(page_policy::TRANSPARENT_HUGE_PAGES,
+                                      true),
+              page_policy::TRANSPARENT_HUGE_PAGES);
+
+    // the huge page pool may well be empty, so either outcome is fine
+    page_policy policy = channel.set_page_policy(page_policy::HUGETLB_PAGES);
+    ASSERT_NE(policy, page_policy::DEFAULT_PAGES);
+    ASSERT_EQ(channel.mirrored, true);
+    if (policy == page_policy::HUGETLB_PAGES) {
+      ASSERT_EQ(channel.capacity % util::get_huge_page_size(), 0);
+      ASSERT_EQ(channel.set_page_policy(page_policy::DEFAULT_PAGES),
+                page_policy::HUGETLB_PAGES);
+    }
+
+    // the buffer still grows, and messages still wrap around
+    size_t capacity = channel.capacity;
+    buffer bytes = get_random_bytes(capacity);
+    for (size_t i = 0; i < 3; i++)
+      channel.send_bytes(bytes.get_ptr(), capacity / 2);
+    ASSERT_GT(channel.capacity, capacity);
+    for (size_t i = 0; i < 3; i++) {
+      buffer read_bytes = channel.receive_bytes(false);
+      ASSERT_EQ(read_bytes.get_len(), capacity / 2);
+      ASSERT_EQ(memcmp(bytes.get_ptr(), read_bytes.get_ptr(), capacity / 2),
+                0);
+    }
+    for (size_t i = 0; i < 10; i++) {
+      channel.send_bytes(bytes.get_ptr(), capacity / 2);
+      buffer read_bytes = channel.receive_bytes(false);
+      ASSERT_EQ(memcmp(bytes.get_ptr(), read_bytes.get_ptr(), capacity / 2),
+                0);
+    }
+
+    // the buffer can't move once it's in use
+    channel.send_bytes(bytes.get_ptr(), 1);
+    if (policy != page_policy::HUGETLB_PAGES) {
+      try {
+        channel.set_page_policy(page_policy::HUGETLB_PAGES);
+        FAIL();
+      } catch (const std::runtime_error &e) {
+        ASSERT_EQ(std::string(e.what()), "channel is in use");
+      }
+    }
+
+    channel.dispose();
+  }
+}
+
+/**
+ * \brief Get the number of bytes of memory backing the buffer of `channel`.
+ */
+static size_t get_resident_size(const channel_test &channel) {
+  struct stat st;
+  if (fstat(channel.shared_fd, &st)) {
+    perror("fstat() failed");
+    abort();
+  }
+  return st.st_blocks * 512;
+}
+
+TEST(ChannelTest, TrimConsumedSpace) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t threshold = 8 * page_size;
+  channel_mode modes[] = {channel_mode::LOCKED, channel_mode::SPSC};
+
+  for (channel_mode mode : modes) {
+    channel_test channel = channel_test(64 * page_size, mode);
+    channel.set_trim_threshold(threshold);
+    buffer bytes = get_random_bytes(32 * page_size);
+
+    // small messages are left alone until the threshold is reached
+    channel.send_bytes(bytes.get_ptr(), page_size);
+    channel.receive_bytes(false);
+    size_t resident = get_resident_size(channel);
+    ASSERT_GE(resident, page_size);
+
+    // a large message is handed back as soon as it's consumed
+    channel.send_bytes(bytes.get_ptr(), 32 * page_size);
+    ASSERT_GE(get_resident_size(channel), 32 * page_size);
+    buffer read_bytes = channel.receive_bytes(false);
+    ASSERT_EQ(memcmp(bytes.get_ptr(), read_bytes.get_ptr(), 32 * page_size),
+              0);
+    ASSERT_LE(get_resident_size(channel), resident + 2 * page_size);
+
+    // so are many small ones, once enough of them have been consumed
+    for (size_t i = 0; i < 32; i++)
+      channel.send_bytes(bytes.get_ptr(), page_size);
+    for (size_t i = 0; i < 32; i++) {
+      buffer read_bytes = channel.receive_bytes(false);
+      ASSERT_EQ(memcmp(bytes.get_ptr(), read_bytes.get_ptr(), page_size), 0);
+    }
+    channel.send_bytes(bytes.get_ptr(), 1);
+    channel.receive_bytes(false);
+    ASSERT_LT(get_resident_size(channel), 16 * page_size);
+
+    // released space can be reused
+    for (size_t i = 0; i < 8; i++) {
+      channel.send_bytes(bytes.get_ptr(), 20 * page_size);
+      buffer read_bytes = channel.receive_bytes(false);
+      ASSERT_EQ(memcmp(bytes.get_ptr(), read_bytes.get_ptr(), 20 * page_size),
+                0);
+    }
+
+    channel.dispose();
+  }
+}
+
+TEST(ChannelTest, NumaNode) {
+  ASSERT_EQ(util::parse_id_list("0-3,8,10-11"),
+            std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  ASSERT_EQ(util::parse_id_list(""), std::vector<int>());
+
+  // this works on single-node systems too, where nothing is bound
+  int n_nodes = util::get_numa_nodes().size();
+  channel_test channel = channel_test(4096, 64 * 4096, channel_mode::SPSC);
+  int node = channel.set_numa_node();
+  ASSERT_GE(node, 0);
+  ASSERT_LT(node, n_nodes);
+  ASSERT_EQ(channel.set_numa_node(n_nodes - 1), n_nodes - 1);
+  try {
+    channel.set_numa_node(n_nodes);
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid NUMA node");
+  }
+
+  // the buffer still works as it grows
+  buffer bytes = get_random_bytes(16 * 4096);
+  channel.send_bytes(bytes.get_ptr(), 16 * 4096);
+  buffer read_bytes = channel.receive_bytes(false);
+  ASSERT_EQ(memcmp(bytes.get_ptr(), read_bytes.get_ptr(), 16 * 4096), 0);
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, IpcGrow) {
+  const size_t n_msgs = 1000;
+  const size_t max_len = 3000;
+  channel_mode modes[] = {channel_mode::LOCKED, channel_mode::SPSC};
+
+  for (channel_mode mode : modes) {
+    channel_test channel = channel_test(64, 1024 * 1024, mode);
+
+    pid_t result = fork();
+    if (result == 0) {
+      // child writes messages of varying sizes
+      std::vector<unsigned char> msg(max_len);
+      for (size_t i = 0; i < n_msgs; i++) {
+        size_t len = i * 7 % max_len + 1;
+        memset(msg.data(), static_cast<int>(i), len);
+        channel.send_bytes(msg.data(), len, true, -1);
+      }
+
+      std::exit(0);
+    } else if (result > 0) {
+      // parent reads concurrently, picking up the new sizes
+      for (size_t i = 0; i < n_msgs; i++) {
+        buffer read_bytes = channel.receive_bytes(true);
+        size_t len = i * 7 % max_len + 1;
+        ASSERT_EQ(read_bytes.get_len(), len);
+        std::vector<unsigned char> expected(len, static_cast<unsigned char>(i));
+        ASSERT_EQ(memcmp(expected.data(), read_bytes.get_ptr(), len), 0);
+      }
+
+      // check child status
+      int status = 0;
+      if (waitpid(result, &status, 0) == -1) {
+        perror("waitpid() failed");
+        abort();
+      } else {
+        ASSERT_EQ(WIFEXITED(status), 1);
+        ASSERT_EQ(WEXITSTATUS(status), 0);
+      }
+      ASSERT_GT(channel.capacity, 64);
+
+      // release resources
+      channel.dispose();
+    } else {
+      perror("fork() failed");
+      abort();
+    }
+  }
+}
+
+TEST(ChannelTest, ReserveCommit) {
+  size_t capacity = TEST_CAPACITY + sizeof(size_t);
+  channel_test channel = channel_test(capacity);
+
+  buffer bytes = get_random_bytes(TEST_CAPACITY);
+  buffer copy = duplicate_bytes(bytes.get_ptr(), TEST_CAPACITY);
+
+  // cancelled messages leave no trace
+  channel.reserve(TEST_CAPACITY / 2);
+  channel.write(bytes.get_ptr(), TEST_CAPACITY / 2);
+  channel.cancel();
+  ASSERT_EQ((channel.end)->load(), 0);
+  ASSERT_EQ(channel.n_unread.trywait(), false);
+
+  // the reservation grows as bytes are written
+  channel.reserve(0);
+  channel.write(bytes.get_ptr(), TEST_CAPACITY / 2);
+  channel.write(static_cast<char *>(bytes.get_ptr()) + TEST_CAPACITY / 2,
+                TEST_CAPACITY / 2);
+  try {
+    channel.write(bytes.get_ptr(), 1);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+  ASSERT_EQ((channel.end)->load(), 0);
+  channel.commit();
+  ASSERT_EQ((channel.end)->load(), 0);
+  ASSERT_EQ((channel.full)->load(), true);
+
+  buffer read_bytes = channel.receive_bytes(false);
+  ASSERT_EQ(read_bytes.get_len(), TEST_CAPACITY);
+  ASSERT_EQ(memcmp(copy.get_ptr(), read_bytes.get_ptr(), TEST_CAPACITY), 0);
+
+  // only one message can be written at a time
+  channel.reserve(0);
+  try {
+    channel.reserve(0);
+    FAIL();
+  } catch (const std::runtime_error &e) {
+    ASSERT_EQ(std::string(e.what()), "a message is already being written");
+  }
+  channel.cancel();
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, SendReceiveMany) {
+  size_t msg_len = TEST_CAPACITY / 4;
+  size_t capacity = TEST_CAPACITY + 4 * sizeof(size_t);
+  channel_test channel = channel_test(capacity);
+
+  buffer bytes = get_random_bytes(TEST_CAPACITY);
+  buffer copy = duplicate_bytes(bytes.get_ptr(), TEST_CAPACITY);
+  struct iovec msgs[5];
+  for (size_t i = 0; i < 5; i++) {
+    msgs[i].iov_base = static_cast<char *>(bytes.get_ptr()) + i % 4 * msg_len;
+    msgs[i].iov_len = msg_len;
+  }
+
+  // batches are all-or-nothing
+  try {
+    channel.send_bytes_many(msgs, 5);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+  ASSERT_EQ((channel.end)->load(), 0);
+  ASSERT_EQ(channel.n_unread.trywait(), false);
+
+  channel.send_bytes_many(msgs, 4);
+  ASSERT_EQ((channel.end)->load(), 0);
+  ASSERT_EQ((channel.full)->load(), true);
+
+  std::vector<buffer> read_bytes = channel.receive_bytes_many(3, false);
+  ASSERT_EQ(read_bytes.size(), 3);
+  for (size_t i = 0; i < 3; i++) {
+    ASSERT_EQ(read_bytes[i].get_len(), msg_len);
+    ASSERT_EQ(memcmp(static_cast<char *>(copy.get_ptr()) + i * msg_len,
+                     read_bytes[i].get_ptr(), msg_len),
+              0);
+  }
+  ASSERT_EQ((channel.start)->load(), 3 * (msg_len + sizeof(size_t)));
+  ASSERT_EQ((channel.full)->load(), false);
+
+  read_bytes = channel.receive_bytes_many(10, false);
+  ASSERT_EQ(read_bytes.size(), 1);
+  ASSERT_EQ(memcmp(static_cast<char *>(copy.get_ptr()) + 3 * msg_len,
+                   read_bytes[0].get_ptr(), msg_len),
+            0);
+  ASSERT_EQ((channel.start)->load(), 0);
+
+  try {
+    channel.receive_bytes_many(10, false);
+    FAIL();
+  } catch (const std::out_of_range &e) {
+    ASSERT_EQ(std::string(e.what()), "out-of-bounds read detected");
+  }
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, SpscSendReceiveMany) {
+  size_t msg_len = TEST_CAPACITY / 4;
+  channel_test channel = channel_test(TEST_CAPACITY, channel_mode::SPSC);
+
+  buffer bytes = get_random_bytes(msg_len);
+  buffer copy = duplicate_bytes(bytes.get_ptr(), msg_len);
+  struct iovec msgs[3];
+  for (size_t i = 0; i < 3; i++)
+    msgs[i] = {bytes.get_ptr(), msg_len};
+
+  // the second batch wraps around
+  for (size_t round = 0; round < 2; round++) {
+    channel.send_bytes_many(msgs, 3);
+    ASSERT_EQ(channel.n_unread.trywait(), false);
+
+    std::vector<buffer> read_bytes = channel.receive_bytes_many(10, false);
+    ASSERT_EQ(read_bytes.size(), 3);
+    for (size_t i = 0; i < 3; i++)
+      ASSERT_EQ(memcmp(copy.get_ptr(), read_bytes[i].get_ptr(), msg_len), 0);
+    ASSERT_EQ((channel.start)->load(),
+              (round + 1) * 3 * (msg_len + sizeof(size_t)));
+  }
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, ReceiveView) {
+  size_t capacity = TEST_CAPACITY + 2 * sizeof(size_t);
+  channel_test channel = channel_test(capacity);
+
+  buffer bytes = get_random_bytes(TEST_CAPACITY / 4);
+  buffer copy = duplicate_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  size_t msg_size = TEST_CAPACITY / 4 + sizeof(size_t);
+
+  // the views point into the shared buffer
+  channel_view view1 = channel.receive_view(true);
+  channel_view view2 = channel.receive_view(true);
+  ASSERT_EQ(view1.get_len(), TEST_CAPACITY / 4);
+  ASSERT_EQ(view1.get_ptr(),
+            static_cast<char *>(channel.shared_mem) + sizeof(size_t));
+  ASSERT_EQ(memcmp(copy.get_ptr(), view1.get_ptr(), TEST_CAPACITY / 4), 0);
+  ASSERT_EQ(memcmp(copy.get_ptr(), view2.get_ptr(), TEST_CAPACITY / 4), 0);
+  ASSERT_EQ((channel.start)->load(), 0);
+  ASSERT_EQ((channel.read)->load(), 2 * msg_size);
+  ASSERT_EQ((channel.n_pending)->load(), 2);
+
+  // space is reclaimed in order
+  view2.release();
+  ASSERT_EQ((channel.start)->load(), 0);
+  ASSERT_EQ((channel.n_pending)->load(), 2);
+  view1.release();
+  ASSERT_EQ((channel.start)->load(), 2 * msg_size);
+  ASSERT_EQ((channel.n_pending)->load(), 0);
+
+  // a copying receive doesn't skip an unreleased view
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  channel.send_bytes(bytes.get_ptr(), TEST_CAPACITY / 4);
+  channel_view view3 = channel.receive_view(true);
+  buffer read_bytes = channel.receive_bytes(true);
+  ASSERT_EQ(memcmp(copy.get_ptr(), read_bytes.get_ptr(), TEST_CAPACITY / 4),
+            0);
+  ASSERT_EQ((channel.start)->load(), 2 * msg_size);
+  view3.release();
+  ASSERT_EQ((channel.start)->load(), (4 * msg_size) % capacity);
+  ASSERT_EQ((channel.end)->load(), (4 * msg_size) % capacity);
+  ASSERT_EQ((channel.full)->load(), false);
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, MirroredReceiveView) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  channel_test channel = channel_test(page_size);
+  ASSERT_EQ(channel.mirrored, true);
+
+  size_t len = page_size * 3 / 4;
+  buffer bytes = get_random_bytes(len);
+  buffer copy = duplicate_bytes(bytes.get_ptr(), len);
+  channel.send_bytes(bytes.get_ptr(), len);
+  channel.receive_bytes(false);
+
+  // the second message wraps around, but is still viewed in place
+  channel.send_bytes(bytes.get_ptr(), len);
+  ASSERT_EQ((channel.end)->load(), 2 * (len + sizeof(size_t)) - page_size);
+  channel_view view = channel.receive_view(false);
+  ASSERT_EQ(view.get_ptr(), static_cast<char *>(channel.shared_mem) + len +
+                                2 * sizeof(size_t));
+  ASSERT_EQ(view.get_len(), len);
+  ASSERT_EQ(memcmp(copy.get_ptr(), view.get_ptr(), len), 0);
+  view.release();
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, SpscReceiveViewWithWrapping) {
+  size_t capacity = TEST_CAPACITY + 2 * sizeof(size_t);
+  size_t size_t_size = sizeof(size_t);
+  channel_test channel = channel_test(capacity, channel_mode::SPSC);
+
+  buffer bytes = get_random_bytes(600);
+  buffer copy = duplicate_bytes(bytes.get_ptr(), 600);
+  channel.send_bytes(bytes.get_ptr(), 300);
+  buffer read_bytes = channel.receive_bytes(true);
+  ASSERT_EQ((channel.start)->load(), 300 + size_t_size);
+
+  // the first message is viewed in place, the second one wraps around so it
+  // is copied out
+  channel.send_bytes(bytes.get_ptr(), 600);
+  channel.send_bytes(bytes.get_ptr(), 300);
+  channel_view view1 = channel.receive_view(true);
+  channel_view view2 = channel.receive_view(true);
+  ASSERT_EQ(view1.get_ptr(),
+            static_cast<char *>(channel.shared_mem) + 300 + 2 * size_t_size);
+  ASSERT_EQ(memcmp(copy.get_ptr(), view1.get_ptr(), 600), 0);
+  ASSERT_EQ(memcmp(copy.get_ptr(), view2.get_ptr(), 300), 0);
+  ASSERT_EQ((channel.start)->load(), 300 + size_t_size);
+  ASSERT_EQ((channel.read)->load(), 1200 + 3 * size_t_size);
+
+  // the space can't be reused until the first view is released
+  try {
+    channel.send_bytes(bytes.get_ptr(), 200);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+  view1.release();
+  ASSERT_EQ((channel.start)->load(), 1200 + 3 * size_t_size);
+  channel.send_bytes(bytes.get_ptr(), 200);
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, DisposeBeforeView) {
+  channel_test channel = channel_test(TEST_CAPACITY);
+  buffer bytes = get_random_bytes(100);
+  buffer copy = duplicate_bytes(bytes.get_ptr(), 100);
+  channel.send_bytes(bytes.get_ptr(), 100);
+  channel_view view = channel.receive_view(false);
+
+  // a view can't be released while buffers exported from it are alive
+  view.add_export();
+  try {
+    view.release();
+    FAIL();
+  } catch (const py::buffer_error &e) {
+    ASSERT_EQ(std::string(e.what()), "the view has exported buffers");
+  }
+  view.remove_export();
+
+  // the memory stays mapped until the view is released
+  channel.dispose();
+  ASSERT_EQ(memcmp(copy.get_ptr(), view.get_ptr(), 100), 0);
+  view.release();
+}
+
+TEST(ChannelTest, ViewExportsObj) {
+  channel_test channel = channel_test(TEST_CAPACITY);
+  buffer bytes = get_random_bytes(100);
+  channel.send_bytes(bytes.get_ptr(), 100);
+
+  py::object view = py::cast(channel.receive_view(false));
+  py::object mem_view =
+      py::module::import("builtins").attr("memoryview")(view);
+  ASSERT_EQ(len(mem_view), 100);
+  try {
+    view.attr("release")();
+    FAIL();
+  } catch (py::error_already_set &e) {
+    ASSERT_TRUE(e.matches(PyExc_BufferError));
+  }
+  mem_view.attr("release")();
+  view.attr("release")();
+  ASSERT_EQ((channel.start)->load(), (channel.end)->load());
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, PickleOutsideLockObj) {
+  channel_test channel;
+
+  // pickling the object sends another message, which would deadlock if the
+  // lock were held while pickling
+  py::exec("class Nested:\n"
+           "    def __reduce__(self):\n"
+           "        nested_send('inner')\n"
+           "        return (str, ('outer',))\n",
+           py::globals());
+  py::globals()["nested_send"] = py::cpp_function(
+      [&channel](const py::object &obj) { channel.send_pyobj(obj); });
+  py::object nested = py::globals()["Nested"]();
+  channel.send_pyobj(nested);
+  ASSERT_TRUE(channel.receive_pyobj(false).equal(py::str("inner")));
+  ASSERT_TRUE(channel.receive_pyobj(false).equal(py::str("outer")));
+
+  py::list objs;
+  objs.append(nested);
+  objs.append(py::bytes(std::string(OOB_BUFFER_THRESHOLD, 'x')));
+  channel.send_many(objs);
+  ASSERT_TRUE(channel.receive_pyobj(false).equal(py::str("inner")));
+  ASSERT_TRUE(channel.receive_pyobj(false).equal(py::str("outer")));
+  ASSERT_TRUE(channel.receive_pyobj(false).equal(objs[1]));
+
+  channel.dispose();
+}
+
 TEST(ChannelTest, TransferSmallObj) {
   channel_test channel;
 
@@ -325,6 +1299,34 @@ TEST(ChannelTest, TransferSmallObj) {
   channel.dispose();
 }
 
+TEST(ChannelTest, TransferEncodedObj) {
+  channel_test channel;
+
+  // common types are encoded without pickle
+  py::object o1 = py::eval("(None, True, -42, 1.5, b'abc', 'h\\u00e9', ())");
+  channel.send_pyobj(o1);
+  buffer raw = channel.receive_bytes(true);
+  ASSERT_EQ(static_cast<const char *>(raw.get_ptr())[0], codec::TAG_TUPLE);
+  channel.send_pyobj(o1);
+  py::object o2 = channel.receive_pyobj(true);
+  ASSERT_EQ(o2.equal(o1), true);
+
+  // everything else falls back to pickle
+  const char *pickled[] = {"2 ** 70", "(1, [2])", "'\\ud800'"};
+  for (const char *expr : pickled) {
+    py::object p1 = py::eval(expr);
+    channel.send_pyobj(p1);
+    buffer raw_pickled = channel.receive_bytes(true);
+    ASSERT_EQ(static_cast<const unsigned char *>(raw_pickled.get_ptr())[0],
+              codec::PICKLE_PROTO);
+    channel.send_pyobj(p1);
+    py::object p2 = channel.receive_pyobj(true);
+    ASSERT_EQ(p2.equal(p1), true);
+  }
+
+  channel.dispose();
+}
+
 TEST(ChannelTest, TransferLargeObj) {
   channel_test channel;
 
@@ -337,6 +1339,53 @@ TEST(ChannelTest, TransferLargeObj) {
   channel.dispose();
 }
 
+TEST(ChannelTest, OverflowObj) {
+  channel_test channel = channel_test(TEST_CAPACITY);
+
+  // the overflow happens while pickling, and is still reported as such
+  try {
+    channel.send_pyobj(py::eval("list(range(1000))"), false);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+  ASSERT_EQ((channel.end)->load(), 0);
+
+  channel.send_pyobj(py::eval("list(range(10))"), false);
+  ASSERT_TRUE(channel.receive_pyobj(false).equal(py::eval("list(range(10))")));
+
+  channel.dispose();
+}
+
+TEST(ChannelTest, TransferOutOfBandObj) {
+  channel_test channel;
+  const char *expr =
+      "__import__('pickle').PickleBuffer(bytearray(b'x' * (1 << 17)))";
+
+  // large buffers are handed back in place, and the space of the message is
+  // only freed once they are dropped
+  channel.send_pyobj(py::eval(expr));
+  size_t end = (channel.end)->load();
+  py::object o1 = channel.receive_pyobj(true);
+  ASSERT_EQ((channel.start)->load(), 0);
+  ASSERT_EQ((channel.n_pending)->load(), 1);
+  ASSERT_EQ(o1.attr("readonly").cast<bool>(), false);
+  ASSERT_EQ(len(o1), 1 << 17);
+  ASSERT_TRUE(py::bytes(o1).equal(py::eval("b'x' * (1 << 17)")));
+  o1 = py::none();
+  ASSERT_EQ((channel.start)->load(), end);
+  ASSERT_EQ((channel.n_pending)->load(), 0);
+
+  // or copied out on request
+  channel.send_pyobj(py::eval(expr));
+  py::object o2 = channel.receive_pyobj_copy(true);
+  ASSERT_EQ((channel.start)->load(), (channel.end)->load());
+  ASSERT_EQ((channel.n_pending)->load(), 0);
+
+  channel.dispose();
+  ASSERT_TRUE(py::bytes(o2).equal(py::eval("b'x' * (1 << 17)")));
+}
+
 TEST(ChannelTest, IpcSmallObj) {
   channel_test channel;
 
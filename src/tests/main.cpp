@@ -3,10 +3,27 @@
 #include <pybind11/embed.h>
 namespace py = pybind11;
 
+#include "atomic_array_tests.h"
+#include "broadcast_channel_tests.h"
 #include "channel_tests.h"
+#include "misc_tests.h"
+#include "mpmc_channel_tests.h"
+#include "object_store_tests.h"
+#include "pool_tests.h"
+#include "shared_array_tests.h"
+#include "shared_barrier_tests.h"
+#include "shared_event_tests.h"
+#include "shared_lock_tests.h"
+#include "shared_map_tests.h"
+#include "thread_tests.h"
+
+extern "C" PyObject *PyInit_snakefish();
 
 int main(int argc, char **argv) {
+  // the bindings register the types some tests hand over to Python
+  PyImport_AppendInittab("snakefish", PyInit_snakefish);
   py::scoped_interpreter guard{};
+  py::module::import("snakefish");
 
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
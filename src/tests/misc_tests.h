@@ -0,0 +1,133 @@
+#ifndef SNAKEFISH_MISC_TESTS_H
+#define SNAKEFISH_MISC_TESTS_H
+
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <pybind11/embed.h>
+namespace py = pybind11;
+
+#include "misc.h"
+using namespace snakefish;
+
+TEST(MiscTest, PackResultsObj) {
+  py::object array_type = py::module::import("array").attr("array");
+
+  // homogeneous ints and floats are packed
+  std::vector<py::object> ints = {py::cast(1), py::cast(-2), py::cast(3)};
+  py::object packed_ints = pack_results(ints);
+  ASSERT_TRUE(py::isinstance(packed_ints, array_type));
+  ASSERT_TRUE(packed_ints.equal(py::eval("__import__('array').array('q', "
+                                         "[1, -2, 3])")));
+  std::vector<py::object> floats = {py::cast(1.5), py::cast(-2.0)};
+  py::object packed_floats = pack_results(floats);
+  ASSERT_TRUE(py::isinstance(packed_floats, array_type));
+  ASSERT_TRUE(packed_floats.equal(py::eval("__import__('array').array('d', "
+                                           "[1.5, -2.0])")));
+
+  // anything else falls back to a list
+  std::vector<py::object> mixed = {py::cast(1), py::cast(2.5)};
+  py::object packed_mixed = pack_results(mixed);
+  ASSERT_TRUE(py::isinstance<py::list>(packed_mixed));
+  ASSERT_TRUE(packed_mixed.equal(py::eval("[1, 2.5]")));
+  std::vector<py::object> large = {py::cast(1), py::eval("2 ** 70")};
+  ASSERT_TRUE(py::isinstance<py::list>(pack_results(large)));
+  ASSERT_TRUE(py::isinstance<py::list>(pack_results({})));
+
+  // bools are ints to Python, but must not come back as such
+  std::vector<py::object> bools = {py::cast(true), py::cast(false)};
+  py::object packed_bools = pack_results(bools);
+  ASSERT_TRUE(py::isinstance<py::list>(packed_bools));
+  ASSERT_TRUE(PyBool_Check(py::list(packed_bools)[0].ptr()));
+  ASSERT_TRUE(PyBool_Check(py::list(packed_bools)[1].ptr()));
+}
+
+TEST(MiscTest, JoinResultsObj) {
+  py::object array_type = py::module::import("array").attr("array");
+  std::vector<py::object> ints = {
+      py::eval("__import__('array').array('q', [1, 2])"),
+      py::eval("__import__('array').array('q', [3])")};
+  std::vector<py::object> floats = {
+      py::eval("__import__('array').array('d', [1.5])"),
+      py::eval("__import__('array').array('d', [2.5, 3.5])")};
+
+  // columnar results are joined into a single array
+  py::object joined_ints = join_results(ints, true);
+  ASSERT_TRUE(py::isinstance(joined_ints, array_type));
+  ASSERT_TRUE(joined_ints.equal(py::eval("__import__('array').array('q', "
+                                         "[1, 2, 3])")));
+  py::object joined_floats = join_results(floats, true);
+  ASSERT_TRUE(py::isinstance(joined_floats, array_type));
+  ASSERT_TRUE(joined_floats.equal(py::eval("__import__('array').array('d', "
+                                           "[1.5, 2.5, 3.5])")));
+
+  // otherwise, they are joined into a list
+  py::object list_ints = join_results(ints, false);
+  ASSERT_TRUE(py::isinstance<py::list>(list_ints));
+  ASSERT_TRUE(list_ints.equal(py::eval("[1, 2, 3]")));
+  py::object list_floats = join_results(floats, false);
+  ASSERT_TRUE(py::isinstance<py::list>(list_floats));
+  ASSERT_TRUE(list_floats.equal(py::eval("[1.5, 2.5, 3.5]")));
+
+  // as are mixed results, even if columnar ones were requested
+  std::vector<py::object> mixed = {ints[0], floats[0]};
+  py::object joined_mixed = join_results(mixed, true);
+  ASSERT_TRUE(py::isinstance<py::list>(joined_mixed));
+  ASSERT_TRUE(joined_mixed.equal(py::eval("[1, 2, 1.5]")));
+  std::vector<py::object> partly_packed = {ints[0], py::eval("[True, 'x']")};
+  py::object joined_partly = join_results(partly_packed, true);
+  ASSERT_TRUE(py::isinstance<py::list>(joined_partly));
+  ASSERT_TRUE(joined_partly.equal(py::eval("[1, 2, True, 'x']")));
+  ASSERT_TRUE(join_results({}, true).equal(py::eval("[]")));
+}
+
+TEST(MiscTest, SelectSharedObj) {
+  const size_t n_procs = 4;
+  py::object channel = py::module::import("snakefish").attr("Channel")();
+  py::list objs;
+  objs.append(channel);
+
+  // several processes select on the same channel, and each takes one message
+  std::vector<pid_t> pids;
+  for (size_t i = 0; i < n_procs; i++) {
+    pid_t result = fork();
+    if (result == 0) {
+      while (true) {
+        if (select(objs, 10).empty())
+          std::exit(1);
+        try {
+          channel.attr("receive_pyobj")(false);
+          std::exit(0);
+        } catch (py::error_already_set &e) {
+          // another process took the message
+        }
+      }
+    } else if (result < 0) {
+      perror("fork() failed");
+      abort();
+    }
+    pids.push_back(result);
+  }
+
+  // none of them sleeps through a message, even though they share a
+  // notifier
+  for (size_t i = 0; i < n_procs; i++)
+    channel.attr("send_pyobj")(i);
+  for (pid_t pid : pids) {
+    int status = 0;
+    if (waitpid(pid, &status, 0) == -1) {
+      perror("waitpid() failed");
+      abort();
+    }
+    ASSERT_EQ(WIFEXITED(status), 1);
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+  }
+
+  channel.attr("dispose")();
+}
+
+#endif // SNAKEFISH_MISC_TESTS_H
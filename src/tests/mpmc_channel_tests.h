@@ -0,0 +1,261 @@
+#ifndef SNAKEFISH_MPMC_CHANNEL_TESTS_H
+#define SNAKEFISH_MPMC_CHANNEL_TESTS_H
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <pybind11/embed.h>
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "mpmc_channel.h"
+#include "test_util.h"
+using namespace snakefish;
+
+class mpmc_channel_test : public mpmc_channel {
+public:
+  using mpmc_channel::header;
+  using mpmc_channel::n_slots;
+  using mpmc_channel::seqs;
+  using mpmc_channel::shared_mem;
+  using mpmc_channel::mpmc_channel;
+};
+
+TEST(MpmcChannelTest, ReadWrite) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  mpmc_channel_test channel = mpmc_channel_test(1);
+  ASSERT_NE(channel.shared_mem, nullptr);
+  ASSERT_EQ(channel.n_slots, page_size / MPMC_SLOT_SIZE);
+
+  // go around the buffer a few times, so that messages wrap
+  size_t len = page_size / 3;
+  for (size_t i = 0; i < 10; i++) {
+    buffer bytes = get_random_bytes(len);
+    buffer copy = duplicate_bytes(bytes.get_ptr(), len);
+    channel.send_bytes(bytes.get_ptr(), len);
+    buffer read_bytes = channel.receive_bytes(false);
+    ASSERT_EQ(read_bytes.get_len(), len);
+    ASSERT_EQ(memcmp(copy.get_ptr(), read_bytes.get_ptr(), len), 0);
+  }
+  ASSERT_EQ(channel.header->enqueue_pos.load(),
+            channel.header->dequeue_pos.load());
+
+  channel.dispose();
+}
+
+TEST(MpmcChannelTest, WriteOverflow) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  mpmc_channel_test channel = mpmc_channel_test(page_size);
+
+  buffer bytes = get_random_bytes(page_size);
+  size_t len = page_size - sizeof(size_t);
+  channel.send_bytes(bytes.get_ptr(), len);
+  try {
+    channel.send_bytes(bytes.get_ptr(), 1);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+
+  // times out when nothing is received
+  try {
+    channel.send_bytes(bytes.get_ptr(), 1, true, 0.01);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+
+  // fails right away when the message can never fit
+  channel.receive_bytes(false);
+  try {
+    channel.send_bytes(bytes.get_ptr(), len + 1, true, -1);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+
+  channel.dispose();
+}
+
+TEST(MpmcChannelTest, WriteUnfreed) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  mpmc_channel_test channel = mpmc_channel_test(page_size);
+
+  // a receiver claims the first message, but is still reading it
+  size_t len = page_size / 4;
+  size_t n_msg_slots =
+      (sizeof(size_t) + len + MPMC_SLOT_SIZE - 1) / MPMC_SLOT_SIZE;
+  buffer bytes = get_random_bytes(len);
+  for (size_t i = 0; i < 3; i++)
+    channel.send_bytes(bytes.get_ptr(), len);
+  channel.header->dequeue_pos.store(n_msg_slots);
+
+  // its slots can't be reused yet, so the buffer is full
+  try {
+    channel.send_bytes(bytes.get_ptr(), len);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+  try {
+    channel.send_bytes(bytes.get_ptr(), len, true, 0.01);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "channel buffer is full");
+  }
+
+  // until the receiver is done with it
+  for (size_t p = 0; p < n_msg_slots; p++)
+    channel.seqs[p].store(channel.n_slots);
+  channel.send_bytes(bytes.get_ptr(), len);
+  for (size_t i = 0; i < 3; i++)
+    ASSERT_EQ(channel.receive_bytes(false).get_len(), len);
+
+  channel.dispose();
+}
+
+TEST(MpmcChannelTest, ReadOutOfBound) {
+  mpmc_channel_test channel = mpmc_channel_test(1);
+
+  try {
+    channel.receive_bytes(false);
+    FAIL();
+  } catch (const std::out_of_range &e) {
+    ASSERT_EQ(std::string(e.what()), "out-of-bounds read detected");
+  }
+
+  size_t n = 42;
+  ASSERT_EQ(channel.poll(), false);
+  channel.send_bytes(&n, sizeof(size_t));
+  ASSERT_EQ(channel.poll(), true);
+  buffer read_bytes = channel.receive_bytes(false);
+  ASSERT_EQ(*static_cast<size_t *>(read_bytes.get_ptr()), n);
+  ASSERT_EQ(channel.poll(), false);
+  try {
+    channel.receive_bytes(false);
+    FAIL();
+  } catch (const std::out_of_range &e) {
+    ASSERT_EQ(std::string(e.what()), "out-of-bounds read detected");
+  }
+
+  channel.dispose();
+}
+
+TEST(MpmcChannelTest, IpcManyToMany) {
+  const size_t n_senders = 4;
+  const size_t n_receivers = 4;
+  const size_t n_msgs = 5000;
+  const size_t max_filler = 150;
+  size_t size_t_size = sizeof(size_t);
+
+  // a small buffer, so that senders have to wait and messages wrap
+  mpmc_channel_test channel = mpmc_channel_test(1);
+  mpmc_channel_test results = mpmc_channel_test(1);
+
+  // receivers check the framing of each message, and report how many messages
+  // they got and the sum of their sequence numbers
+  std::vector<pid_t> receivers;
+  for (size_t r = 0; r < n_receivers; r++) {
+    pid_t result = fork();
+    if (result == 0) {
+      size_t stats[2] = {0, 0};
+      while (true) {
+        buffer msg = channel.receive_bytes(true);
+        if (msg.get_len() == 0)
+          break;
+
+        const char *bytes = static_cast<const char *>(msg.get_ptr());
+        size_t sender = 0;
+        size_t i = 0;
+        memcpy(&sender, bytes, size_t_size);
+        memcpy(&i, bytes + size_t_size, size_t_size);
+        if (sender >= n_senders || i >= n_msgs ||
+            msg.get_len() != 2 * size_t_size + i % max_filler)
+          std::exit(1);
+        for (size_t j = 2 * size_t_size; j < msg.get_len(); j++) {
+          if (bytes[j] != static_cast<char>(i ^ sender))
+            std::exit(1);
+        }
+
+        stats[0]++;
+        stats[1] += i;
+      }
+      results.send_bytes(stats, sizeof(stats), true, -1);
+
+      std::exit(0);
+    } else if (result > 0) {
+      receivers.push_back(result);
+    } else {
+      perror("fork() failed");
+      abort();
+    }
+  }
+
+  std::vector<pid_t> senders;
+  for (size_t s = 0; s < n_senders; s++) {
+    pid_t result = fork();
+    if (result == 0) {
+      char msg[2 * sizeof(size_t) + max_filler];
+      for (size_t i = 0; i < n_msgs; i++) {
+        memcpy(msg, &s, size_t_size);
+        memcpy(msg + size_t_size, &i, size_t_size);
+        memset(msg + 2 * size_t_size, static_cast<char>(i ^ s),
+               i % max_filler);
+        channel.send_bytes(msg, 2 * size_t_size + i % max_filler, true, -1);
+      }
+
+      std::exit(0);
+    } else if (result > 0) {
+      senders.push_back(result);
+    } else {
+      perror("fork() failed");
+      abort();
+    }
+  }
+
+  // wait for the senders, then tell the receivers to stop
+  for (pid_t pid : senders) {
+    int status = 0;
+    if (waitpid(pid, &status, 0) == -1) {
+      perror("waitpid() failed");
+      abort();
+    } else {
+      ASSERT_EQ(WIFEXITED(status), 1);
+      ASSERT_EQ(WEXITSTATUS(status), 0);
+    }
+  }
+  for (size_t r = 0; r < n_receivers; r++)
+    channel.send_bytes(&n_receivers, 0, true, -1);
+
+  // every message is received exactly once
+  size_t total_count = 0;
+  size_t total_sum = 0;
+  for (size_t r = 0; r < n_receivers; r++) {
+    buffer stats = results.receive_bytes(true);
+    ASSERT_EQ(stats.get_len(), 2 * size_t_size);
+    total_count += static_cast<size_t *>(stats.get_ptr())[0];
+    total_sum += static_cast<size_t *>(stats.get_ptr())[1];
+  }
+  ASSERT_EQ(total_count, n_senders * n_msgs);
+  ASSERT_EQ(total_sum, n_senders * n_msgs * (n_msgs - 1) / 2);
+
+  for (pid_t pid : receivers) {
+    int status = 0;
+    if (waitpid(pid, &status, 0) == -1) {
+      perror("waitpid() failed");
+      abort();
+    } else {
+      ASSERT_EQ(WIFEXITED(status), 1);
+      ASSERT_EQ(WEXITSTATUS(status), 0);
+    }
+  }
+  ASSERT_EQ(channel.header->enqueue_pos.load(),
+            channel.header->dequeue_pos.load());
+
+  // release resources
+  channel.dispose();
+  results.dispose();
+}
+
+#endif // SNAKEFISH_MPMC_CHANNEL_TESTS_H
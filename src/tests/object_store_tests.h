@@ -0,0 +1,211 @@
+#ifndef SNAKEFISH_OBJECT_STORE_TESTS_H
+#define SNAKEFISH_OBJECT_STORE_TESTS_H
+
+#include <cstring>
+
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <pybind11/embed.h>
+#include <pybind11/pybind11.h>
+namespace py = pybind11;
+
+#include "object_store.h"
+#include "test_util.h"
+using namespace snakefish;
+
+class object_store_test : public object_store {
+public:
+  using object_store::allocate;
+  using object_store::arena;
+  using object_store::block_of;
+  using object_store::capacity;
+  using object_store::object_store;
+};
+
+TEST(ObjectStoreTest, Allocate) {
+  object_store_test store = object_store_test(1000);
+  ASSERT_EQ(store.capacity, 1024);
+  ASSERT_EQ(store.get_used(), 0);
+
+  size_t h1 = store.allocate(100, object_kind::RAW_BUFFER);
+  size_t h2 = store.allocate(0, object_kind::RAW_BUFFER);
+  ASSERT_NE(h1, 0);
+  ASSERT_NE(h2, 0);
+  ASSERT_NE(h1, h2);
+  object_block *b1 = store.block_of(h1);
+  object_block *b2 = store.block_of(h2);
+  ASSERT_EQ(reinterpret_cast<char *>(b1) - store.arena, 0);
+  ASSERT_EQ(b1->size, 192);
+  ASSERT_EQ(b1->len, 100);
+  ASSERT_EQ(b1->refs.load(), 1);
+  ASSERT_EQ(reinterpret_cast<char *>(b2) - store.arena, 192);
+  ASSERT_EQ(b2->size, 64);
+  ASSERT_EQ(store.get_used(), 256);
+
+  // the rest doesn't fit anything bigger
+  ASSERT_EQ(store.allocate(1024 - 256, object_kind::RAW_BUFFER), 0);
+  size_t h3 = store.allocate(1024 - 256 - 64, object_kind::RAW_BUFFER);
+  ASSERT_NE(h3, 0);
+  ASSERT_EQ(store.get_used(), 1024);
+  ASSERT_EQ(store.allocate(0, object_kind::RAW_BUFFER), 0);
+
+  store.dispose();
+}
+
+TEST(ObjectStoreTest, ReleaseAndReuse) {
+  object_store_test store = object_store_test(1024);
+  size_t h1 = store.allocate(100, object_kind::RAW_BUFFER);
+  size_t h2 = store.allocate(100, object_kind::RAW_BUFFER);
+  size_t h3 = store.allocate(100, object_kind::RAW_BUFFER);
+  ASSERT_EQ(store.get_used(), 3 * 192);
+
+  // the object stays until its last reference is dropped
+  store.retain(h2);
+  store.release(h2);
+  ASSERT_EQ(store.block_of(h2)->refs.load(), 1);
+  ASSERT_EQ(store.get_used(), 3 * 192);
+  store.release(h1);
+  store.release(h2);
+  ASSERT_EQ(store.get_used(), 192);
+
+  // stale handles are rejected even if the space is reused
+  try {
+    store.release(h1);
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid handle");
+  }
+
+  // freed neighbors are merged
+  size_t h4 = store.allocate(300, object_kind::RAW_BUFFER);
+  ASSERT_NE(h4, 0);
+  ASSERT_EQ(store.block_of(h4), reinterpret_cast<object_block *>(store.arena));
+  ASSERT_NE(h4, h1);
+  try {
+    store.retain(h2);
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid handle");
+  }
+
+  store.release(h3);
+  store.release(h4);
+  ASSERT_EQ(store.get_used(), 0);
+  ASSERT_NE(store.allocate(1024 - 64, object_kind::RAW_BUFFER), 0);
+
+  store.dispose();
+}
+
+TEST(ObjectStoreTest, InvalidHandle) {
+  object_store_test store = object_store_test(1024);
+  size_t handles[] = {0, 1, static_cast<size_t>(1) << HANDLE_OFFSET_BITS,
+                      (static_cast<size_t>(1) << HANDLE_OFFSET_BITS) | 16};
+  for (size_t handle : handles) {
+    try {
+      store.retain(handle);
+      FAIL();
+    } catch (const std::invalid_argument &e) {
+      ASSERT_EQ(std::string(e.what()), "invalid handle");
+    }
+  }
+
+  // nor are handles into the middle of an object, whatever it holds
+  size_t h1 = store.allocate(256, object_kind::RAW_BUFFER);
+  object_block *b1 = store.block_of(h1);
+  object_block *fake = b1 + 1;
+  fake->size = 64;
+  fake->seq = 12345;
+  fake->refs.store(1);
+  size_t forged = (static_cast<size_t>(12345) << HANDLE_OFFSET_BITS) |
+                  ((reinterpret_cast<char *>(fake) - store.arena) /
+                   OBJECT_ALIGNMENT);
+  try {
+    store.retain(forged);
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid handle");
+  }
+
+  try {
+    object_store_test(0);
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid object store size");
+  }
+
+  store.dispose();
+}
+
+TEST(ObjectStoreTest, Ipc) {
+  object_store_test store = object_store_test(1024 * 1024);
+  size_t len = 4096;
+  buffer bytes = get_random_bytes(len);
+
+  int pipe_fds[2];
+  ASSERT_EQ(pipe(pipe_fds), 0);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // child
+    size_t handle = store.allocate(len, object_kind::RAW_BUFFER);
+    memcpy(reinterpret_cast<char *>(store.block_of(handle)) +
+               sizeof(object_block),
+           bytes.get_ptr(), len);
+    if (write(pipe_fds[1], &handle, sizeof(handle)) != sizeof(handle))
+      exit(1);
+    exit(0);
+  } else {
+    // parent
+    size_t handle = 0;
+    ASSERT_EQ(read(pipe_fds[0], &handle, sizeof(handle)), sizeof(handle));
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    object_block *block = store.block_of(handle);
+    ASSERT_EQ(block->len, len);
+    ASSERT_EQ(memcmp(reinterpret_cast<char *>(block) + sizeof(object_block),
+                     bytes.get_ptr(), len),
+              0);
+    store.release(handle);
+    ASSERT_EQ(store.get_used(), 0);
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    store.dispose();
+  }
+}
+
+TEST(ObjectStoreTest, PutGetObj) {
+  object_store store = object_store(1024 * 1024);
+  py::object bytes = py::bytes("hello");
+  py::object obj = py::eval("{'a': [1, 2.5, 'x'], 'b': b'y' * 100000}");
+
+  size_t h1 = store.put(bytes);
+  size_t h2 = store.put(obj);
+  ASSERT_TRUE(store.get(h1).attr("tobytes")().equal(bytes));
+  ASSERT_TRUE(store.get(h1).attr("readonly").cast<bool>());
+  ASSERT_TRUE(store.get(h2).equal(obj));
+
+  store.release(h1);
+  store.release(h2);
+  ASSERT_EQ(store.get_used(), 0);
+  store.dispose();
+}
+
+TEST(ObjectStoreTest, DisposeBeforeViewObj) {
+  object_store store = object_store(1024 * 1024);
+  py::object bytes = py::bytes("hello");
+  size_t handle = store.put(bytes);
+  py::object view = store.get(handle);
+  store.release(handle);
+
+  // the memory stays mapped until the view is gone
+  store.dispose();
+  ASSERT_TRUE(view.attr("tobytes")().equal(bytes));
+  view = py::none();
+}
+
+#endif // SNAKEFISH_OBJECT_STORE_TESTS_H
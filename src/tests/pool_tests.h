@@ -0,0 +1,112 @@
+#ifndef SNAKEFISH_POOL_TESTS_H
+#define SNAKEFISH_POOL_TESTS_H
+
+#include <gtest/gtest.h>
+
+#include <pybind11/embed.h>
+namespace py = pybind11;
+
+#include "pool.h"
+using namespace snakefish;
+
+TEST(PoolTest, MapObj) {
+  pool p = pool(3);
+  ASSERT_EQ(p.get_n_workers(), 3);
+  py::object builtins = py::module::import("builtins");
+  py::function abs = builtins.attr("abs");
+  py::function pow = builtins.attr("pow");
+
+  // the same workers serve every call
+  for (int i = 0; i < 10; i++) {
+    py::object args = py::eval("range(-50, 50)");
+    ASSERT_TRUE(p.map(abs, args).equal(py::eval("[abs(i) for i in "
+                                                "range(-50, 50)]")));
+  }
+  ASSERT_TRUE(p.map(abs, py::eval("[-1.5, 2.5]"), 0, 1, true)
+                  .equal(py::eval("__import__('array').array('d', "
+                                  "[1.5, 2.5])")));
+  ASSERT_TRUE(p.starmap(pow, py::eval("[(2, 3), (3, 2)]"))
+                  .equal(py::eval("[8, 9]")));
+  ASSERT_TRUE(p.map(abs, py::eval("[]")).equal(py::eval("[]")));
+
+  p.dispose();
+}
+
+TEST(PoolTest, ErrorObj) {
+  pool p = pool(2);
+  py::function abs = py::module::import("builtins").attr("abs");
+
+  try {
+    p.map(abs, py::eval("[1, 'x', 3, 4]"), 0, 1);
+    FAIL();
+  } catch (py::error_already_set &e) {
+    ASSERT_TRUE(e.matches(PyExc_TypeError));
+  }
+
+  // the pool is still usable
+  ASSERT_TRUE(p.map(abs, py::eval("[-1, -2]")).equal(py::eval("[1, 2]")));
+
+  p.dispose();
+  try {
+    p.map(abs, py::eval("[1]"));
+    FAIL();
+  } catch (const std::runtime_error &e) {
+    ASSERT_EQ(std::string(e.what()), "this pool has been disposed");
+  }
+}
+
+TEST(PoolTest, UnpicklableTaskObj) {
+  pool p = pool(2);
+
+  // functions defined in __main__ after the workers were started can't be
+  // unpickled by them
+  py::exec("def late_square(x):\n"
+           "    return x * x\n",
+           py::globals());
+  py::function late_square = py::globals()["late_square"];
+  try {
+    p.map(late_square, py::eval("[1, 2, 3]"), 0, 1);
+    FAIL();
+  } catch (py::error_already_set &e) {
+    ASSERT_TRUE(e.matches(PyExc_RuntimeError));
+  }
+
+  // the workers are still alive
+  py::function abs = py::module::import("builtins").attr("abs");
+  ASSERT_TRUE(p.map(abs, py::eval("[-1, -2]")).equal(py::eval("[1, 2]")));
+
+  p.dispose();
+}
+
+TEST(PoolTest, OversizedResultObj) {
+  pool p = pool(1, 64 * 1024);
+  py::function bytes = py::module::import("builtins").attr("bytes");
+
+  // the result doesn't fit in the result channel
+  try {
+    p.map(bytes, py::eval("[1024 * 1024]"));
+    FAIL();
+  } catch (py::error_already_set &e) {
+    ASSERT_TRUE(e.matches(PyExc_RuntimeError));
+  }
+
+  // the worker is still alive
+  ASSERT_TRUE(p.map(bytes, py::eval("[1, 2]"))
+                  .equal(py::eval("[b'\\0', b'\\0\\0']")));
+
+  p.dispose();
+}
+
+TEST(PoolTest, LargeChunksObj) {
+  // each channel only fits a single task or result, so the workers can all be
+  // stuck sending results while the task channel is full
+  pool p = pool(3, 64 * 1024);
+  py::function bytes = py::module::import("builtins").attr("bytes");
+
+  py::object args = py::eval("[b'x' * 40000] * 12");
+  ASSERT_TRUE(p.map(bytes, args, 0, 1).equal(args));
+
+  p.dispose();
+}
+
+#endif // SNAKEFISH_POOL_TESTS_H
@@ -0,0 +1,96 @@
+#ifndef SNAKEFISH_SHARED_ARRAY_TESTS_H
+#define SNAKEFISH_SHARED_ARRAY_TESTS_H
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shared_array.h"
+using namespace snakefish;
+
+TEST(SharedArrayTest, Layout) {
+  shared_array array = shared_array(std::vector<size_t>({3, 4, 5}), "int32");
+  ASSERT_EQ(array.get_format(), "i");
+  ASSERT_EQ(array.get_itemsize(), 4);
+  ASSERT_EQ(array.get_nbytes(), 3 * 4 * 5 * 4);
+  ASSERT_EQ(array.get_len(), 3);
+
+  py::buffer_info info = array.get_buffer_info();
+  ASSERT_EQ(info.ptr, array.get_ptr());
+  ASSERT_EQ(info.ndim, 3);
+  ASSERT_EQ(info.shape, std::vector<ssize_t>({3, 4, 5}));
+  ASSERT_EQ(info.strides, std::vector<ssize_t>({80, 20, 4}));
+  ASSERT_FALSE(info.readonly);
+
+  // zero-filled
+  const char *p = static_cast<const char *>(array.get_ptr());
+  for (size_t i = 0; i < array.get_nbytes(); i++)
+    ASSERT_EQ(p[i], 0);
+
+  array.dispose();
+
+  shared_array vec = shared_array(10);
+  ASSERT_EQ(vec.get_format(), "d");
+  ASSERT_EQ(vec.get_shape(), std::vector<size_t>({10}));
+  ASSERT_EQ(vec.get_nbytes(), 10 * sizeof(double));
+  vec.dispose();
+}
+
+TEST(SharedArrayTest, InvalidArgs) {
+  try {
+    shared_array(std::vector<size_t>({2, 0}));
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid shape");
+  }
+  try {
+    shared_array(std::vector<size_t>());
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid shape");
+  }
+  try {
+    shared_array(10, "complex128");
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid dtype");
+  }
+  try {
+    shared_array(std::vector<size_t>({SIZE_MAX / 2, 4}));
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "array is too large");
+  }
+}
+
+TEST(SharedArrayTest, Ipc) {
+  size_t n = 1000;
+  shared_array array = shared_array(n, "float64");
+  double *data = static_cast<double *>(array.get_ptr());
+
+  // each child fills its own half
+  pid_t pids[2];
+  for (size_t c = 0; c < 2; c++) {
+    pids[c] = fork();
+    if (pids[c] == 0) {
+      for (size_t i = c * n / 2; i < (c + 1) * n / 2; i++)
+        data[i] = i * 0.5;
+      exit(0);
+    }
+  }
+  for (pid_t pid : pids) {
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+  }
+
+  for (size_t i = 0; i < n; i++)
+    ASSERT_EQ(data[i], i * 0.5);
+
+  array.dispose();
+}
+
+#endif // SNAKEFISH_SHARED_ARRAY_TESTS_H
@@ -0,0 +1,65 @@
+#ifndef SNAKEFISH_SHARED_BARRIER_TESTS_H
+#define SNAKEFISH_SHARED_BARRIER_TESTS_H
+
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shared_barrier.h"
+#include "util.h"
+using namespace snakefish;
+
+TEST(SharedBarrierTest, Ipc) {
+  const size_t n_procs = 4;
+  const size_t n_steps = 200;
+  shared_barrier barrier = shared_barrier(n_procs);
+  ASSERT_EQ(barrier.get_n_parties(), n_procs);
+  size_t *steps = static_cast<size_t *>(
+      util::get_shared_mem(2 * n_procs * sizeof(size_t), true));
+  size_t *arrivals = steps + n_procs;
+
+  // nobody may see a step of another process other than its own after the
+  // barrier
+  pid_t pids[n_procs];
+  for (size_t p = 0; p < n_procs; p++) {
+    pids[p] = fork();
+    if (pids[p] == 0) {
+      if (p % 2)
+        barrier.set_spin(100);
+      for (size_t s = 1; s <= n_steps; s++) {
+        __atomic_store_n(&steps[p], s, __ATOMIC_RELAXED);
+        size_t idx = barrier.wait();
+        __atomic_fetch_add(&arrivals[idx], 1, __ATOMIC_RELAXED);
+        for (size_t q = 0; q < n_procs; q++) {
+          size_t step = __atomic_load_n(&steps[q], __ATOMIC_RELAXED);
+          if (step != s && step != s + 1)
+            exit(1);
+        }
+        barrier.wait();
+      }
+      exit(0);
+    }
+  }
+  for (pid_t pid : pids) {
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+  }
+
+  // each arrival index is handed out once per step
+  for (size_t i = 0; i < n_procs; i++)
+    ASSERT_EQ(arrivals[i], n_steps);
+
+  try {
+    shared_barrier(0);
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid number of parties");
+  }
+
+  munmap(steps, 2 * n_procs * sizeof(size_t));
+  barrier.dispose();
+}
+
+#endif // SNAKEFISH_SHARED_BARRIER_TESTS_H
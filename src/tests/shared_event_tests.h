@@ -0,0 +1,73 @@
+#ifndef SNAKEFISH_SHARED_EVENT_TESTS_H
+#define SNAKEFISH_SHARED_EVENT_TESTS_H
+
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shared_event.h"
+using namespace snakefish;
+
+TEST(SharedEventTest, SetClear) {
+  shared_event event = shared_event();
+  ASSERT_FALSE(event.is_set());
+  ASSERT_FALSE(event.wait(0.05));
+  event.set();
+  ASSERT_TRUE(event.is_set());
+  ASSERT_TRUE(event.wait());
+  ASSERT_TRUE(event.wait(0));
+  event.clear();
+  ASSERT_FALSE(event.is_set());
+  ASSERT_FALSE(event.wait(0));
+  event.dispose();
+}
+
+TEST(SharedEventTest, Ipc) {
+  const size_t n_procs = 4;
+  const size_t n_rounds = 50;
+  shared_event go[2] = {shared_event(), shared_event()};
+  shared_event done[n_procs] = {shared_event(), shared_event(), shared_event(),
+                                shared_event()};
+
+  // the waiters must all wake up every round, sleeping or spinning
+  // rounds alternate between two events, so that one can be cleared while the
+  // waiters wait for the other
+  pid_t pids[n_procs];
+  for (size_t p = 0; p < n_procs; p++) {
+    pids[p] = fork();
+    if (pids[p] == 0) {
+      if (p % 2) {
+        go[0].set_spin(100);
+        go[1].set_spin(100);
+      }
+      for (size_t r = 0; r < n_rounds; r++) {
+        if (!go[r % 2].wait(10))
+          exit(1);
+        done[p].set();
+      }
+      exit(0);
+    }
+  }
+  for (size_t r = 0; r < n_rounds; r++) {
+    usleep(100);
+    go[r % 2].set();
+    for (size_t p = 0; p < n_procs; p++) {
+      ASSERT_TRUE(done[p].wait(10));
+      done[p].clear();
+    }
+    go[r % 2].clear();
+  }
+  for (pid_t pid : pids) {
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+  }
+
+  for (shared_event &event : go)
+    event.dispose();
+  for (shared_event &event : done)
+    event.dispose();
+}
+
+#endif // SNAKEFISH_SHARED_EVENT_TESTS_H
@@ -0,0 +1,77 @@
+#ifndef SNAKEFISH_SHARED_LOCK_TESTS_H
+#define SNAKEFISH_SHARED_LOCK_TESTS_H
+
+#include <chrono>
+
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shared_lock.h"
+#include "util.h"
+using namespace snakefish;
+
+TEST(SharedLockTest, AcquireRelease) {
+  shared_lock lock = shared_lock();
+  ASSERT_FALSE(lock.locked());
+  ASSERT_TRUE(lock.acquire());
+  ASSERT_TRUE(lock.locked());
+  ASSERT_FALSE(lock.acquire(false));
+
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_FALSE(lock.acquire(true, 0.1));
+  auto elapsed = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  ASSERT_GE(elapsed, 0.1);
+
+  lock.release();
+  ASSERT_FALSE(lock.locked());
+  try {
+    lock.release();
+    FAIL();
+  } catch (const std::runtime_error &e) {
+    ASSERT_EQ(std::string(e.what()), "lock is not locked");
+  }
+
+  lock.dispose();
+}
+
+TEST(SharedLockTest, Ipc) {
+  const size_t n_procs = 4;
+  const size_t n_iters = 20000;
+  shared_lock lock = shared_lock();
+  size_t *counter =
+      static_cast<size_t *>(util::get_shared_mem(sizeof(size_t), true));
+
+  // a plain increment only adds up if the lock works
+  pid_t pids[n_procs];
+  for (size_t p = 0; p < n_procs; p++) {
+    pids[p] = fork();
+    if (pids[p] == 0) {
+      if (p % 2)
+        lock.set_spin(100);
+      for (size_t i = 0; i < n_iters; i++) {
+        lock.acquire();
+        volatile size_t *c = counter;
+        *c = *c + 1;
+        lock.release();
+      }
+      exit(0);
+    }
+  }
+  for (pid_t pid : pids) {
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+  }
+
+  ASSERT_EQ(*counter, n_procs * n_iters);
+  ASSERT_FALSE(lock.locked());
+
+  munmap(counter, sizeof(size_t));
+  lock.dispose();
+}
+
+#endif // SNAKEFISH_SHARED_LOCK_TESTS_H
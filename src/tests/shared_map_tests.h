@@ -0,0 +1,113 @@
+#ifndef SNAKEFISH_SHARED_MAP_TESTS_H
+#define SNAKEFISH_SHARED_MAP_TESTS_H
+
+#include <cstring>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shared_map.h"
+using namespace snakefish;
+
+class shared_map_test : public shared_map {
+public:
+  using shared_map::max_key_len;
+  using shared_map::n_slots;
+  using shared_map::slot_size;
+  using shared_map::shared_map;
+};
+
+TEST(SharedMapTest, Ops) {
+  shared_map_test map = shared_map_test(3, 5);
+  ASSERT_EQ(map.n_slots, 8);
+  ASSERT_EQ(map.max_key_len, 8);
+  ASSERT_EQ(map.slot_size, sizeof(shared_map_slot) + 8);
+  ASSERT_EQ(map.get_size(), 0);
+
+  // int and bytes keys with the same bytes are different keys
+  int64_t int_key = 0x4142434445464748;
+  char bytes_key[8];
+  memcpy(bytes_key, &int_key, sizeof(int_key));
+  const char *key = reinterpret_cast<const char *>(&int_key);
+  ASSERT_EQ(map.add(key, 8, key_kind::INT_KEY, 2), 2);
+  ASSERT_EQ(map.add(key, 8, key_kind::INT_KEY, 3), 5);
+  ASSERT_EQ(map.add(bytes_key, 8, key_kind::BYTES_KEY, 1), 1);
+  map.set("ab", 2, key_kind::BYTES_KEY, -7);
+  ASSERT_EQ(map.get_size(), 3);
+
+  int64_t val = 0;
+  ASSERT_TRUE(map.get(key, 8, key_kind::INT_KEY, val));
+  ASSERT_EQ(val, 5);
+  ASSERT_TRUE(map.get("ab", 2, key_kind::BYTES_KEY, val));
+  ASSERT_EQ(val, -7);
+  ASSERT_FALSE(map.get("a", 1, key_kind::BYTES_KEY, val));
+  ASSERT_FALSE(map.get("abcdefghi", 9, key_kind::BYTES_KEY, val));
+
+  try {
+    map.add("abcdefghi", 9, key_kind::BYTES_KEY, 1);
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "key is too long");
+  }
+  try {
+    map.add("a", 1, key_kind::BYTES_KEY, 1);
+    FAIL();
+  } catch (const std::overflow_error &e) {
+    ASSERT_EQ(std::string(e.what()), "map is full");
+  }
+  ASSERT_EQ(map.get_size(), 3);
+
+  // existing keys can still be updated
+  ASSERT_EQ(map.add("ab", 2, key_kind::BYTES_KEY, 7), 0);
+
+  try {
+    shared_map(0);
+    FAIL();
+  } catch (const std::invalid_argument &e) {
+    ASSERT_EQ(std::string(e.what()), "invalid map capacity");
+  }
+
+  map.dispose();
+}
+
+TEST(SharedMapTest, Ipc) {
+  const size_t n_procs = 4;
+  const size_t n_keys = 500;
+  const size_t n_rounds = 20;
+  shared_map map = shared_map(n_keys);
+
+  // every process adds the same keys, in a different order
+  pid_t pids[n_procs];
+  for (size_t p = 0; p < n_procs; p++) {
+    pids[p] = fork();
+    if (pids[p] == 0) {
+      for (size_t r = 0; r < n_rounds; r++) {
+        for (size_t i = 0; i < n_keys; i++) {
+          std::string key = std::to_string((i + p * 37) % n_keys);
+          map.add(key.data(), key.size(), key_kind::BYTES_KEY, 1);
+        }
+      }
+      exit(0);
+    }
+  }
+  for (pid_t pid : pids) {
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+  }
+
+  ASSERT_EQ(map.get_size(), n_keys);
+  for (size_t i = 0; i < n_keys; i++) {
+    std::string key = std::to_string(i);
+    int64_t val = 0;
+    ASSERT_TRUE(map.get(key.data(), key.size(), key_kind::BYTES_KEY, val));
+    ASSERT_EQ(val, n_procs * n_rounds);
+  }
+
+  map.dispose();
+}
+
+#endif // SNAKEFISH_SHARED_MAP_TESTS_H
@@ -0,0 +1,28 @@
+#ifndef SNAKEFISH_THREAD_TESTS_H
+#define SNAKEFISH_THREAD_TESTS_H
+
+#include <gtest/gtest.h>
+
+#include <pybind11/embed.h>
+namespace py = pybind11;
+
+#include "thread.h"
+using namespace snakefish;
+
+TEST(ThreadTest, LargeResultObj) {
+  // the result is rebuilt from an out-of-band buffer, which must outlive the
+  // channel of the thread
+  py::function f = py::eval(
+      "lambda: __import__('pickle').PickleBuffer(bytearray(b'x' * (1 << 20)))");
+  thread t(f);
+  t.start();
+  t.join();
+  py::object r = t.get_result();
+  t.dispose();
+
+  ASSERT_EQ(len(r), 1 << 20);
+  ASSERT_EQ(r.attr("__getitem__")(0).cast<int>(), 'x');
+  r = py::none();
+}
+
+#endif // SNAKEFISH_THREAD_TESTS_H
@@ -6,7 +6,7 @@ namespace snakefish {
 thread::thread(py::function f)
     : is_parent(false), child_pid(0), started(false), joined(false),
       child_status(0), func(std::move(f)), extract_func(), merge_func(),
-      _channel(), merging(false) {
+      _channel(channel_mode::SPSC), merging(false), numa_node(-1) {
 
   // create shared memory
   alive = static_cast<std::atomic_bool *>(
@@ -17,7 +17,8 @@ thread::thread(py::function f)
 thread::thread(py::function f, py::function extract, py::function merge)
     : is_parent(false), child_pid(0), started(false), joined(false),
       child_status(0), func(std::move(f)), extract_func(std::move(extract)),
-      merge_func(std::move(merge)), _channel(), merging(true) {
+      merge_func(std::move(merge)), _channel(channel_mode::SPSC),
+      merging(true), numa_node(-1) {
 
   // create shared memory
   alive = static_cast<std::atomic_bool *>(
@@ -40,6 +41,8 @@ void thread::start() {
     is_parent = false;
     child_pid = 0;
     started = true;
+    if (numa_node >= 0)
+      util::run_on_numa_node(numa_node);
     run();
   } else {
     perror("fork() failed");
@@ -47,6 +50,13 @@ void thread::start() {
   }
 }
 
+void thread::set_numa_node(int node) {
+  if (node < 0)
+    node = util::get_numa_node();
+  util::check_numa_node(node);
+  numa_node = node;
+}
+
 void thread::join() {
   if (!started) {
     throw std::runtime_error("this thread has not been started yet");
@@ -66,11 +76,11 @@ void thread::join() {
   } else {
     joined = true;
     if (merging) {
-      globals = _channel.receive_pyobj(true);
-      ret_val = _channel.receive_pyobj(true);
+      globals = _channel.receive_pyobj_copy(true);
+      ret_val = _channel.receive_pyobj_copy(true);
       merge_func(py::globals(), globals);
     } else {
-      ret_val = _channel.receive_pyobj(true);
+      ret_val = _channel.receive_pyobj_copy(true);
     }
   }
 }
@@ -96,11 +106,11 @@ bool thread::try_join() {
   } else {
     joined = true;
     if (merging) {
-      globals = _channel.receive_pyobj(true);
-      ret_val = _channel.receive_pyobj(true);
+      globals = _channel.receive_pyobj_copy(true);
+      ret_val = _channel.receive_pyobj_copy(true);
       merge_func(py::globals(), globals);
     } else {
-      ret_val = _channel.receive_pyobj(true);
+      ret_val = _channel.receive_pyobj_copy(true);
     }
     return true;
   }
@@ -129,40 +139,56 @@ void thread::run() {
     abort();
   }
 
+  bool globals_sent = false;
   try {
-    ret_val = func();
-    if (merging) {
-      globals = extract_func(py::globals());
-      _channel.send_pyobj(globals);
-    }
-    _channel.send_pyobj(ret_val);
-  } catch (py::error_already_set &e) {
-    // send globals
-    if (merging) {
-      globals = extract_func(py::globals());
-      _channel.send_pyobj(globals);
-    }
-
-    // send exceptions to parent
-    _channel.send_pyobj(e.value());
-    _channel.send_pyobj(e.type());
-
-    // send traceback
-    if (e.trace()) {
-      _channel.send_pyobj(
-          py::module::import("traceback")
-              .attr("format_exception")(e.type(), e.value(), e.trace()));
-    } else {
-      _channel.send_pyobj(
-          py::module::import("traceback")
-              .attr("format_exception_only")(e.type(), e.value()));
+    try {
+      ret_val = func();
+      if (merging) {
+        globals = extract_func(py::globals());
+        _channel.send_pyobj(globals);
+        globals_sent = true;
+      }
+      _channel.send_pyobj(ret_val);
+    } catch (py::error_already_set &e) {
+      // send globals
+      if (merging && !globals_sent) {
+        globals = extract_func(py::globals());
+        _channel.send_pyobj(globals);
+        globals_sent = true;
+      }
+
+      // send exceptions to parent
+      send_exception(e.value(), e.type(), e.trace());
     }
+  } catch (const std::exception &e) {
+    // e.g. the result doesn't fit in the channel, or can't be pickled
+    // the parent is still waiting for the globals and a result, so it gets
+    // no globals and a `RuntimeError` instead
+    if (merging && !globals_sent)
+      _channel.send_pyobj(py::dict());
+    py::object type = py::reinterpret_borrow<py::object>(PyExc_RuntimeError);
+    send_exception(type(e.what()), type, py::object());
   }
 
   alive->store(false);
   std::exit(0);
 }
 
+void thread::send_exception(const py::object &value, const py::object &type,
+                            const py::object &trace) {
+  _channel.send_pyobj(value);
+  _channel.send_pyobj(type);
+
+  // send traceback
+  if (trace) {
+    _channel.send_pyobj(py::module::import("traceback")
+                            .attr("format_exception")(type, value, trace));
+  } else {
+    _channel.send_pyobj(py::module::import("traceback")
+                            .attr("format_exception_only")(type, value));
+  }
+}
+
 py::object thread::get_result() {
   if ((!started) || (!joined)) {
     throw std::runtime_error("result is not yet available");
@@ -172,8 +198,8 @@ py::object thread::get_result() {
     // handle exceptions
     static bool exc_received = false;
     if (!exc_received) {
-      exc_type = _channel.receive_pyobj(true);
-      exc_traceback = _channel.receive_pyobj(true);
+      exc_type = _channel.receive_pyobj_copy(true);
+      exc_traceback = _channel.receive_pyobj_copy(true);
       exc_traceback = py::str("").attr("join")(exc_traceback);
       exc_received = true;
     }
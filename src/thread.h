@@ -92,6 +92,19 @@ public:
    */
   void start();
 
+  /**
+   * \brief Run this thread on the CPUs of a NUMA node, and allocate its
+   * memory there. This is a no-op on systems with a single node.
+   *
+   * This only has an effect if it's called before `start()`.
+   *
+   * \param node The node. If negative, the node the calling process is
+   * running on.
+   *
+   * \throws std::invalid_argument If `node` is not a node of the system.
+   */
+  void set_numa_node(int node = -1);
+
   /**
    * \brief Join this thread.
    *
@@ -157,6 +170,13 @@ private:
    */
   void run();
 
+  /**
+   * \brief Send the exception `value` of type `type`, along with its
+   * formatted traceback `trace` (if not null), to the parent.
+   */
+  void send_exception(const py::object &value, const py::object &type,
+                      const py::object &trace);
+
   bool is_parent;
   pid_t child_pid;
   bool started;
@@ -171,7 +191,8 @@ private:
   py::object exc_type;
   py::object exc_traceback;
   channel _channel;
-  bool merging; // should globals be merged?
+  bool merging;  // should globals be merged?
+  int numa_node; // the node to run on, or -1
 };
 
 } // namespace snakefish
@@ -5,11 +5,32 @@
 #ifndef SNAKEFISH_UTIL_H
 #define SNAKEFISH_UTIL_H
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
+#include <ctime>
+#include <fstream>
 #include <new>
 #include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
+#include <fcntl.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
 
 namespace snakefish {
 
@@ -82,6 +103,430 @@ static inline void *get_shared_mem(const size_t len, const bool reserve) {
   }
 }
 
+/**
+ * \brief Create an anonymous shared memory object.
+ *
+ * On Linux, this is a `memfd`. On macOS, this is a POSIX shared memory object
+ * that is unlinked right away.
+ *
+ * \param len Initial size (in bytes) of the object.
+ *
+ * \returns A file descriptor referring to the object.
+ *
+ * \throws std::bad_alloc If the object could not be created.
+ */
+static inline int get_shared_fd(const size_t len) {
+#ifdef __APPLE__
+  std::string name = "/snakefish-" + std::to_string(getpid()) + "-" +
+                     std::to_string(get_random_uint());
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    perror("shm_open() failed");
+    throw std::bad_alloc();
+  }
+  if (shm_unlink(name.c_str())) {
+    perror("shm_unlink() failed");
+    close(fd);
+    throw std::bad_alloc();
+  }
+#else
+  int fd = memfd_create("snakefish", MFD_CLOEXEC);
+  if (fd == -1) {
+    perror("memfd_create() failed");
+    throw std::bad_alloc();
+  }
+#endif
+
+  if (ftruncate(fd, len)) {
+    perror("ftruncate() failed");
+    close(fd);
+    throw std::bad_alloc();
+  }
+  return fd;
+}
+
+/**
+ * \brief Use `mmap()` to reserve some address space without backing it with
+ * any memory.
+ *
+ * The reservation can't be accessed until something is mapped over it with
+ * `map_shared_fd()`.
+ *
+ * \param len Number of bytes to reserve.
+ *
+ * \returns Pointer to the start of the reservation.
+ *
+ * \throws std::bad_alloc If `mmap()` failed.
+ */
+static inline void *reserve_mem(const size_t len) {
+  void *mem = mmap(nullptr, len, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    perror("mmap() failed");
+    throw std::bad_alloc();
+  } else {
+    return mem;
+  }
+}
+
+/**
+ * \brief Map the first `len` bytes of the shared memory object `fd` at `addr`,
+ * replacing whatever was mapped there.
+ *
+ * \throws std::bad_alloc If `mmap()` failed.
+ */
+static inline void map_shared_fd(void *addr, const size_t len, const int fd) {
+  void *mem = mmap(addr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                   fd, 0);
+  if (mem == MAP_FAILED) {
+    perror("mmap() failed");
+    throw std::bad_alloc();
+  }
+}
+
+/**
+ * \brief Get the size of the default huge pages of the system.
+ *
+ * \returns The size in bytes, or 0 if the system doesn't support huge pages.
+ */
+static inline size_t get_huge_page_size() {
+  static size_t huge_page_size = []() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    size_t val = 0;
+    while (meminfo >> key) {
+      if (key == "Hugepagesize:" && meminfo >> val)
+        return val * 1024; // in kB
+    }
+    return static_cast<size_t>(0);
+  }();
+  return huge_page_size;
+}
+
+/**
+ * \brief Ask for the memory mapped at `addr` to be backed by transparent huge
+ * pages.
+ *
+ * This is only advice, so it is silently ignored if the system doesn't
+ * support it (or is configured not to for shared memory).
+ */
+static inline void advise_huge_pages(void *addr, const size_t len) {
+#ifdef MADV_HUGEPAGE
+  madvise(addr, len, MADV_HUGEPAGE);
+#else
+  (void)addr;
+  (void)len;
+#endif
+}
+
+/**
+ * \brief Hand the pages backing `len` bytes of the shared memory object `fd`
+ * at `offset` back to the system. They read as zeros afterwards.
+ *
+ * Both must be multiples of the page size. Unlike `madvise(MADV_DONTNEED)`,
+ * this frees the memory even though the object is still mapped (by any
+ * number of processes). This is only an optimization, so it is silently
+ * skipped where it isn't supported.
+ */
+static inline void release_pages(const int fd, const size_t offset,
+                                 const size_t len) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+  fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+#else
+  (void)fd;
+  (void)offset;
+  (void)len;
+#endif
+}
+
+/**
+ * \brief Fault in the memory mapped at `addr` for writing, so that later
+ * accesses don't take page faults.
+ *
+ * The contents are left untouched, so this is safe while other processes
+ * use the memory.
+ */
+static inline void prefault(void *addr, const size_t len) {
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(addr, len, MADV_POPULATE_WRITE) == 0)
+    return;
+#endif
+
+  // older kernels: adding 0 atomically writes to each page without changing
+  // what's there
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  char *begin = static_cast<char *>(addr);
+  for (char *p = begin; p < begin + len; p += page_size)
+    __atomic_fetch_add(p, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Parse a list of CPUs or NUMA nodes in the format of `/sys` (e.g.
+ * `0-3,8,10-11`).
+ */
+static inline std::vector<int> parse_id_list(const std::string &list) {
+  std::vector<int> ids;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    int first = 0, last = 0;
+    int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+    if (n < 1)
+      continue;
+    if (n == 1)
+      last = first;
+    for (int id = first; id <= last; id++)
+      ids.push_back(id);
+  }
+  return ids;
+}
+
+/**
+ * \brief Get the CPUs of each NUMA node of the system.
+ *
+ * \returns The CPUs of node `i` at index `i`. Systems without NUMA support
+ * have a single node, whose CPU list is empty.
+ */
+static inline const std::vector<std::vector<int>> &get_numa_nodes() {
+  static std::vector<std::vector<int>> nodes = []() {
+    std::vector<std::vector<int>> nodes;
+    std::string list;
+    std::ifstream online("/sys/devices/system/node/online");
+    if (std::getline(online, list)) {
+      for (int node : parse_id_list(list)) {
+        std::ifstream cpus("/sys/devices/system/node/node" +
+                           std::to_string(node) + "/cpulist");
+        std::string cpu_list;
+        std::getline(cpus, cpu_list);
+        if (static_cast<size_t>(node) >= nodes.size())
+          nodes.resize(node + 1);
+        nodes[node] = parse_id_list(cpu_list);
+      }
+    }
+    if (nodes.empty())
+      nodes.resize(1);
+    return nodes;
+  }();
+  return nodes;
+}
+
+/**
+ * \brief Check that `node` is a NUMA node of the system.
+ *
+ * \throws std::invalid_argument If it isn't.
+ */
+static inline void check_numa_node(const int node) {
+  if (node < 0 || static_cast<size_t>(node) >= get_numa_nodes().size()) {
+    throw std::invalid_argument("invalid NUMA node");
+  }
+}
+
+/**
+ * \brief Get the NUMA node the calling process is running on.
+ */
+static inline int get_numa_node() {
+  const std::vector<std::vector<int>> &nodes = get_numa_nodes();
+  if (nodes.size() == 1)
+    return 0;
+
+#ifdef __linux__
+  int cpu = sched_getcpu();
+  for (size_t node = 0; node < nodes.size(); node++) {
+    if (std::find(nodes[node].begin(), nodes[node].end(), cpu) !=
+        nodes[node].end())
+      return node;
+  }
+#endif
+  return 0;
+}
+
+/**
+ * \brief Ask for the memory mapped at `addr` to be allocated on NUMA node
+ * `node`, moving the pages that are already there if possible.
+ *
+ * The node is only preferred, so allocations still succeed when it runs out
+ * of memory. This is a no-op on systems with a single node.
+ */
+static inline void bind_to_numa_node(void *addr, const size_t len,
+                                     const int node) {
+  if (get_numa_nodes().size() == 1)
+    return;
+
+#ifdef __linux__
+  size_t bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(node / bits + 1, 0);
+  mask[node / bits] |= 1ul << (node % bits);
+  if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask.data(),
+              mask.size() * bits + 1, MPOL_MF_MOVE)) {
+    perror("mbind() failed");
+  }
+#else
+  (void)addr;
+  (void)len;
+#endif
+}
+
+/**
+ * \brief Run the calling process on the CPUs of NUMA node `node`, and
+ * allocate its memory there.
+ *
+ * This is a no-op on systems with a single node.
+ */
+static inline void run_on_numa_node(const int node) {
+  const std::vector<std::vector<int>> &nodes = get_numa_nodes();
+  if (nodes.size() == 1)
+    return;
+
+#ifdef __linux__
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (int cpu : nodes[node])
+    CPU_SET(cpu, &cpus);
+  if (CPU_COUNT(&cpus) > 0 && sched_setaffinity(0, sizeof(cpus), &cpus))
+    perror("sched_setaffinity() failed");
+
+  size_t bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(node / bits + 1, 0);
+  mask[node / bits] |= 1ul << (node % bits);
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(),
+              mask.size() * bits + 1)) {
+    perror("set_mempolicy() failed");
+  }
+#endif
+}
+
+/**
+ * \brief Get a monotonic timestamp in nanoseconds.
+ */
+static inline uint64_t get_time_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * \brief The maximum number of pauses between two checks in `spin_until()`.
+ */
+const unsigned MAX_SPIN_BACKOFF = 16;
+
+/**
+ * \brief Tell the CPU that this is a spin-wait loop.
+ */
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#else
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+/**
+ * \brief Spin until `cond()` holds, for at most `budget` checks.
+ *
+ * The number of pauses between two checks doubles each time (up to
+ * `MAX_SPIN_BACKOFF`). The budget adapts to how long waits actually are: it
+ * doubles (up to `max_spins`) when spinning succeeded, and halves (down to
+ * `max_spins / 8`) when it didn't, so that a waiter that keeps ending up in
+ * the kernel stops wasting time before it gets there.
+ *
+ * With a single CPU, the other side can't make progress while this spins, so
+ * this returns `false` right away.
+ *
+ * \param cond The condition to check.
+ * \param max_spins The maximum budget. If 0, this returns `false` right away.
+ * \param budget The current budget, which is updated.
+ *
+ * \returns `true` if `cond()` held. `false` if the budget ran out.
+ */
+template <typename F>
+static inline bool spin_until(F cond, const unsigned max_spins,
+                              unsigned &budget) {
+  static const bool multi_core = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+  if (max_spins == 0 || !multi_core)
+    return false;
+
+  unsigned backoff = 1;
+  for (unsigned i = 0; i < budget; i++) {
+    if (cond()) {
+      budget = std::min(max_spins, std::max(budget, i + 1) * 2);
+      return true;
+    }
+    for (unsigned j = 0; j < backoff; j++)
+      cpu_relax();
+    backoff = std::min(backoff * 2, MAX_SPIN_BACKOFF);
+  }
+
+  budget = std::max(budget / 2, std::max(max_spins / 8, 1u));
+  return false;
+}
+
+/**
+ * \brief Sleep until `*addr` is woken up by `wake_all()`, if it still holds
+ * `val`.
+ *
+ * On Linux, this is a (process-shared) futex wait. On macOS, which has no
+ * public equivalent, this polls `*addr`, sleeping a bit longer each time (up
+ * to 1 ms).
+ *
+ * This may return early (spuriously), so the caller should check `*addr`
+ * again.
+ *
+ * \param addr The word to wait on, in shared memory.
+ * \param val The value `*addr` is expected to hold.
+ * \param timeout Maximum number of seconds to wait. If negative, wait for as
+ * long as it takes.
+ *
+ * \throws std::runtime_error If `futex()` failed.
+ */
+static inline void wait_on(std::atomic_uint32_t *addr, const uint32_t val,
+                           const double timeout) {
+#ifdef __linux__
+  struct timespec ts;
+  struct timespec *ts_ptr = nullptr;
+  if (timeout >= 0) {
+    double secs = std::floor(timeout);
+    ts.tv_sec = static_cast<time_t>(secs);
+    ts.tv_nsec = static_cast<long>((timeout - secs) * 1e9);
+    ts_ptr = &ts;
+  }
+  if (syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT, val,
+              ts_ptr, nullptr, 0) &&
+      errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+    perror("futex() failed");
+    throw std::runtime_error("futex() failed");
+  }
+#else
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::duration<double>(std::max(timeout, 0.0));
+  unsigned delay_us = 1;
+  while (addr->load() == val) {
+    if (timeout >= 0 && std::chrono::steady_clock::now() >= deadline)
+      return;
+    usleep(delay_us);
+    delay_us = std::min(delay_us * 2, 1000u);
+  }
+#endif
+}
+
+/**
+ * \brief Wake up all processes sleeping in `wait_on(addr, ...)`.
+ *
+ * \throws std::runtime_error If `futex()` failed.
+ */
+static inline void wake_all(std::atomic_uint32_t *addr) {
+#ifdef __linux__
+  if (syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE,
+              INT32_MAX, nullptr, nullptr, 0) < 0) {
+    perror("futex() failed");
+    throw std::runtime_error("futex() failed");
+  }
+#else
+  (void)addr;
+#endif
+}
+
 } // namespace util
 
 } // namespace snakefish